@@ -0,0 +1,335 @@
+/*
+ * Micro-benchmarks of the animation hot paths on synthetic rigs and
+ * clips, so they run without any model or motion file.
+ *
+ * Usage: bench [results.json]
+ * Results go to the file, or to stdout, as JSON: one entry per benchmark
+ * and scale with the nanoseconds per operation (median and fastest of
+ * kRepeats batches) and a checksum of the first result. Rigs and clips
+ * come from a fixed seed, so checksums only change with the math.
+ */
+#include "bone_geometry.h"
+#include "procedure_geometry.h"
+#include "json.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace {
+	const int kBones[] = { 32, 128, 512, 1024 };
+	const int kKeyFrames[] = { 10, 100, 1000, 10000 };
+	const int kRepeats = 5;
+	const double kMinBatchNs = 20e6;        // a batch runs at least this long
+	const int kVerticesPerBone = 64;
+	const int kSamples = 4096;              // inputs of the scalar benchmarks
+	// JSON keeps the whole document in memory, larger clips are skipped
+	const size_t kJsonMaxQuats = size_t(1) << 18;
+	const char* const kJsonFile = "bench_animation.json";
+
+	// xorshift32: same sequence with every standard library
+	struct Random {
+		uint32_t state = 2463534242u;
+
+		uint32_t next()
+		{
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			return state;
+		}
+		float uniform(float lo, float hi)
+		{
+			return lo + (hi - lo) * (next() >> 8) * (1.0f / 16777216.0f);
+		}
+		glm::vec3 vec3(float lo, float hi)
+		{
+			float x = uniform(lo, hi), y = uniform(lo, hi);
+			return glm::vec3(x, y, uniform(lo, hi));
+		}
+		glm::fquat rotation(float max_angle)
+		{
+			glm::vec3 axis = vec3(-1.0f, 1.0f);
+			if (glm::length(axis) < 1e-3f)
+				axis = glm::vec3(0.0f, 1.0f, 0.0f);
+			return glm::angleAxis(uniform(-max_angle, max_angle), glm::normalize(axis));
+		}
+	};
+
+	/*
+	 * A spine of every eighth joint with chains of seven hanging off it,
+	 * roughly the depth and fan-out of a character rig.
+	 */
+	Skeleton make_rig(int nbones)
+	{
+		Skeleton skeleton;
+		for (int i = 0; i < nbones; i++) {
+			int parent = i == 0 ? -1 : (i % 8 == 0 ? i - 8 : i - 1);
+			glm::vec3 position = i % 8 == 0 ? glm::vec3(0.0f, i / 8, 0.0f)
+			                                : glm::vec3(i % 8, i / 8, 0.0f);
+			skeleton.joints.emplace_back(i, position, parent);
+		}
+		for (const Joint& joint : skeleton.joints)
+			if (joint.parent_index >= 0)
+				skeleton.joints[joint.parent_index].children.emplace_back(joint.joint_index);
+		return skeleton;
+	}
+
+	std::vector<KeyFrame> make_clip(int nbones, int nframes)
+	{
+		Random random;
+		std::vector<KeyFrame> clip(nframes);
+		for (KeyFrame& frame : clip) {
+			frame.rel_rot.resize(nbones);
+			for (glm::fquat& rot : frame.rel_rot)
+				rot = random.rotation(0.5f);
+			frame.camera_rel_orientation = random.rotation(0.5f);
+		}
+		return clip;
+	}
+
+	const int kJoints = SparseTuple::kMaxJoints;
+
+	// Blend weights as loadPmd leaves them, four joints per vertex
+	struct SkinnedVertices {
+		std::vector<glm::ivec4> joint_ids;
+		std::vector<glm::vec4> joint_weights;
+		std::vector<glm::vec3> from_joint[kJoints];
+	};
+
+	SkinnedVertices make_vertices(int nbones, int nvertices)
+	{
+		Random random;
+		SkinnedVertices v;
+		for (int i = 0; i < nvertices; i++) {
+			glm::ivec4 ids;
+			glm::vec4 weights;
+			for (int k = 0; k < kJoints; k++) {
+				ids[k] = random.next() % nbones;
+				weights[k] = random.uniform(0.0f, 1.0f);
+				v.from_joint[k].emplace_back(random.vec3(-0.5f, 0.5f));
+			}
+			v.joint_ids.emplace_back(ids);
+			v.joint_weights.emplace_back(weights / (weights.x + weights.y + weights.z + weights.w));
+		}
+		return v;
+	}
+
+	// What shaders/blending.vert computes per vertex, morphs left out
+	void skin(const SkinnedVertices& v, const Configuration& q, std::vector<glm::vec3>& out)
+	{
+		out.resize(v.joint_ids.size());
+		for (size_t i = 0; i < out.size(); i++) {
+			glm::vec3 position(0.0f);
+			for (int k = 0; k < kJoints; k++) {
+				int j = v.joint_ids[i][k];
+				position += v.joint_weights[i][k] * (q.rot[j] * v.from_joint[k][i] + q.trans[j]);
+			}
+			out[i] = position;
+		}
+	}
+
+	float checksum(const glm::fquat& q) { return q.w + q.x + q.y + q.z; }
+	float checksum(const glm::vec3& v) { return v.x + v.y + v.z; }
+	float checksum(const KeyFrame& frame)
+	{
+		float sum = 0.0f;
+		for (const glm::fquat& rot : frame.rel_rot)
+			sum += checksum(rot);
+		return sum;
+	}
+	float checksum(const Configuration& q)
+	{
+		float sum = 0.0f;
+		for (size_t i = 0; i < q.rot.size(); i++)
+			sum += checksum(q.rot[i]) + checksum(q.trans[i]);
+		return sum;
+	}
+
+	// The animation saver reports on std::cout, which may hold the results
+	class QuietCout {
+	public:
+		QuietCout() : buf_(std::cout.rdbuf(nullptr)) {}
+		~QuietCout()
+		{
+			std::cout.rdbuf(buf_);
+			std::cout.clear();
+		}
+	private:
+		std::streambuf* buf_;
+	};
+
+	json results = json::array();
+
+	/*
+	 * run: time op, which returns a checksum, in batches that double until
+	 * one takes kMinBatchNs, then kRepeats batches of that size. Only the
+	 * first call is checksummed, later ones depend on the iteration count.
+	 */
+	template<typename Op>
+	void run(const std::string& name, const json& params, Op op)
+	{
+		using clock = std::chrono::steady_clock;
+		auto time_batch = [&op](long iterations, float& sum) {
+			auto begin = clock::now();
+			for (long i = 0; i < iterations; i++)
+				sum += op();
+			return double(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - begin).count());
+		};
+		float first = op();
+		float sum = 0.0f;
+		long iterations = 1;
+		while (time_batch(iterations, sum) < kMinBatchNs)
+			iterations *= 2;
+		std::vector<double> ns_per_op;
+		for (int r = 0; r < kRepeats; r++)
+			ns_per_op.emplace_back(time_batch(iterations, sum) / iterations);
+		std::sort(ns_per_op.begin(), ns_per_op.end());
+
+		json result;
+		result["name"] = name;
+		result["params"] = params;
+		result["iterations"] = iterations;
+		result["ns_per_op"] = ns_per_op[kRepeats / 2];
+		result["ns_per_op_min"] = ns_per_op.front();
+		result["checksum"] = first;
+		results.push_back(result);
+		std::cerr << name << " " << params.dump() << ": " << ns_per_op[kRepeats / 2] << " ns" << std::endl;
+	}
+
+	void bench_skeleton(int nbones)
+	{
+		json params = { {"bones", nbones} };
+		Skeleton skeleton = make_rig(nbones);
+		std::vector<KeyFrame> clip = make_clip(nbones, 2);
+		int frame = 0;
+		run("Skeleton::transform_skeleton_by_frame", params, [&]() {
+			skeleton.transform_skeleton_by_frame(clip[frame++ % 2]);
+			return checksum(skeleton.joints.back().position);
+		});
+		skeleton.transform_skeleton_by_frame(clip[0]);
+		run("Skeleton::refreshCache", params, [&]() {
+			skeleton.refreshCache();
+			return checksum(skeleton.cache.trans.back());
+		});
+		Configuration q;
+		frame = 0;
+		run("Skeleton::evaluate", params, [&]() {
+			skeleton.evaluate(clip[frame++ % 2], q);
+			return checksum(q.trans.back());
+		});
+		KeyFrame target;
+		run("KeyFrame::interpolate", params, [&]() {
+			KeyFrame::interpolate(clip[0], clip[1], 0.25f, target);
+			return checksum(target.rel_rot.back());
+		});
+
+		SkinnedVertices vertices = make_vertices(nbones, nbones * kVerticesPerBone);
+		skeleton.transform_skeleton_by_frame(clip[0]);
+		skeleton.refreshCache(&q);
+		std::vector<glm::vec3> skinned;
+		json skin_params = { {"bones", nbones}, {"vertices", nbones * kVerticesPerBone} };
+		run("cpu_skinning", skin_params, [&]() {
+			skin(vertices, q, skinned);
+			return checksum(skinned.back());
+		});
+	}
+
+	void bench_clip(int nbones, int nframes)
+	{
+		json params = { {"bones", nbones}, {"key_frames", nframes} };
+		std::vector<KeyFrame> clip = make_clip(nbones, nframes);
+		float t = 0.0f;
+		float step = (nframes - 1) / 7.0f;      // visits the whole clip, never a key frame
+		KeyFrame target;
+		run("KeyFrame::interpolate_frame_spline", params, [&]() {
+			target.rel_rot.clear();         // appended to, keeps its capacity
+			t = std::fmod(t + step, float(nframes - 1));
+			KeyFrame::interpolate_frame_spline(clip, t, target);
+			return checksum(target.rel_rot.back());
+		});
+
+		if (size_t(nbones) * nframes > kJsonMaxQuats)
+			return;
+		Mesh mesh;
+		mesh.key_frames = clip;
+		QuietCout quiet;
+		run("Mesh::saveAnimationTo", params, [&]() {
+			mesh.saveAnimationTo(kJsonFile);
+			return float(mesh.key_frames.size());
+		});
+		run("Mesh::loadAnimationFrom", params, [&]() {
+			mesh.loadAnimationFrom(kJsonFile);
+			return checksum(mesh.key_frames.back());
+		});
+		std::remove(kJsonFile);
+	}
+
+	void bench_scalar()
+	{
+		Random random;
+		json params = { {"samples", kSamples} };
+		std::vector<glm::fquat> quats;
+		for (int i = 0; i < kSamples + 3; i++)
+			quats.emplace_back(random.rotation(1.0f));
+		int i = 0;
+		run("my_squad", params, [&]() {
+			int k = i++ % kSamples;
+			return checksum(my_squad(quats[k], quats[k + 1], quats[k + 2], quats[k + 3], 0.3f));
+		});
+
+		std::vector<glm::vec3> points;
+		for (int k = 0; k < kSamples + 3; k++)
+			points.emplace_back(random.vec3(-10.0f, 10.0f));
+		i = 0;
+		run("line_segment_distance", params, [&]() {
+			int k = i++ % kSamples;
+			return line_segment_distance(points[k], points[k + 1], points[k + 2], points[k + 3]);
+		});
+		float start_x[4], start_y[4], start_z[4], end_x[4], end_y[4], end_z[4];
+		for (int lane = 0; lane < 4; lane++) {
+			glm::vec3 s = random.vec3(-10.0f, 10.0f), e = random.vec3(-10.0f, 10.0f);
+			start_x[lane] = s.x; start_y[lane] = s.y; start_z[lane] = s.z;
+			end_x[lane] = e.x; end_y[lane] = e.y; end_z[lane] = e.z;
+		}
+		i = 0;
+		run("line_segment_distance4", params, [&]() {
+			int k = i++ % kSamples;
+			float distances[4];
+			line_segment_distance4(points[k], points[k + 1],
+			                       start_x, start_y, start_z, end_x, end_y, end_z,
+			                       distances);
+			return distances[0] + distances[1] + distances[2] + distances[3];
+		});
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	for (int nbones : kBones)
+		bench_skeleton(nbones);
+	for (int nbones : kBones)
+		for (int nframes : kKeyFrames)
+			bench_clip(nbones, nframes);
+	bench_scalar();
+
+	json report;
+	report["benchmarks"] = results;
+	std::string text = report.dump(2);
+	if (argc < 2) {
+		std::cout << text << std::endl;
+		return 0;
+	}
+	std::ofstream out(argv[1]);
+	if (!out) {
+		std::cerr << "Cannot write " << argv[1] << std::endl;
+		return -1;
+	}
+	out << text << std::endl;
+	return 0;
+}
@@ -0,0 +1,7 @@
+# PROFILE_ZONE and friends compile to nothing when this is OFF
+OPTION(ENABLE_PROFILER "Build the frame profiler instrumentation" ON)
+# Targets opt in with TARGET_COMPILE_DEFINITIONS, so the benchmarks can leave the zones out
+SET(profiler_definitions "")
+IF (ENABLE_PROFILER)
+	SET(profiler_definitions ENABLE_PROFILER)
+ENDIF ()
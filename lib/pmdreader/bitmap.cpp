@@ -2,100 +2,253 @@
 // bitmap.cpp
 //
 // handle MS bitmap I/O. For portability, we don't use the data structure defined in Windows.h
-// However, there is some strange thing, the side of our structure is different from what it 
-// should though we define it in the same way as MS did. So, there is a hack, we use the hardcoded
-// constanr, 14, instead of the sizeof to calculate the size of the structure.
-// You are not supposed to worry about this part. However, I will appreciate if you find out the
-// reason and let me know. Thanks.
+// The headers are copied field by field out of the mapped file, because the
+// packed file layout (14 byte file header) differs from the padded structs.
 //
 
 #include "bitmap.h"
 #include "image.h"
- 
-BMP_BITMAPFILEHEADER bmfh; 
-BMP_BITMAPINFOHEADER bmih; 
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-bool readBMP(const char *fname, Image& image)
-{ 
-	FILE* file; 
-	BMP_DWORD pos; 
- 
-	if ( (file=fopen( fname, "rb" )) == NULL )  
-		return false; 
-	 
-//	I am doing fread( &bmfh, sizeof(BMP_BITMAPFILEHEADER), 1, file ) in a safe way. :}
-	auto ret = fread( &(bmfh.bfType), 2, 1, file); 
-	ret += fread( &(bmfh.bfSize), 4, 1, file); 
-	ret += fread( &(bmfh.bfReserved1), 2, 1, file); 
-	ret += fread( &(bmfh.bfReserved2), 2, 1, file); 
-	ret += fread( &(bmfh.bfOffBits), 4, 1, file); 
-
-	pos = bmfh.bfOffBits; 
- 
-	ret += fread( &bmih, sizeof(BMP_BITMAPINFOHEADER), 1, file ); 
-
-	if (ret == 0)
-		return false;
- 
-	// error checking
-	if ( bmfh.bfType!= 0x4d42 ) {	// "BM" actually
-		return false;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BMP_X86_SIMD
+#include <tmmintrin.h>
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+namespace {
+	const size_t kFileHeaderSize = 14;
+
+	template<typename T>
+	const unsigned char* read_field(const unsigned char* p, T& field)
+	{
+		memcpy(&field, p, sizeof(T));
+		return p + sizeof(T);
 	}
-	if ( bmih.biBitCount != 24 )  
-		return false; 
-/*
- 	if ( bmih.biCompression != BMP_BI_RGB ) {
-		return NULL;
+
+	void bgr_to_rgb_scalar(const unsigned char* in, unsigned char* out, int n)
+	{
+		for (int i = 0; i < n; i++, in += 3, out += 3) {
+			unsigned char b = in[0];
+			out[0] = in[2];
+			out[1] = in[1];
+			out[2] = b;
+		}
 	}
-*/
-	fseek( file, pos, SEEK_SET ); 
- 
-	int width = image.width = bmih.biWidth; 
-	int height = image.height = bmih.biHeight; 
- 
-	int padWidth = width * 3; 
-	int pad = 0; 
-	if ( padWidth % 4 != 0 ) { 
-		pad = 4 - (padWidth % 4); 
-		padWidth += pad; 
-	} 
-	int bytes = height*padWidth; 
-	image.stride = padWidth;
- 
-	image.bytes.resize(bytes);
-	unsigned char *data = image.bytes.data();
-
-	int foo = fread( data, bytes, 1, file ); 
-	
-	if (!foo) {
-		return false;
+
+	void bgrx_to_rgb_scalar(const unsigned char* in, unsigned char* out, int n)
+	{
+		for (int i = 0; i < n; i++, in += 4, out += 3) {
+			out[0] = in[2];
+			out[1] = in[1];
+			out[2] = in[0];
+		}
 	}
 
-	fclose( file );
-	
-	// shuffle bitmap data such that it is (R,G,B) tuples in row-major order
-	int i, j;
-	j = 0;
-	unsigned char temp;
-	unsigned char* in;
-	unsigned char* out;
+#ifdef BMP_X86_SIMD
+	/*
+	 * 16 byte loads and stores reach a little past the pixels they
+	 * convert, so the loops leave at least 6 pixels of the row (which
+	 * rgb rows always have after them too) to the scalar tail.
+	 */
+	__attribute__((target("ssse3")))
+	void bgr_to_rgb_ssse3(const unsigned char* in, unsigned char* out, int n)
+	{
+		const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6,
+		                                      11, 10, 9, 14, 13, 12, 15);
+		int i = 0;
+		for (; i + 6 <= n; i += 5, in += 15, out += 15) {
+			__m128i v = _mm_loadu_si128((const __m128i*)in);
+			_mm_storeu_si128((__m128i*)out, _mm_shuffle_epi8(v, shuffle));
+		}
+		bgr_to_rgb_scalar(in, out, n - i);
+	}
 
-	in = data;
-	out = data;
+	__attribute__((target("ssse3")))
+	void bgrx_to_rgb_ssse3(const unsigned char* in, unsigned char* out, int n)
+	{
+		const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+		                                      14, 13, 12, -1, -1, -1, -1);
+		int i = 0;
+		for (; i + 6 <= n; i += 4, in += 16, out += 12) {
+			__m128i v = _mm_loadu_si128((const __m128i*)in);
+			_mm_storeu_si128((__m128i*)out, _mm_shuffle_epi8(v, shuffle));
+		}
+		bgrx_to_rgb_scalar(in, out, n - i);
+	}
 
-	for ( j = 0; j < height; ++j )
+	bool has_ssse3()
 	{
-		for ( i = 0; i < width; ++i )
-		{
-			out[1] = in[1];
-			temp = in[2];
-			out[2] = in[0];
-			out[0] = temp;
+		static const bool supported = __builtin_cpu_supports("ssse3");
+		return supported;
+	}
+#endif
 
-			in += 3;
-			out += 3;
+	void bgr_to_rgb(const unsigned char* in, unsigned char* out, int n)
+	{
+#if defined(BMP_X86_SIMD)
+		if (has_ssse3())
+			return bgr_to_rgb_ssse3(in, out, n);
+#elif defined(__ARM_NEON)
+		int i = 0;
+		for (; i + 16 <= n; i += 16, in += 48, out += 48) {
+			uint8x16x3_t v = vld3q_u8(in);
+			uint8x16_t b = v.val[0];
+			v.val[0] = v.val[2];
+			v.val[2] = b;
+			vst3q_u8(out, v);
 		}
-		in += pad;
+		n -= i;
+#endif
+		bgr_to_rgb_scalar(in, out, n);
+	}
+
+	void bgrx_to_rgb(const unsigned char* in, unsigned char* out, int n)
+	{
+#if defined(BMP_X86_SIMD)
+		if (has_ssse3())
+			return bgrx_to_rgb_ssse3(in, out, n);
+#elif defined(__ARM_NEON)
+		int i = 0;
+		for (; i + 16 <= n; i += 16, in += 64, out += 48) {
+			uint8x16x4_t v = vld4q_u8(in);
+			uint8x16x3_t rgb = {{ v.val[2], v.val[1], v.val[0] }};
+			vst3q_u8(out, rgb);
+		}
+		n -= i;
+#endif
+		bgrx_to_rgb_scalar(in, out, n);
+	}
+}
+
+bool parseBMP(const unsigned char* data, size_t size, BMPInfo& bmp)
+{
+	if (size < kFileHeaderSize + 40)
+		return false;
+	BMP_BITMAPFILEHEADER& bmfh = bmp.file;
+	BMP_BITMAPINFOHEADER& bmih = bmp.info;
+	const unsigned char* p = data;
+	p = read_field(p, bmfh.bfType);
+	p = read_field(p, bmfh.bfSize);
+	p = read_field(p, bmfh.bfReserved1);
+	p = read_field(p, bmfh.bfReserved2);
+	p = read_field(p, bmfh.bfOffBits);
+	p = read_field(p, bmih.biSize);
+	p = read_field(p, bmih.biWidth);
+	p = read_field(p, bmih.biHeight);
+	p = read_field(p, bmih.biPlanes);
+	p = read_field(p, bmih.biBitCount);
+	p = read_field(p, bmih.biCompression);
+	p = read_field(p, bmih.biSizeImage);
+	p = read_field(p, bmih.biXPelsPerMeter);
+	p = read_field(p, bmih.biYPelsPerMeter);
+	p = read_field(p, bmih.biClrUsed);
+	p = read_field(p, bmih.biClrImportant);
+
+	// error checking
+	if (bmfh.bfType != 0x4d42)	// "BM" actually
+		return false;
+	if (bmih.biSize < 40 || kFileHeaderSize + bmih.biSize > size)
+		return false;
+	int bits = bmih.biBitCount;
+	if (bits != 8 && bits != 24 && bits != 32)
+		return false;
+	if (bmih.biCompression != BMP_BI_RGB) {
+		// Only the default BGRX masks
+		if (bits != 32 || bmih.biCompression != BMP_BI_BITFIELDS)
+			return false;
+		BMP_DWORD masks[3];
+		const unsigned char* mp = data + kFileHeaderSize + 40;
+		if (mp + sizeof(masks) > data + size)
+			return false;
+		memcpy(masks, mp, sizeof(masks));
+		if (masks[0] != 0x00FF0000 || masks[1] != 0x0000FF00 || masks[2] != 0x000000FF)
+			return false;
+	}
+	if (bmih.biWidth <= 0 || bmih.biHeight == 0 || bmih.biHeight == BMP_LONG(0x80000000))
+		return false;
+	bmp.width = bmih.biWidth;
+	bmp.top_down = bmih.biHeight < 0;
+	bmp.height = bmp.top_down ? -bmih.biHeight : bmih.biHeight;
+	if (bmp.width > 65536 || bmp.height > 65536)
+		return false;
+	bmp.row_bytes = (size_t(bmp.width) * bits + 31) / 32 * 4;
+	if (bmfh.bfOffBits > size || bmp.row_bytes * bmp.height > size - bmfh.bfOffBits)
+		return false;
+	bmp.pixels = data + bmfh.bfOffBits;
+
+	bmp.palette = nullptr;
+	bmp.palette_size = 0;
+	if (bits == 8) {
+		bmp.palette_size = bmih.biClrUsed ? int(bmih.biClrUsed) : 256;
+		size_t palette_offset = kFileHeaderSize + bmih.biSize;
+		if (bmp.palette_size > 256 ||
+		    palette_offset + size_t(bmp.palette_size) * 4 > bmfh.bfOffBits)
+			return false;
+		bmp.palette = data + palette_offset;
 	}
 	return true;
-} 
+}
+
+void decodeBMP(const BMPInfo& bmp, unsigned char* rgb)
+{
+	size_t out_row = size_t(bmp.width) * 3;
+	for (int y = 0; y < bmp.height; y++) {
+		// Bottom row first
+		int src_y = bmp.top_down ? bmp.height - 1 - y : y;
+		const unsigned char* in = bmp.pixels + src_y * bmp.row_bytes;
+		unsigned char* out = rgb + y * out_row;
+		switch (bmp.info.biBitCount) {
+		case 8:
+			for (int x = 0; x < bmp.width; x++, out += 3) {
+				int index = in[x] < bmp.palette_size ? in[x] : 0;
+				const unsigned char* entry = bmp.palette + index * 4;
+				out[0] = entry[2];
+				out[1] = entry[1];
+				out[2] = entry[0];
+			}
+			break;
+		case 24:
+			bgr_to_rgb(in, out, bmp.width);
+			break;
+		case 32:
+			bgrx_to_rgb(in, out, bmp.width);
+			break;
+		}
+	}
+}
+
+bool readBMP(const char *fname, Image& image)
+{
+	int fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		close(fd);
+		return false;
+	}
+	size_t size = size_t(st.st_size);
+	void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+
+	BMPInfo bmp;
+	bool ok = parseBMP((const unsigned char*)data, size, bmp);
+	if (ok) {
+		image.width = bmp.width;
+		image.height = bmp.height;
+		image.stride = bmp.width * 3;
+		image.bytes.resize(size_t(image.stride) * image.height);
+		decodeBMP(bmp, image.bytes.data());
+	}
+	munmap(data, size);
+	return ok;
+}
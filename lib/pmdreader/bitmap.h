@@ -8,10 +8,10 @@
 #ifndef BITMAP_H
 #define BITMAP_H
 
-#include <stdio.h>
-#include <string.h>
+#include <stddef.h>
 
 #define BMP_BI_RGB        0L
+#define BMP_BI_BITFIELDS  3L
 
 typedef unsigned short	BMP_WORD; 
 typedef unsigned int	BMP_DWORD; 
@@ -39,10 +39,36 @@ typedef struct {
 	BMP_DWORD	biClrImportant; 
 } BMP_BITMAPINFOHEADER; 
 
+/*
+ * A validated bitmap in memory. Everything points into the caller's data.
+ */
+struct BMPInfo {
+	BMP_BITMAPFILEHEADER file;
+	BMP_BITMAPINFOHEADER info;
+	int width;
+	int height;                     // always positive
+	bool top_down;                  // negative biHeight
+	size_t row_bytes;               // stored row size, padded to 4 bytes
+	const unsigned char* pixels;
+	const unsigned char* palette;   // BGRX entries for 8 bit images
+	int palette_size;
+};
+
 struct Image;
+
+/*
+ * parseBMP: check the headers of an uncompressed 8, 24 or 32 bit bitmap
+ * of size bytes and fill info. Reentrant.
+ */
+bool parseBMP(const unsigned char* data, size_t size, BMPInfo& info);
+/*
+ * decodeBMP: write info.width x info.height RGB pixels to rgb, rows
+ * packed and bottom row first (GL order).
+ */
+void decodeBMP(const BMPInfo& info, unsigned char* rgb);
+
 // global I/O routines
+// readBMP: map the file and decode it into image. Reentrant.
 extern bool readBMP(const char *fname, Image& image);
-//int& width, int& height, void* data_ptr);
 
 #endif
-
@@ -86,6 +86,8 @@ namespace mmd {
 #include "model/model.inl"
 #include "motion/motion.inl"
 
+#include "scene/camera.inl"
+
 namespace mmd {
     class MMD {
     public:
@@ -99,8 +101,12 @@ namespace mmd {
 
 #include "reader/model_reader.inl"
 #include "reader/motion_reader.inl"
+#include "reader/camera_motion_reader.inl"
+#include "reader/light_motion_reader.inl"
 
 #include "reader/pmd_reader.inl"
+#include "reader/pmx_reader.inl"
+#include "reader/vmd_reader.inl"
 
 namespace mmd {
 #include "mmd_facility_impl.inl"
@@ -60,6 +60,7 @@ namespace mmd {
 
         const CameraKeyframe &GetCameraKeyframe(size_t frame) const;
         CameraKeyframe &GetCameraKeyframe(size_t frame);
+        const std::map<size_t, CameraKeyframe> &GetCameraKeyframes() const;
 
         CameraPose GetCameraPose(size_t frame) const;
         CameraPose GetCameraPose(double time) const;
@@ -72,6 +72,11 @@ CameraMotion::GetCameraKeyframe(size_t frame) {
     return camera_motions_[frame];
 }
 
+inline const std::map<size_t, CameraMotion::CameraKeyframe>&
+CameraMotion::GetCameraKeyframes() const {
+    return camera_motions_;
+}
+
 //inline CameraPose CameraMotion::GetCameraPose(size_t frame) const;
 //inline CameraPose CameraMotion::GetCameraPose(double time) const;
 
@@ -229,6 +229,11 @@ inline std::wstring ShiftJISToUTF16String(const std::string &s) {
     size_t to_length = s.size()*4+1;
     iconv(cd, &from_ptr, &from_length, &to_ptr, &to_length);
     iconv_close(cd);
-    return std::wstring((std::uint16_t*)&to_buffer[0], (std::uint16_t*)&to_buffer[s.size()*4-to_length+1]);
+    std::wstring ws((std::uint16_t*)&to_buffer[0], (std::uint16_t*)&to_buffer[s.size()*4-to_length+1]);
+    // "UTF-16" starts with a byte order mark, which PMX names do not have
+    if(!ws.empty() && ws[0]==0xFEFF) {
+        ws.erase(0, 1);
+    }
+    return ws;
 #endif
 }
@@ -9,10 +9,24 @@
 #include <iostream>
 #include <exception>
 #include <unordered_map>
+#include <algorithm>
+#include <iterator>
+#include <cctype>
+#include <cstring>
+#include <jpegio.h>
+#include <job_system.h>
 
 using std::endl;
 
 namespace {
+	bool has_extension(const std::string& fn, const std::string& ext)
+	{
+		if (fn.size() < ext.size())
+			return false;
+		return std::equal(ext.begin(), ext.end(), fn.end() - ext.size(),
+		                  [](char lhs, char rhs) { return lhs == std::tolower((unsigned char)rhs); });
+	}
+
 	glm::vec4 conv(const mmd::Vector4f& rhs)
 	{
 		glm::vec4 lhs;
@@ -37,6 +51,10 @@ namespace {
 		lhs[1] = rhs.v[1];
 		return lhs;
 	}
+	glm::fquat conv_quat(const mmd::Vector4f& rhs)
+	{
+		return glm::fquat(rhs.v[3], rhs.v[0], rhs.v[1], rhs.v[2]);
+	}
 	glm::uvec3 conv(const mmd::Vector3D<std::uint32_t>& rhs)
 	{
 		glm::uvec3 lhs;
@@ -45,6 +63,62 @@ namespace {
 		lhs[2] = rhs.v[2];
 		return lhs;
 	}
+
+	/*
+	 * Names are stored as UTF-16 code units, whatever the size of wchar_t.
+	 * UTF16ToNativeString depends on the locale, so convert by hand.
+	 */
+	std::string utf16_to_utf8(const std::wstring& ws)
+	{
+		std::string ret;
+		for (size_t i = 0; i < ws.size(); i++) {
+			uint32_t c = uint32_t(ws[i]) & 0xFFFF;
+			if (c >= 0xD800 && c < 0xDC00 && i + 1 < ws.size()) {
+				uint32_t low = uint32_t(ws[i + 1]) & 0xFFFF;
+				if (low >= 0xDC00 && low < 0xE000) {
+					c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+					i++;
+				}
+			}
+			if (c < 0x80) {
+				ret += char(c);
+			} else if (c < 0x800) {
+				ret += char(0xC0 | (c >> 6));
+				ret += char(0x80 | (c & 0x3F));
+			} else if (c < 0x10000) {
+				ret += char(0xE0 | (c >> 12));
+				ret += char(0x80 | ((c >> 6) & 0x3F));
+				ret += char(0x80 | (c & 0x3F));
+			} else {
+				ret += char(0xF0 | (c >> 18));
+				ret += char(0x80 | ((c >> 12) & 0x3F));
+				ret += char(0x80 | ((c >> 6) & 0x3F));
+				ret += char(0x80 | (c & 0x3F));
+			}
+		}
+		return ret;
+	}
+
+	std::wstring utf8_to_utf16(const std::string& s)
+	{
+		std::wstring ret;
+		for (size_t i = 0; i < s.size(); ) {
+			unsigned char lead = s[i];
+			int extra = lead < 0x80 ? 0 : lead < 0xE0 ? 1 : lead < 0xF0 ? 2 : 3;
+			uint32_t c = extra == 0 ? lead : lead & (0x3F >> extra);
+			for (int k = 1; k <= extra && i + k < s.size(); k++)
+				c = (c << 6) | (s[i + k] & 0x3F);
+			i += extra + 1;
+			if (c >= 0x10000) {
+				c -= 0x10000;
+				ret += wchar_t(0xD800 + (c >> 10));
+				ret += wchar_t(0xDC00 + (c & 0x3FF));
+			} else {
+				ret += wchar_t(c);
+			}
+		}
+		return ret;
+	}
 };
 
 class MMDAdapter {
@@ -61,7 +135,13 @@ class MMDAdapter {
 	}
 public:
 	MMDAdapter()
+		: image_loader_(readImage)
+	{
+	}
+
+	void setImageLoader(MMDReader::ImageLoader loader)
 	{
+		image_loader_ = loader;
 	}
 
 	~MMDAdapter()
@@ -72,8 +152,18 @@ public:
 	{
 		try {
 			mmd::FileReader file(fn);
-			mmd::PmdReader reader(file);
-			reader.ReadModel(model_);
+			// The signature decides the format, whatever the extension
+			const auto& buffer = file.GetBuffer();
+			if (buffer.size() >= 4 && memcmp(&buffer[0], "PMX ", 4) == 0) {
+				mmd::PmxReader reader(file);
+				reader.ReadModel(model_);
+				is_pmx_ = true;
+			} else {
+				mmd::PmdReader reader(file);
+				reader.ReadModel(model_);
+			}
+			size_t slash = fn.find_last_of("/\\");
+			model_dir_ = slash == std::string::npos ? "" : fn.substr(0, slash + 1);
 
 			size_t useful_bone_id = 0;
 			for (size_t i = 0; i < model_.GetBoneNum(); i++) {
@@ -119,7 +209,6 @@ public:
 
 	void getMaterial(std::vector<Material>& vm)
 	{
-		std::map<std::string, std::shared_ptr<Image>> loaded_tex;
 		vm.resize(model_.GetPartNum());
 		for (size_t i = 0; i < vm.size(); i++) {
 			const auto& part = model_.GetPart(i);
@@ -130,32 +219,34 @@ public:
 			vm[i].shininess = material.GetShininess();
 			vm[i].offset = part.GetBaseShift();
 			vm[i].nfaces = part.GetTriangleNum();
-			const mmd::Texture* tex = material.GetTexture();
+		}
+		std::vector<int> material_tex;
+		std::vector<std::string> tex_files;
+		getTextureFiles(material_tex, tex_files);
+		auto images = loadImages(tex_files, image_loader_);
+		for (size_t i = 0; i < vm.size(); i++)
+			if (material_tex[i] >= 0)
+				vm[i].texture = images[material_tex[i]];
+	}
+
+	void getTextureFiles(std::vector<int>& material_tex, std::vector<std::string>& tex_files)
+	{
+		std::map<std::string, int> tex_index;
+		tex_files.clear();
+		material_tex.assign(model_.GetPartNum(), -1);
+		for (size_t i = 0; i < material_tex.size(); i++) {
+			const mmd::Texture* tex = model_.GetPart(i).GetMaterial().GetTexture();
 			if (!tex)
 				continue;
 			std::string texfn = mmd::UTF16ToNativeString(tex->GetTexturePath());
+			// "diffuse.bmp*sphere.spa": sphere maps are not used
+			texfn = resolveTexturePath(texfn.substr(0, texfn.find('*')));
 			if (texfn.empty())
 				continue;
-			auto iter = loaded_tex.find(texfn);
-			if (iter != loaded_tex.end()) {
-				vm[i].texture = iter->second;
-				continue;
-			}
-			auto image = std::make_shared<Image>();
-			std::cerr << __func__ << " is trying to load texture " << texfn << std::endl;
-			if (!readBMP(texfn.data(), *image))
-				continue;
-			std::cerr << __func__ << " successfully loaded texture " << texfn << std::endl;
-#if 0
-			std::cerr << "\t\ttesting RGB ";
-			for (int i = 0; i < 64; i++)
-				std::cerr << int(image->bytes[i]) << ' ';
-			std::cerr << std::endl;
-			//std::cerr << "\t\ttesting RGB " << int(image->bytes[0]) << ' ' << int(image->bytes[1]) << ' ' << int(image->bytes[2]) << ' ' << std::endl;
-			//std::cerr << "\t\ttesting RGB " << int(image->bytes[256]) << ' ' << int(image->bytes[257]) << ' ' << int(image->bytes[258]) << ' ' << std::endl;
-#endif
-			loaded_tex[texfn] = image;
-			vm[i].texture = image;
+			auto iter = tex_index.emplace(texfn, int(tex_files.size()));
+			if (iter.second)
+				tex_files.emplace_back(texfn);
+			material_tex[i] = iter.first->second;
 		}
 	}
 
@@ -191,6 +282,97 @@ public:
 		return true;
 	}
 
+	std::string getJointName(int useful_bone_id)
+	{
+		auto iter = useful_bone_to_pmd_bone_.find(useful_bone_id);
+		if (iter == useful_bone_to_pmd_bone_.end())
+			return std::string();
+		return utf16_to_utf8(model_.GetBone(iter->second).GetName());
+	}
+
+	void getMorphs(std::vector<MorphTarget>& morphs)
+	{
+		typedef mmd::Model::Morph Morph;
+		morphs.clear();
+		for (size_t i = 0; i < model_.GetMorphNum(); i++) {
+			const Morph& morph = model_.GetMorph(i);
+			if (morph.GetType() != Morph::MORPH_TYPE_VERTEX &&
+			    morph.GetType() != Morph::MORPH_TYPE_GROUP)
+				continue;
+			// PMD's base morph holds absolute positions
+			if (!is_pmx_ && morph.GetCategory() == Morph::MORPH_CAT_SYSTEM)
+				continue;
+			std::map<int, glm::vec3> offsets;
+			addVertexOffsets(i, 1.0f, offsets, 0);
+			if (offsets.empty())
+				continue;
+			MorphTarget target;
+			target.name = utf16_to_utf8(morph.GetName());
+			for (const auto& entry : offsets) {
+				target.vertices.emplace_back(entry.first);
+				target.offsets.emplace_back(entry.second);
+			}
+			morphs.emplace_back(std::move(target));
+		}
+	}
+
+	void getIKChains(std::vector<IKChain>& chains)
+	{
+		chains.clear();
+		for (size_t i = 0; i < model_.GetBoneNum(); i++) {
+			const auto& bone = model_.GetBone(i);
+			if (!bone.IsHasIK() || bone.GetIKLinkNum() == 0)
+				continue;
+			IKChain chain;
+			chain.name = utf16_to_utf8(bone.GetName());
+			chain.effector = usefulBone(bone.GetIKTargetIndex());
+			chain.iterations = int(bone.GetCCDIterateLimit());
+			chain.max_angle = bone.GetCCDAngleLimit();
+			bool ok = chain.effector >= 0;
+			for (size_t j = 0; ok && j < bone.GetIKLinkNum(); j++) {
+				const auto& link = bone.GetIKLink(j);
+				IKLink ik_link;
+				ik_link.joint = usefulBone(link.GetLinkIndex());
+				ik_link.limited = link.IsHasLimit();
+				ik_link.lo = glm::vec3(conv(link.GetLoLimit()));
+				ik_link.hi = glm::vec3(conv(link.GetHiLimit()));
+				ok = ik_link.joint >= 0;
+				chain.links.emplace_back(ik_link);
+			}
+			if (ok)
+				chains.emplace_back(std::move(chain));
+		}
+	}
+
+	void addVertexOffsets(size_t morph_id, float rate, std::map<int, glm::vec3>& offsets, int depth)
+	{
+		typedef mmd::Model::Morph Morph;
+		const Morph& morph = model_.GetMorph(morph_id);
+		size_t nv = model_.GetVertexNum();
+		for (size_t j = 0; j < morph.GetMorphDataNum(); j++) {
+			const auto& data = morph.GetMorphData(j);
+			if (morph.GetType() == Morph::MORPH_TYPE_VERTEX) {
+				const auto& vertex_morph = data.GetVertexMorph();
+				if (vertex_morph.GetVertexIndex() >= nv)
+					continue;
+				offsets[int(vertex_morph.GetVertexIndex())] +=
+					rate * glm::vec3(conv(vertex_morph.GetOffset()));
+			} else if (morph.GetType() == Morph::MORPH_TYPE_GROUP && depth < 4) {
+				// Groups may nest, but not forever
+				const auto& group = data.GetGroupMorph();
+				if (group.GetMorphIndex() < model_.GetMorphNum())
+					addVertexOffsets(group.GetMorphIndex(), rate * group.GetMorphRate(),
+					                 offsets, depth + 1);
+			}
+		}
+	}
+
+	/*
+	 * Every vertex gets exactly one tuple so they line up with the
+	 * vertices. Mesh skins with two bones: BDEF4 keeps its two heaviest
+	 * bones with their weights renormalized, and SDEF is blended like
+	 * BDEF2. Vertices without a bone in the tree follow joint 0.
+	 */
 	void getJointWeights(std::vector<SparseTuple>& tup)
 	{
 		constexpr int SKINNING_BDEF1 = mmd::Model::SkinningOperator::SKINNING_BDEF1;
@@ -199,57 +381,172 @@ public:
 		constexpr int SKINNING_SDEF = mmd::Model::SkinningOperator::SKINNING_SDEF;
 		size_t nv = model_.GetVertexNum();
 		tup.clear();
-		tup.reserve(nv * 2);
+		tup.reserve(nv);
 		for (size_t i = 0; i < nv; i++) {
-			const auto& v = model_.GetVertex(i);
-			int skt = v.GetSkinningOperator().GetSkinningType();
-
-			switch (skt) {
+			const auto& op = model_.GetVertex(i).GetSkinningOperator();
+			size_t bones[4];
+			float weights[4];
+			int n = 0;
+			switch (op.GetSkinningType()) {
 				case SKINNING_BDEF1:
-					{
-						const auto& bdef1 = v.GetSkinningOperator().GetBDEF1();
-						auto bid = pmd_bone_to_useful_bone_[bdef1.GetBoneID()];
-						if (bid >= 0)
-							tup.emplace_back(i, bid, -1, 1.0f);
-					}
+					bones[0] = op.GetBDEF1().GetBoneID();
+					weights[0] = 1.0f;
+					n = 1;
 					break;
 				case SKINNING_BDEF2:
-					{
-						const auto& bdef2 = v.GetSkinningOperator().GetBDEF2();
-						auto bid0 = pmd_bone_to_useful_bone_[bdef2.GetBoneID(0)];
-						auto bid1 = pmd_bone_to_useful_bone_[bdef2.GetBoneID(1)];
-						if (bid0 >= 0 && bid1 >= 0) {
-							tup.emplace_back(i, bid0, bid1, bdef2.GetBoneWeight());
-						}
-					}
+					bones[0] = op.GetBDEF2().GetBoneID(0);
+					bones[1] = op.GetBDEF2().GetBoneID(1);
+					weights[0] = op.GetBDEF2().GetBoneWeight();
+					weights[1] = 1.0f - weights[0];
+					n = 2;
 					break;
 				case SKINNING_BDEF4:
-					{
-						std::cerr << "We are limited to models that each vertex only binds to at most two bones " << std::endl;
-						throw -1;
-						break;
-#if 0
-						const auto& bdef4 = v.GetSkinningOperator().GetBDEF4();
-						for (int i = 0 ; i < 4; i++) {
-							auto bid = pmd_bone_to_useful_bone_[bdef4.GetBoneID(i)];
-							if (bid < 0)
-								continue;
-							tup.emplace_back(bid, i, bdef4.GetBoneWeight(i));
-						}
-#endif
+					for (n = 0; n < 4; n++) {
+						bones[n] = op.GetBDEF4().GetBoneID(n);
+						weights[n] = op.GetBDEF4().GetBoneWeight(n);
 					}
 					break;
 				case SKINNING_SDEF:
-					std::cerr << "Unexcepted SkinningOperator " << v.GetSkinningOperator().GetSkinningType() << std::endl;
-					throw -1;
+					bones[0] = op.GetSDEF().GetBoneID(0);
+					bones[1] = op.GetSDEF().GetBoneID(1);
+					weights[0] = op.GetSDEF().GetBoneWeight();
+					weights[1] = 1.0f - weights[0];
+					n = 2;
 					break;
 			}
-			//std::cerr << bdef2.GetBoneID(0) << "\t" << bdef2.GetBoneID(1) << "\t" << bdef2.GetBoneWeight() << endl;
+			tup.emplace_back(reduceWeights(i, bones, weights, n));
 		}
 	}
+
+	// Maps the bones, merges repeated ones and sorts them by weight
+	SparseTuple reduceWeights(int vid, const size_t* bones, const float* weights, int n)
+	{
+		SparseTuple tuple(vid);
+		int used = 0;
+		float total = 0.0f;
+		for (int k = 0; k < n; k++) {
+			auto iter = pmd_bone_to_useful_bone_.find(int(bones[k]));
+			if (iter == pmd_bone_to_useful_bone_.end() || iter->second < 0 || weights[k] <= 0.0f)
+				continue;
+			int bid = iter->second;
+			int slot = 0;
+			while (slot < used && tuple.jid[slot] != bid)
+				slot++;
+			if (slot == used)
+				tuple.jid[used++] = bid;
+			tuple.weight[slot] += weights[k];
+			total += weights[k];
+		}
+		if (used == 0) {
+			// No usable bone, follow the root
+			tuple.jid[0] = 0;
+			tuple.weight[0] = 1.0f;
+			return tuple;
+		}
+		for (int k = 0; k < used; k++)
+			tuple.weight[k] /= total;
+		for (int k = 1; k < used; k++)
+			for (int j = k; j > 0 && tuple.weight[j] > tuple.weight[j - 1]; j--) {
+				std::swap(tuple.weight[j], tuple.weight[j - 1]);
+				std::swap(tuple.jid[j], tuple.jid[j - 1]);
+			}
+		return tuple;
+	}
+
+	/*
+	 * PMX paths use backslashes and are relative to the model, and the
+	 * registry only prefixes the model directory if the path already works.
+	 */
+	std::string resolveTexturePath(std::string texfn)
+	{
+		std::replace(texfn.begin(), texfn.end(), '\\', '/');
+		if (texfn.empty() || texfn[0] == '/' || model_dir_.empty() ||
+		    texfn.compare(0, model_dir_.size(), model_dir_) == 0)
+			return texfn;
+		if (!mmd::FileReader::FileExists(mmd::NativeToUTF16String(texfn)) &&
+		    mmd::FileReader::FileExists(mmd::NativeToUTF16String(model_dir_ + texfn)))
+			return model_dir_ + texfn;
+		return texfn;
+	}
 private:
 	mmd::Model model_;
 	std::unordered_map<int, int> useful_bone_to_pmd_bone_, pmd_bone_to_useful_bone_;
+
+	int usefulBone(size_t pmd_bone)
+	{
+		auto iter = pmd_bone_to_useful_bone_.find(int(pmd_bone));
+		return iter == pmd_bone_to_useful_bone_.end() ? -1 : iter->second;
+	}
+	MMDReader::ImageLoader image_loader_;
+	std::string model_dir_;
+	bool is_pmx_ = false;
+};
+
+class VMDAdapter {
+public:
+	bool open(const std::string& fn)
+	{
+		try {
+			mmd::FileReader file(fn);
+			mmd::VmdReader reader(file);
+			reader.ReadMotion(motion_);
+			reader.ReadCameraMotion(camera_);
+		} catch (std::exception& e) {
+			std::cerr << e.what() << endl;
+			return false;
+		}
+		return true;
+	}
+
+	double getLength() const
+	{
+		return std::max(motion_.GetLength(), camera_.GetLength()) / kFramesPerSecond;
+	}
+
+	bool getBoneRotation(const std::string& name, double t, glm::fquat& rot) const
+	{
+		std::wstring bone_name = utf8_to_utf16(name);
+		if (!motion_.IsBoneRegistered(bone_name))
+			return false;
+		rot = conv_quat(motion_.GetBonePose(bone_name, t).GetRotation());
+		return true;
+	}
+
+	bool getMorphWeight(const std::string& name, double t, float& weight) const
+	{
+		std::wstring morph_name = utf8_to_utf16(name);
+		if (!motion_.IsMorphRegistered(morph_name))
+			return false;
+		weight = motion_.GetMorphPose(morph_name, t).GetWeight();
+		return true;
+	}
+
+	bool hasCamera() const
+	{
+		return !camera_.GetCameraKeyframes().empty();
+	}
+
+	glm::vec3 getCameraRotation(double t) const
+	{
+		const auto& keys = camera_.GetCameraKeyframes();
+		if (keys.empty())
+			return glm::vec3(0.0f);
+		double frame = t * kFramesPerSecond;
+		auto right = keys.upper_bound(size_t(std::max(frame, 0.0)));
+		if (right == keys.begin())
+			return glm::vec3(conv(right->second.GetRotation()));
+		auto left = std::prev(right);
+		if (right == keys.end())
+			return glm::vec3(conv(left->second.GetRotation()));
+		float tau = float((frame - left->first) / (right->first - left->first));
+		return glm::mix(glm::vec3(conv(left->second.GetRotation())),
+		                glm::vec3(conv(right->second.GetRotation())),
+		                glm::clamp(tau, 0.0f, 1.0f));
+	}
+private:
+	static constexpr double kFramesPerSecond = 30.0;
+	mmd::Motion motion_;
+	mmd::CameraMotion camera_;
 };
 
 MMDReader::MMDReader()
@@ -279,12 +576,119 @@ void MMDReader::getMaterial(std::vector<Material>& vm)
 	d_->getMaterial(vm);
 }
 
+void MMDReader::setImageLoader(ImageLoader loader)
+{
+	d_->setImageLoader(loader);
+}
+
+void MMDReader::getTextureFiles(std::vector<int>& material_texture,
+		std::vector<std::string>& files)
+{
+	d_->getTextureFiles(material_texture, files);
+}
+
+/*
+ * Decoding dominates the load time of most models, so every file is a
+ * task of its own on the shared job pool.
+ */
+std::vector<std::shared_ptr<Image>> loadImages(const std::vector<std::string>& files,
+		const MMDReader::ImageLoader& loader)
+{
+	std::vector<std::shared_ptr<Image>> images(files.size());
+	parallel_for(0, int(files.size()), 1, [&](int t) {
+		auto image = std::make_shared<Image>();
+		if (loader(files[t], *image)) {
+			image->source = files[t];
+			images[t] = image;
+		}
+	});
+
+	for (size_t t = 0; t < files.size(); t++) {
+		if (images[t])
+			std::cerr << __func__ << " successfully loaded texture " << files[t] << std::endl;
+		else
+			std::cerr << __func__ << " failed to load texture " << files[t] << std::endl;
+	}
+	return images;
+}
+
+bool readImage(const std::string& fn, Image& image)
+{
+	if (has_extension(fn, ".jpg") || has_extension(fn, ".jpeg")) {
+		if (!LoadJPEG(fn, &image))
+			return false;
+		// Bottom row first, like BMP
+		size_t row = size_t(image.width) * 3;
+		for (int y = 0; y < image.height / 2; y++)
+			std::swap_ranges(image.bytes.begin() + y * row,
+			                 image.bytes.begin() + (y + 1) * row,
+			                 image.bytes.begin() + (image.height - 1 - y) * row);
+		image.stride = int(row);
+		return true;
+	}
+	return readBMP(fn.data(), image);
+}
+
 bool MMDReader::getJoint(int id, glm::vec3& wcoord, int& parent)
 {
 	return d_->getJoint(id, wcoord, parent);
 }
 
+std::string MMDReader::getJointName(int id)
+{
+	return d_->getJointName(id);
+}
+
 void MMDReader::getJointWeights(std::vector<SparseTuple>& tup)
 {
 	d_->getJointWeights(tup);
 }
+
+void MMDReader::getMorphs(std::vector<MorphTarget>& morphs)
+{
+	d_->getMorphs(morphs);
+}
+
+void MMDReader::getIKChains(std::vector<IKChain>& chains)
+{
+	d_->getIKChains(chains);
+}
+
+VMDReader::VMDReader()
+	: d_(new VMDAdapter)
+{
+}
+
+VMDReader::~VMDReader()
+{
+}
+
+bool VMDReader::open(const std::string& fn)
+{
+	return d_->open(fn);
+}
+
+double VMDReader::getLength() const
+{
+	return d_->getLength();
+}
+
+bool VMDReader::getBoneRotation(const std::string& name, double t, glm::fquat& rot) const
+{
+	return d_->getBoneRotation(name, t, rot);
+}
+
+bool VMDReader::hasCamera() const
+{
+	return d_->hasCamera();
+}
+
+glm::vec3 VMDReader::getCameraRotation(double t) const
+{
+	return d_->getCameraRotation(t);
+}
+
+bool VMDReader::getMorphWeight(const std::string& name, double t, float& weight) const
+{
+	return d_->getMorphWeight(name, t, weight);
+}
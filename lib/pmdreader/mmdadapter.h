@@ -8,28 +8,71 @@
 
 #include "material.h"
 #include <image.h>
+#include <glm/gtc/quaternion.hpp>
 #include <string>
+#include <functional>
+#include <memory>
+#include <vector>
 
 class MMDAdapter;
 
+/*
+ * Joints moving a vertex, heaviest first. Unused slots have joint -1 and
+ * weight 0; the weights add up to 1.
+ */
 struct SparseTuple {
+	static const int kMaxJoints = 4;
+
 	int vid;
-	int jid0;
-	int jid1;
-	float weight0;
-	SparseTuple(int v, int j0, int j1, float w)
-		: vid(v), jid0(j0), jid1(j1), weight0(w)
+	int jid[kMaxJoints];
+	float weight[kMaxJoints];
+	SparseTuple(int v)
+		: vid(v)
 	{
+		for (int k = 0; k < kMaxJoints; k++) {
+			jid[k] = -1;
+			weight[k] = 0.0f;
+		}
 	}
 };
 
+/*
+ * Vertex morph: sparse offsets added to the rest positions of a few
+ * vertices, scaled by the weight of the morph.
+ */
+struct MorphTarget {
+	std::string name;               // UTF-8, matched against VMD morph tracks
+	std::vector<int> vertices;
+	std::vector<glm::vec3> offsets; // one per entry of vertices
+};
+
+/*
+ * IK chain: the links (from the effector's parent upward) are rotated
+ * until the effector reaches the IK bone. Limited links keep the Euler
+ * angles (radians) of their local rotation within lo..hi, e.g. knees
+ * only bend around their X axis.
+ */
+struct IKLink {
+	int joint;
+	bool limited;
+	glm::vec3 lo, hi;
+};
+
+struct IKChain {
+	std::string name;               // UTF-8 name of the IK bone
+	int effector;
+	std::vector<IKLink> links;
+	int iterations;                 // CCD iteration limit of the model
+	float max_angle;                // max rotation of a link per iteration
+};
+
 class MMDReader {
 public:
 	MMDReader();
 	~MMDReader();
 
 	/*
-	 * Open a PMD model file.
+	 * Open a PMD or PMX (2.0) model file, told apart by the signature.
 	 * Input
 	 *      fn: file name
 	 * Return:
@@ -54,6 +97,22 @@ public:
 	 * Check Material struct (in material.h) for details
 	 */
 	void getMaterial(std::vector<Material>&);
+	/*
+	 * Replace the texture decoder used by getMaterial (readImage by
+	 * default), e.g. with one that goes through a cache. getMaterial
+	 * calls it from several threads at once.
+	 */
+	typedef std::function<bool(const std::string& fn, Image& image)> ImageLoader;
+	void setImageLoader(ImageLoader loader);
+	/*
+	 * Get the texture files without loading them
+	 * Output:
+	 *      material_texture: index into files for each material, -1 for
+	 *                        materials without texture
+	 *      files: unique texture files
+	 */
+	void getTextureFiles(std::vector<int>& material_texture,
+	                     std::vector<std::string>& files);
 	/*
 	 * Get a joint for given ID
 	 * Input:
@@ -72,20 +131,100 @@ public:
 	 *       The bone structure in actual PMD files is a forest.
 	 */
 	bool getJoint(int id, glm::vec3& wcoord, int& parent);
+	/*
+	 * Get the name of a joint in UTF-8, which is how VMD motions refer to
+	 * it. Empty for invalid joint IDs.
+	 */
+	std::string getJointName(int id);
 	/*
 	 * Get a list of tuples representing the vertex-joint weight.
 	 * See SparseTuple for more details
 	 * Output:
 	 *      tup: an array of SparseTuple object
 	 * 
-	 * Note: if a vertex was binded to two joints, then only one would be
-	 *       placed into tup array, because the other one is supposed to
-	 *       get calculated in shaders on-the-fly, which is cheaper than
-	 *       reading another weight from VRAM.
+	 * Note: there is one tuple per vertex, with all of its joints: two for
+	 *       PMD, up to four for PMX. SDEF vertices are blended linearly
+	 *       between their two joints.
 	 */
 	void getJointWeights(std::vector<SparseTuple>& tup);
+	/*
+	 * Get the vertex morphs of the model
+	 * Output:
+	 *      morphs: one MorphTarget per vertex or group morph
+	 *
+	 * Note: group morphs are flattened into the vertex offsets of their
+	 *       members. PMD's "base" morph only holds the vertex list the
+	 *       others refer to and is left out, as are bone, UV and material
+	 *       morphs.
+	 */
+	void getMorphs(std::vector<MorphTarget>& morphs);
+	/*
+	 * Get the IK chains of the model
+	 * Output:
+	 *      chains: one IKChain per IK bone, joints given as Joint IDs
+	 *
+	 * Note: chains with a bone outside the joint tree are left out. PMD
+	 *       IK bones with several chains give one IKChain each.
+	 */
+	void getIKChains(std::vector<IKChain>& chains);
 private:
 	std::unique_ptr<MMDAdapter> d_;
 };
 
+class VMDAdapter;
+
+/*
+ * VMDReader: bone and camera motion of a VMD file.
+ *
+ * VMD key frames run at 30 frames per second and are sampled here with
+ * their Bezier curves. Bone rotations are local: relative to the parent
+ * bone, in the axes of the rest pose. All getters are const and may be
+ * called from several threads at once.
+ */
+class VMDReader {
+public:
+	VMDReader();
+	~VMDReader();
+
+	bool open(const std::string& fn);
+	/*
+	 * Length of the motion in seconds, bones and camera together.
+	 */
+	double getLength() const;
+	/*
+	 * Get the local rotation of a bone at time t (in seconds).
+	 * Input:
+	 *      name: the joint name as given by MMDReader::getJointName
+	 * Return:
+	 *      false: the motion does not animate this bone
+	 */
+	bool getBoneRotation(const std::string& name, double t, glm::fquat& rot) const;
+	bool hasCamera() const;
+	/*
+	 * Euler angles (x, y, z in radians) of the camera at time t, linearly
+	 * interpolated between key frames.
+	 */
+	glm::vec3 getCameraRotation(double t) const;
+	/*
+	 * Get the weight of a morph at time t (in seconds).
+	 * Return:
+	 *      false: the motion does not animate this morph
+	 */
+	bool getMorphWeight(const std::string& name, double t, float& weight) const;
+private:
+	std::unique_ptr<VMDAdapter> d_;
+};
+
+/*
+ * Decode a BMP or JPEG (by extension) texture into RGB rows, bottom row
+ * first. Safe to call from several threads.
+ */
+bool readImage(const std::string& fn, Image& image);
+/*
+ * Load files with loader on the job pool (job_system.h). Files that fail to load
+ * give null entries.
+ */
+std::vector<std::shared_ptr<Image>> loadImages(const std::vector<std::string>& files,
+		const MMDReader::ImageLoader& loader);
+
 #endif
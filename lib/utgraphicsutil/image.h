@@ -1,6 +1,7 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
+#include <string>
 #include <vector>
 
 struct Image {
@@ -14,6 +15,16 @@ struct Image {
 	int width;
 	int height;
 	int stride; // Stores the actual number of bytes for a scan line, you can ignore this for our current case.
+	/*
+	 * Optional BC1 (DXT1) blocks of the whole mip chain, level 0 first.
+	 * Loaders that fill this may leave bytes empty.
+	 */
+	std::vector<std::vector<unsigned char>> compressed;
+	/*
+	 * Where the image came from, e.g. its file. Identifies it in texture
+	 * caches; empty for images made in memory.
+	 */
+	std::string source;
 };
 
 #endif
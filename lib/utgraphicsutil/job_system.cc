@@ -0,0 +1,216 @@
+#include "job_system.h"
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+	struct Task {
+		std::function<void()> run;
+		TaskGroup* group;
+	};
+
+	int requested_workers = -1;
+	thread_local int worker_index = -1;     // -1 on threads outside the pool
+}
+
+// The pool behind TaskGroup, started on first use
+class JobPool {
+public:
+	JobPool(int workers)
+	{
+		// Queues of the workers, then the shared one
+		for (int i = 0; i <= workers; i++)
+			queues_.emplace_back(new Queue);
+		for (int i = 0; i < workers; i++)
+			threads_.emplace_back(&JobPool::work, this, i);
+	}
+
+	~JobPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(sleep_mutex_);
+			quit_ = true;
+		}
+		sleep_cv_.notify_all();
+		for (auto& thread : threads_)
+			thread.join();
+	}
+
+	int workers() const { return int(threads_.size()); }
+
+	void push(Task task)
+	{
+		task.group->pending_++;
+		if (task.group->background_) {
+			{
+				std::lock_guard<std::mutex> lock(background_.mutex);
+				background_.tasks.emplace_back(std::move(task));
+			}
+			background_queued_++;
+			// Waiting threads share the condition, make sure a worker wakes
+			wake();
+			return;
+		}
+		int index = worker_index >= 0 ? worker_index : int(queues_.size()) - 1;
+		{
+			std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+			queues_[index]->tasks.emplace_back(std::move(task));
+		}
+		queued_++;
+		std::lock_guard<std::mutex> lock(sleep_mutex_);
+		sleep_cv_.notify_one();
+	}
+
+	/*
+	 * Own tasks newest first, stolen ones oldest first, background ones
+	 * last and only on workers.
+	 */
+	bool runOne(bool background)
+	{
+		Task task;
+		int self = worker_index;
+		int n = int(queues_.size());
+		bool found = self >= 0 && pop(*queues_[self], true, task);
+		for (int i = 0; !found && i < n; i++) {
+			int victim = (self + 1 + i) % n;
+			if (victim != self)
+				found = pop(*queues_[victim], false, task);
+		}
+		if (found) {
+			queued_--;
+		} else if (background && pop(background_, false, task)) {
+			background_queued_--;
+		} else {
+			return false;
+		}
+		try {
+			task.run();
+		} catch (...) {
+			task.group->fail(std::current_exception());
+		}
+		task.run = nullptr;     // captures go before the group may end
+		if (--task.group->pending_ == 0)
+			wake();
+		return true;
+	}
+
+	void wait(const TaskGroup& group)
+	{
+		while (!group.isDone()) {
+			if (runOne(false))
+				continue;
+			std::unique_lock<std::mutex> lock(sleep_mutex_);
+			sleep_cv_.wait(lock, [this, &group]() {
+				return group.isDone() || queued_.load() > 0;
+			});
+		}
+	}
+
+	void wake()
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex_);
+		sleep_cv_.notify_all();
+	}
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	bool pop(Queue& queue, bool back, Task& task)
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.tasks.empty())
+			return false;
+		if (back) {
+			task = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+		} else {
+			task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+		}
+		return true;
+	}
+
+	void work(int index)
+	{
+		worker_index = index;
+		while (true) {
+			if (runOne(true))
+				continue;
+			std::unique_lock<std::mutex> lock(sleep_mutex_);
+			sleep_cv_.wait(lock, [this]() {
+				return quit_ || queued_.load() > 0 || background_queued_.load() > 0;
+			});
+			if (quit_)
+				return;
+		}
+	}
+
+	std::vector<std::unique_ptr<Queue>> queues_;
+	Queue background_;
+	std::vector<std::thread> threads_;
+	std::atomic<int> queued_{0};
+	std::atomic<int> background_queued_{0};
+	// Idle workers wait for tasks, waiting threads also for their group
+	std::mutex sleep_mutex_;
+	std::condition_variable sleep_cv_;
+	bool quit_ = false;
+};
+
+namespace {
+	JobPool& pool()
+	{
+		static JobPool instance(requested_workers >= 0 ? requested_workers :
+		                        std::max(int(std::thread::hardware_concurrency()) - 1, 0));
+		return instance;
+	}
+}
+
+void TaskGroup::run(std::function<void()> task)
+{
+	if (pool().workers() == 0) {
+		task();
+		return;
+	}
+	pool().push({ std::move(task), this });
+}
+
+void TaskGroup::wait()
+{
+	join();
+	std::exception_ptr error;
+	{
+		std::lock_guard<std::mutex> lock(error_mutex_);
+		error = error_;
+		error_ = nullptr;
+	}
+	if (error)
+		std::rethrow_exception(error);
+}
+
+void TaskGroup::join()
+{
+	if (!isDone())
+		pool().wait(*this);
+}
+
+void TaskGroup::fail(std::exception_ptr error)
+{
+	std::lock_guard<std::mutex> lock(error_mutex_);
+	if (!error_)
+		error_ = error;
+}
+
+void JobSystem::setWorkerCount(int workers)
+{
+	requested_workers = workers;
+}
+
+int JobSystem::getWorkerCount()
+{
+	return pool().workers();
+}
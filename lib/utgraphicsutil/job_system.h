@@ -0,0 +1,86 @@
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <mutex>
+
+/*
+ * Job system: one pool of worker threads shared by loading, animation and
+ * export, instead of threads started here and there.
+ *
+ * Every worker owns a deque of tasks. It pushes and pops its own tasks at
+ * the back and, once it runs dry, steals from the front of the others'.
+ * Tasks queued by other threads go to a shared queue. A thread waiting
+ * for a TaskGroup runs queued tasks meanwhile, so groups and parallel_for
+ * nest without tying up the pool.
+ *
+ * Tasks of a background group, e.g. long running ones, are left to the
+ * workers: a thread waiting for another group never picks them up, so it
+ * is not held up by them.
+ */
+class TaskGroup {
+public:
+	explicit TaskGroup(bool background = false) : pending_(0), background_(background) {}
+	~TaskGroup() { join(); }
+	TaskGroup(const TaskGroup&) = delete;
+	TaskGroup& operator=(const TaskGroup&) = delete;
+
+	// run: queue task, or run it right away if the pool has no workers
+	void run(std::function<void()> task);
+	/*
+	 * wait: run queued tasks until every task of this group finished, then
+	 * rethrow the first exception one of them threw.
+	 */
+	void wait();
+	bool isDone() const { return pending_.load() == 0; }
+private:
+	friend class JobPool;
+	void join();
+	void fail(std::exception_ptr error);
+
+	std::atomic<int> pending_;
+	bool background_;
+	std::mutex error_mutex_;
+	std::exception_ptr error_;
+};
+
+class JobSystem {
+public:
+	/*
+	 * setWorkerCount: threads in the pool besides the waiting ones. Takes
+	 * effect if called before the first task. Negative (the default)
+	 * means one less than the hardware threads, 0 runs every task on the
+	 * thread that queues it.
+	 */
+	static void setWorkerCount(int workers);
+	static int getWorkerCount();
+};
+
+/*
+ * parallel_for: body(i) for every i in [begin, end), handed out in chunks
+ * of grain indices. Returns once all of them ran.
+ */
+template<typename Body>
+void parallel_for(int begin, int end, int grain, const Body& body)
+{
+	grain = std::max(grain, 1);
+	if (end - begin <= grain || JobSystem::getWorkerCount() == 0) {
+		for (int i = begin; i < end; i++)
+			body(i);
+		return;
+	}
+	TaskGroup group;
+	for (int first = begin; first < end; first += grain) {
+		int last = std::min(first + grain, end);
+		group.run([first, last, &body]() {
+			for (int i = first; i < last; i++)
+				body(i);
+		});
+	}
+	group.wait();
+}
+
+#endif
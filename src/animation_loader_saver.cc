@@ -1,5 +1,9 @@
 #include "bone_geometry.h"
 #include "texture_to_render.h"
+#include "config.h"
+#include "profiler.h"
+#include <job_system.h>
+#include <cmath>
 #include <fstream>
 #include <iostream>
 #include <glm/gtx/io.hpp>
@@ -15,7 +19,7 @@ using json = nlohmann::json;
 void Mesh::saveAnimationTo(const std::string& fn)
 {
 	// FIXME: Save keyframes to json file.
-	json my_json;
+	json my_json = json::array();
 
 	for(int i = 0; i < key_frames.size(); i++) {
 		KeyFrame& key_frame = key_frames[i];
@@ -37,11 +41,16 @@ void Mesh::saveAnimationTo(const std::string& fn)
 
 			frame_json["bone_rel_rots"].push_back(quat_json);
 		}
+		if(!key_frame.morph_weights.empty())
+			frame_json["morph_weights"] = key_frame.morph_weights;
 		my_json.push_back(frame_json);
 	}
 
 
-	std::string json_str = my_json.dump(4);
+	json clip_json;
+	clip_json["key_frame_rate"] = key_frame_rate;
+	clip_json["key_frames"] = my_json;
+	std::string json_str = clip_json.dump(4);
 	std::ofstream outfile;
 	outfile.open (fn);
 	outfile << json_str;
@@ -60,6 +69,12 @@ void Mesh::loadAnimationFrom(const std::string& fn)
                  std::istreambuf_iterator<char>());
 	// std::cout << "load json string: " << json_str << std::endl;
 	json my_json = json::parse(json_str);
+	// Files written before the key frame rate was saved are plain arrays
+	key_frame_rate = 1.0f;
+	if (my_json.is_object()) {
+		key_frame_rate = my_json.value("key_frame_rate", 1.0f);
+		my_json = my_json["key_frames"];
+	}
 	key_frames.clear();
 	for(int i = 0; i < my_json.size(); i++) {
 		json& bone_json = my_json[i]["bone_rel_rots"];
@@ -72,8 +87,109 @@ void Mesh::loadAnimationFrom(const std::string& fn)
 			glm::fquat rot_quat(quat_json[0], quat_json[1], quat_json[2], quat_json[3]);
 			key_frame.rel_rot.push_back(rot_quat);
 		}
+		if(my_json[i].count("morph_weights"))
+			key_frame.morph_weights = my_json[i]["morph_weights"].get<std::vector<float>>();
 		key_frames.push_back(key_frame);
 	}
+	key_frames_version++;
 	// skeleton.transform_skeleton_by_frame(key_frames[0]);
 	// FIXME: Load keyframes from json file.
 }
+
+/*
+ * VMD rotations are local, W_child = W_parent * L_child, while key frames
+ * hold rotations relative to the parent in world space,
+ * W_child = rel_rot[child] * W_parent. Every frame of the motion becomes
+ * a key frame. Bone translations and the camera position, distance and
+ * field of view have no place in a KeyFrame and are dropped.
+ */
+bool Mesh::loadVmd(const std::string& fn)
+{
+	PROFILE_ZONE("loadVmd");
+	VMDReader vmd;
+	if (!vmd.open(fn))
+		return false;
+	const std::vector<Joint>& joints = skeleton.joints;
+	int njoints = int(joints.size());
+	int nframes = int(std::floor(vmd.getLength() * kVmdFrameRate)) + 1;
+
+	// Sampling walks the Bezier curves, one track per joint
+	std::vector<std::vector<glm::fquat>> local(njoints);
+	parallel_for(0, njoints, 8, [&](int j) {
+		glm::fquat rot;
+		if (joints[j].name.empty() || !vmd.getBoneRotation(joints[j].name, 0.0, rot))
+			return;
+		local[j].resize(nframes);
+		for (int f = 0; f < nframes; f++)
+			vmd.getBoneRotation(joints[j].name, f / kVmdFrameRate, local[j][f]);
+	});
+	int tracks = 0;
+	for (const auto& track : local)
+		tracks += !track.empty();
+
+	std::vector<std::vector<float>> weights(morphs.size());
+	parallel_for(0, int(morphs.size()), 8, [&](int m) {
+		float weight;
+		if (!vmd.getMorphWeight(morphs[m].name, 0.0, weight))
+			return;
+		weights[m].resize(nframes);
+		for (int f = 0; f < nframes; f++)
+			vmd.getMorphWeight(morphs[m].name, f / kVmdFrameRate, weights[m][f]);
+	});
+	int morph_tracks = 0;
+	for (const auto& track : weights)
+		morph_tracks += !track.empty();
+
+	// Parents before children
+	std::vector<int> order;
+	for (int j = 0; j < njoints; j++)
+		if (joints[j].parent_index == -1)
+			order.emplace_back(j);
+	for (size_t i = 0; i < order.size(); i++)
+		for (int child : joints[order[i]].children)
+			order.emplace_back(child);
+
+	key_frames.assign(nframes, KeyFrame());
+	parallel_for(0, nframes, 8, [&](int f) {
+		KeyFrame& key_frame = key_frames[f];
+		if (morph_tracks > 0) {
+			key_frame.morph_weights.assign(morphs.size(), 0.0f);
+			for (size_t m = 0; m < morphs.size(); m++)
+				if (!weights[m].empty())
+					key_frame.morph_weights[m] = weights[m][f];
+		}
+		std::vector<glm::fquat> world(njoints);
+		key_frame.rel_rot.resize(njoints);
+		for (int j : order) {
+			int parent = joints[j].parent_index;
+			glm::fquat parent_world = parent == -1 ? glm::fquat() : world[parent];
+			world[j] = local[j].empty() ? parent_world : glm::normalize(parent_world * local[j][f]);
+			key_frame.rel_rot[j] = glm::normalize(world[j] * glm::inverse(parent_world));
+		}
+		if (vmd.hasCamera()) {
+			// MMD rotates the camera in Y, X, Z order
+			glm::vec3 euler = vmd.getCameraRotation(f / kVmdFrameRate);
+			key_frame.camera_rel_orientation = glm::angleAxis(euler.y, glm::vec3(0.0f, 1.0f, 0.0f)) *
+			                                   glm::angleAxis(euler.x, glm::vec3(1.0f, 0.0f, 0.0f)) *
+			                                   glm::angleAxis(euler.z, glm::vec3(0.0f, 0.0f, 1.0f));
+		}
+	});
+	// KeyFrame::interpolate mixes without flipping signs, keep neighbours
+	// on the same hemisphere
+	for (int f = 1; f < nframes; f++) {
+		for (int j = 0; j < njoints; j++) {
+			glm::fquat& rot = key_frames[f].rel_rot[j];
+			if (glm::dot(rot, key_frames[f - 1].rel_rot[j]) < 0.0f)
+				rot = -rot;
+		}
+		glm::fquat& camera = key_frames[f].camera_rel_orientation;
+		if (glm::dot(camera, key_frames[f - 1].camera_rel_orientation) < 0.0f)
+			camera = -camera;
+	}
+	key_frame_rate = kVmdFrameRate;
+	key_frames_version++;
+	std::cout << "loaded " << nframes << " key frames from " << fn << ", "
+	          << tracks << " of " << njoints << " joints and "
+	          << morph_tracks << " of " << morphs.size() << " morphs animated" << std::endl;
+	return true;
+}
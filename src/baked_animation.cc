@@ -0,0 +1,102 @@
+#include <GL/glew.h>
+#include <debuggl.h>
+#include "baked_animation.h"
+#include <job_system.h>
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+
+BakedAnimation::BakedAnimation()
+{
+}
+
+BakedAnimation::~BakedAnimation()
+{
+	if (texture_)
+		glDeleteTextures(1, &texture_);
+}
+
+void BakedAnimation::clear()
+{
+	texels_.clear();
+	ranges_.clear();
+	nrows_ = 0;
+}
+
+int BakedAnimation::addClip(const Mesh& mesh,
+                            std::vector<KeyFrame>& clip,
+                            bool spline,
+                            float rate)
+{
+	const Skeleton& skeleton = mesh.skeleton;
+	int nbones = skeleton.joints.size();
+	int morph_texels = (int(mesh.morphs.size()) + 3) / 4;
+	width_ = 2 * nbones + morph_texels;
+	rate_ = rate;
+
+	// Clips shorter than two key frames hold the rest pose.
+	float duration = clip.size() < 2 ? 0.0f : clip.size() - 1;
+	int nrows = std::max(2, int(std::ceil(duration * rate)) + 1);
+	ClipRange range;
+	range.first_row = nrows_;
+	range.nrows = nrows;
+	std::vector<BoundingBox> row_bounds(nrows);
+	nrows_ += nrows;
+	texels_.resize(nrows_ * width_);
+
+	KeyFrame rest;
+	rest.rel_rot.resize(nbones);
+
+	parallel_for(0, nrows, 8, [&](int row) {
+		KeyFrame frame;
+		float t = std::min(row / rate, duration);
+		if (clip.size() < 2)
+			frame = rest;
+		else if (t >= duration)
+			frame = clip.back();
+		else
+			KeyFrame::sample_looped(clip, t, spline, frame);
+		Configuration q;
+		skeleton.evaluate(frame, q);
+		row_bounds[row] = mesh.computeSkinnedBounds(q);
+
+		glm::vec4* out = &texels_[(range.first_row + row) * width_];
+		for (int b = 0; b < nbones; b++) {
+			out[2 * b] = glm::vec4(q.rot[b].x, q.rot[b].y, q.rot[b].z, q.rot[b].w);
+			out[2 * b + 1] = glm::vec4(q.trans[b], 1.0f);
+		}
+		std::vector<float> weights;
+		mesh.poseMorphs(frame, weights);
+		glm::vec4* morph_out = out + 2 * nbones;
+		std::fill(morph_out, morph_out + morph_texels, glm::vec4(0.0f));
+		for (size_t m = 0; m < weights.size(); m++)
+			morph_out[m / 4][m % 4] = weights[m];
+	});
+	range.bounds.reset();
+	for (const auto& box : row_bounds)
+		range.bounds.merge(box);
+	ranges_.emplace_back(range);
+	std::cout << "baked " << clip.size() << " key frames into "
+	          << nrows << " rows" << std::endl;
+	return int(ranges_.size()) - 1;
+}
+
+void BakedAnimation::upload()
+{
+	GLint max_size = 0;
+	CHECK_GL_ERROR(glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size));
+	if (int(nrows_) > max_size)
+		std::cerr << __func__ << ": " << nrows_ << " rows exceed GL_MAX_TEXTURE_SIZE "
+		          << max_size << ", lower the bake rate" << std::endl;
+	if (!texture_)
+		CHECK_GL_ERROR(glGenTextures(1, &texture_));
+	CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_2D, texture_));
+	CHECK_GL_ERROR(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F,
+	                            width_, nrows_, 0,
+	                            GL_RGBA, GL_FLOAT, texels_.data()));
+	// Rows are interpolated in the shader, never by the sampler
+	CHECK_GL_ERROR(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+	CHECK_GL_ERROR(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+	CHECK_GL_ERROR(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0));
+	CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_2D, 0));
+}
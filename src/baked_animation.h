@@ -0,0 +1,54 @@
+#ifndef BAKED_ANIMATION_H
+#define BAKED_ANIMATION_H
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "bone_geometry.h"
+
+/*
+ * BakedAnimation: clips sampled at a fixed rate into one RGBA32F texture,
+ * for playback without any per-frame CPU work.
+ *
+ * Each row is one sample of one clip, each bone takes two texels:
+ *      column 2 * bone:     rotation quaternion (xyzw) w.r.t. the rest pose
+ *      column 2 * bone + 1: joint position (xyz1)
+ * and the morph weights follow, four per texel, in the last columns.
+ * Clips are stacked vertically, getClipRange() tells where each one starts.
+ * shaders/baked.vert interpolates between neighbouring rows by time.
+ */
+class BakedAnimation {
+public:
+	struct ClipRange {
+		int first_row;
+		int nrows;
+		BoundingBox bounds; // union of the skinned bounds of all rows
+	};
+
+	BakedAnimation();
+	~BakedAnimation();
+
+	void clear();
+	/*
+	 * addClip: sample clip every 1/rate key frames and append the rows.
+	 * Return: index for getClipRange.
+	 */
+	int addClip(const Mesh& mesh,
+	            std::vector<KeyFrame>& clip,
+	            bool spline,
+	            float rate);
+	void upload();
+
+	float getRate() const { return rate_; }
+	unsigned getTexture() const { return texture_; }
+	const ClipRange& getClipRange(int i) const { return ranges_[i]; }
+	size_t getNumberOfRows() const { return nrows_; }
+private:
+	std::vector<glm::vec4> texels_;
+	std::vector<ClipRange> ranges_;
+	int width_ = 0;
+	size_t nrows_ = 0;
+	float rate_ = 0.0f;
+	unsigned texture_ = 0;
+};
+
+#endif
@@ -0,0 +1,164 @@
+#include "bone_bvh.h"
+#include "procedure_geometry.h"
+#include "bone_geometry.h"
+#include <algorithm>
+#include <limits>
+
+namespace {
+	constexpr int kLeafSize = 4;
+
+	// Does the segment p + t * dir, t in [0, 1], pass within radius of the box?
+	bool segment_hits_box(const glm::vec3& p, const glm::vec3& inv_dir,
+	                      const glm::vec3& box_min, const glm::vec3& box_max,
+	                      float radius)
+	{
+		glm::vec3 t0 = (box_min - glm::vec3(radius) - p) * inv_dir;
+		glm::vec3 t1 = (box_max + glm::vec3(radius) - p) * inv_dir;
+		glm::vec3 t_near = glm::min(t0, t1);
+		glm::vec3 t_far = glm::max(t0, t1);
+		float tmin = std::max(std::max(t_near.x, t_near.y), std::max(t_near.z, 0.0f));
+		float tmax = std::min(std::min(t_far.x, t_far.y), std::min(t_far.z, 1.0f));
+		return tmin <= tmax;
+	}
+}
+
+void BoneBVH::build(const std::vector<Capsule>& capsules)
+{
+	nodes_.clear();
+	leaves_.clear();
+	slots_.assign(capsules.size(), -1);
+	if (capsules.empty())
+		return;
+	std::vector<int> order(capsules.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	buildNode(order, 0, order.size(), capsules);
+	refit(capsules);
+}
+
+int BoneBVH::buildNode(std::vector<int>& order, int begin, int end,
+                       const std::vector<Capsule>& capsules)
+{
+	int index = nodes_.size();
+	nodes_.emplace_back();
+	if (end - begin <= kLeafSize) {
+		nodes_[index].leaf = leaves_.size();
+		leaves_.emplace_back();
+		for (int lane = 0; lane < kLeafSize; lane++) {
+			int slot = nodes_[index].leaf * kLeafSize + lane;
+			if (begin + lane < end) {
+				slots_[order[begin + lane]] = slot;
+				writeCapsule(slot, capsules[order[begin + lane]]);
+			} else {
+				// Padding lanes repeat the first capsule and are never reported
+				writeCapsule(slot, capsules[order[begin]]);
+				leaves_.back().id[lane] = -1;
+			}
+		}
+		return index;
+	}
+
+	// Median split along the longest axis of the centroids
+	BoundingBox centroids;
+	centroids.reset();
+	for (int i = begin; i < end; i++) {
+		const auto& capsule = capsules[order[i]];
+		centroids.merge(0.5f * (capsule.start + capsule.end));
+	}
+	glm::vec3 extent = centroids.max - centroids.min;
+	int axis = 0;
+	if (extent.y > extent[axis])
+		axis = 1;
+	if (extent.z > extent[axis])
+		axis = 2;
+	int mid = (begin + end) / 2;
+	std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+		[&capsules, axis](int lhs, int rhs) {
+			return capsules[lhs].start[axis] + capsules[lhs].end[axis] <
+			       capsules[rhs].start[axis] + capsules[rhs].end[axis];
+		});
+	int left = buildNode(order, begin, mid, capsules);
+	int right = buildNode(order, mid, end, capsules);
+	nodes_[index].left = left;
+	nodes_[index].right = right;
+	return index;
+}
+
+void BoneBVH::writeCapsule(int slot, const Capsule& capsule)
+{
+	Leaf& leaf = leaves_[slot / kLeafSize];
+	int lane = slot % kLeafSize;
+	leaf.start_x[lane] = capsule.start.x;
+	leaf.start_y[lane] = capsule.start.y;
+	leaf.start_z[lane] = capsule.start.z;
+	leaf.end_x[lane] = capsule.end.x;
+	leaf.end_y[lane] = capsule.end.y;
+	leaf.end_z[lane] = capsule.end.z;
+	leaf.id[lane] = capsule.id;
+}
+
+void BoneBVH::refit(const std::vector<Capsule>& capsules)
+{
+	for (size_t i = 0; i < capsules.size(); i++)
+		writeCapsule(slots_[i], capsules[i]);
+	for (int i = int(nodes_.size()) - 1; i >= 0; i--) {
+		Node& node = nodes_[i];
+		BoundingBox box;
+		box.reset();
+		if (node.leaf < 0) {
+			box.merge(nodes_[node.left].min);
+			box.merge(nodes_[node.left].max);
+			box.merge(nodes_[node.right].min);
+			box.merge(nodes_[node.right].max);
+		} else {
+			const Leaf& leaf = leaves_[node.leaf];
+			for (int lane = 0; lane < kLeafSize; lane++) {
+				if (leaf.id[lane] < 0)
+					continue;
+				box.merge(glm::vec3(leaf.start_x[lane], leaf.start_y[lane], leaf.start_z[lane]));
+				box.merge(glm::vec3(leaf.end_x[lane], leaf.end_y[lane], leaf.end_z[lane]));
+			}
+		}
+		node.min = box.min;
+		node.max = box.max;
+	}
+}
+
+int BoneBVH::pick(const glm::vec3& ray_start, const glm::vec3& ray_end, float radius) const
+{
+	if (nodes_.empty())
+		return -1;
+	glm::vec3 dir = ray_end - ray_start;
+	glm::vec3 inv_dir;
+	for (int k = 0; k < 3; k++)
+		inv_dir[k] = dir[k] != 0.0f ? 1.0f / dir[k] : std::numeric_limits<float>::max();
+
+	int best = -1;
+	float best_distance = radius;   // shrinks as closer capsules are found
+	int stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		const Node& node = nodes_[stack[--top]];
+		if (!segment_hits_box(ray_start, inv_dir, node.min, node.max, best_distance))
+			continue;
+		if (node.leaf < 0) {
+			stack[top++] = node.left;
+			stack[top++] = node.right;
+			continue;
+		}
+		const Leaf& leaf = leaves_[node.leaf];
+		float distances[kLeafSize];
+		line_segment_distance4(ray_start, ray_end,
+				leaf.start_x, leaf.start_y, leaf.start_z,
+				leaf.end_x, leaf.end_y, leaf.end_z,
+				distances);
+		for (int lane = 0; lane < kLeafSize; lane++) {
+			if (leaf.id[lane] >= 0 && distances[lane] < best_distance) {
+				best_distance = distances[lane];
+				best = leaf.id[lane];
+			}
+		}
+	}
+	return best;
+}
@@ -0,0 +1,56 @@
+#ifndef BONE_BVH_H
+#define BONE_BVH_H
+
+#include <vector>
+#include <glm/glm.hpp>
+
+/*
+ * BoneBVH: bounding volume hierarchy over bone capsules for picking.
+ *
+ * The tree is built once for a set of capsules. When the pose changes only
+ * the endpoints move, so refit() updates the boxes bottom-up and keeps the
+ * topology. Leaves hold up to four capsules in SoA layout so they can be
+ * tested with line_segment_distance4.
+ */
+class BoneBVH {
+public:
+	struct Capsule {
+		glm::vec3 start;
+		glm::vec3 end;
+		int id;         // returned by pick, e.g. the joint index
+	};
+
+	void build(const std::vector<Capsule>& capsules);
+	/*
+	 * refit: capsules must come in the same order as in the last build.
+	 */
+	void refit(const std::vector<Capsule>& capsules);
+	/*
+	 * pick: id of the capsule closest to the segment ray_start-ray_end
+	 * among those closer than radius, or -1.
+	 */
+	int pick(const glm::vec3& ray_start, const glm::vec3& ray_end, float radius) const;
+
+	size_t size() const { return slots_.size(); }
+private:
+	struct Node {
+		glm::vec3 min, max;
+		int left = -1, right = -1;
+		int leaf = -1;  // index into leaves_, or -1 for inner nodes
+	};
+	struct alignas(16) Leaf {
+		float start_x[4], start_y[4], start_z[4];
+		float end_x[4], end_y[4], end_z[4];
+		int id[4];
+	};
+
+	int buildNode(std::vector<int>& order, int begin, int end,
+	              const std::vector<Capsule>& capsules);
+	void writeCapsule(int slot, const Capsule& capsule);
+
+	std::vector<Node> nodes_;   // children are stored after their parent
+	std::vector<Leaf> leaves_;
+	std::vector<int> slots_;    // capsule i lives in leaves_[slots_[i] / 4], lane slots_[i] % 4
+};
+
+#endif
@@ -1,10 +1,18 @@
 #include "config.h"
 #include "bone_geometry.h"
 #include "texture_to_render.h"
+#include "texture_cache.h"
+#include "model_cache.h"
+#include "hash.h"
+#include "profiler.h"
+#include <job_system.h>
 #include <fstream>
 #include <queue>
+#include <cmath>
+#include <algorithm>
 #include <iostream>
 #include <stdexcept>
+#include <memory>
 #include <glm/gtx/io.hpp>
 #include <glm/gtx/transform.hpp>
 #include <glm/gtx/quaternion.hpp>
@@ -33,12 +41,76 @@ std::ostream& operator<<(std::ostream& os, const BoundingBox& bounds)
 	return os;
 }
 
+namespace {
+	// Call fn(joint, vector_from_joint) for every joint that moves the vertices.
+	template <typename Fn>
+	void for_each_influence(const Mesh& mesh, const std::vector<int>& vids, Fn fn)
+	{
+		for (int vid : vids) {
+			if (vid >= int(mesh.joint_ids.size()))
+				continue;
+			for (int k = 0; k < SparseTuple::kMaxJoints; k++)
+				if (mesh.joint_weights[vid][k] > 0.0f)
+					fn(mesh.joint_ids[vid][k], mesh.vector_from_joint[k][vid]);
+		}
+	}
+
+	void fit_bone_spheres(const Mesh& mesh, const std::vector<int>& vids, std::vector<BoneSphere>& spheres)
+	{
+		std::vector<BoundingBox> boxes(mesh.getNumberOfBones());
+		for (auto& box : boxes)
+			box.reset();
+		for_each_influence(mesh, vids, [&boxes](int jid, const glm::vec3& v) {
+			boxes[jid].merge(v);
+		});
+		std::vector<int> slot(boxes.size(), -1);
+		spheres.clear();
+		for (size_t i = 0; i < boxes.size(); i++) {
+			if (boxes[i].isEmpty())
+				continue;
+			slot[i] = spheres.size();
+			spheres.push_back({ int(i), 0.5f * (boxes[i].min + boxes[i].max), 0.0f });
+		}
+		for_each_influence(mesh, vids, [&spheres, &slot](int jid, const glm::vec3& v) {
+			BoneSphere& sphere = spheres[slot[jid]];
+			sphere.radius = std::max(sphere.radius, glm::length(v - sphere.center));
+		});
+	}
+
+	// Linear blending stays inside the convex hull of the posed spheres,
+	// so their box bounds the skinned vertices.
+	BoundingBox pose_bone_spheres(const std::vector<BoneSphere>& spheres, const Configuration& q)
+	{
+		BoundingBox box;
+		box.reset();
+		for (const auto& sphere : spheres)
+			box.merge(q.rot[sphere.joint] * sphere.center + q.trans[sphere.joint], sphere.radius);
+		return box;
+	}
+}
+
+BoundingBox BoundingBox::transformed(const glm::mat4& m) const
+{
+	BoundingBox ret;
+	ret.reset();
+	if (isEmpty())
+		return ret;
+	for (int i = 0; i < 8; i++) {
+		glm::vec3 corner((i & 1) ? max.x : min.x,
+		                 (i & 2) ? max.y : min.y,
+		                 (i & 4) ? max.z : min.z);
+		ret.merge(glm::vec3(m * glm::vec4(corner, 1.0f)));
+	}
+	return ret;
+}
+
 void Skeleton::rotate_bone(const int bone_index, const glm::fquat& rotate_quat) {
 	Joint& curr_joint = joints[bone_index];
 	Joint& parent_joint = joints[curr_joint.parent_index];
 	parent_joint.rel_orientation = rotate_quat * parent_joint.rel_orientation;
 	parent_joint.orientation = rotate_quat * parent_joint.orientation;
 	update_children(parent_joint);
+	pose_version++;
 }
 
 
@@ -55,9 +127,11 @@ void Skeleton::translate_root(glm::vec3 offset) {
 	for(Joint& joint : joints) {
 		joint.position = joint.position + offset;
 	}
+	pose_version++;
 }
 
-void Skeleton::transform_skeleton_by_frame(KeyFrame& frame) {
+void Skeleton::transform_skeleton_by_frame(const KeyFrame& frame) {
+	PROFILE_ZONE("transform_skeleton_by_frame");
 	for(int i = 0; i < joints.size(); i++) {
 		joints[i].rel_orientation = frame.rel_rot[i];
 	}
@@ -67,11 +141,13 @@ void Skeleton::transform_skeleton_by_frame(KeyFrame& frame) {
 			update_children(joints[i]);
 		}
 	}
+	pose_version++;
 }
 
 
 void Skeleton::refreshCache(Configuration* target)
 {
+	PROFILE_ZONE("refreshCache");
 	if (target == nullptr)
 		target = &cache;
 	target->rot.resize(joints.size());
@@ -96,19 +172,20 @@ const glm::fquat* Skeleton::collectJointRot() const
 
 // my implementation for getting bone transform matrix:
 // remember that every bone is pointing from parent to child!
-const glm::mat4 Skeleton::getBoneTransform(int joint_index) const
+const glm::mat4 Skeleton::getBoneTransform(int joint_index, const Configuration* q) const
 {
 	// return bone_transforms[joint_index];
 	const Joint& curr_joint = joints[joint_index];
-	const Joint& parent_joint = joints[curr_joint.parent_index];
+	glm::vec3 curr_position = q ? q->trans[joint_index] : curr_joint.position;
+	glm::vec3 parent_position = q ? q->trans[curr_joint.parent_index] : joints[curr_joint.parent_index].position;
 
-	float length = glm::length(curr_joint.position - parent_joint.position);
+	float length = glm::length(curr_position - parent_position);
 	glm::mat4 scale_matrix = glm::scale(glm::mat4(1.0), glm::vec3(1.0, length, 1.0));
 
-	glm::fquat rotate_quat = quaternion_between_two_directs(glm::vec3(0.0, 1.0, 0.0), curr_joint.position - parent_joint.position);
+	glm::fquat rotate_quat = quaternion_between_two_directs(glm::vec3(0.0, 1.0, 0.0), curr_position - parent_position);
 	glm::mat4 rotate_matrix = glm::toMat4(rotate_quat);
 
-	glm::vec3 translate = parent_joint.position;
+	glm::vec3 translate = parent_position;
 	glm::mat4 translate_matrix = glm::translate(glm::mat4(1.0f), translate);
 
 	return translate_matrix * rotate_matrix * scale_matrix;
@@ -125,6 +202,31 @@ void Skeleton::set_rest_pose()
 			update_children(joints[i]);
 		}
 	}
+	pose_version++;
+}
+
+void Skeleton::evaluate(const KeyFrame& frame, Configuration& target) const
+{
+	target.rot.resize(joints.size());
+	target.trans.resize(joints.size());
+	for(int i = 0; i < joints.size(); i++) {
+		if(joints[i].parent_index == -1) {
+			target.rot[i] = frame.rel_rot[i];
+			target.trans[i] = joints[i].init_position;
+			evaluate_children(i, frame, target);
+		}
+	}
+}
+
+void Skeleton::evaluate_children(int parent_index, const KeyFrame& frame, Configuration& target) const
+{
+	const Joint& parent_joint = joints[parent_index];
+	for(int child_index : parent_joint.children) {
+		const Joint& child_joint = joints[child_index];
+		target.rot[child_index] = frame.rel_rot[child_index] * target.rot[parent_index];
+		target.trans[child_index] = target.trans[parent_index] + target.rot[parent_index] * (child_joint.init_position - parent_joint.init_position);
+		evaluate_children(child_index, frame, target);
+	}
 }
 
 void KeyFrame::interpolate(const KeyFrame& from,
@@ -137,6 +239,12 @@ void KeyFrame::interpolate(const KeyFrame& from,
 		target.rel_rot.push_back(kf_rot);
 	}
 	target.camera_rel_orientation = glm::mix(from.camera_rel_orientation, to.camera_rel_orientation, tau);
+	target.morph_weights.resize(std::max(from.morph_weights.size(), to.morph_weights.size()));
+	for(size_t i = 0; i < target.morph_weights.size(); i++) {
+		float w0 = i < from.morph_weights.size() ? from.morph_weights[i] : 0.0f;
+		float w1 = i < to.morph_weights.size() ? to.morph_weights[i] : 0.0f;
+		target.morph_weights[i] = glm::mix(w0, w1, tau);
+	}
 } 
 
 
@@ -160,9 +268,51 @@ void KeyFrame::interpolate_frame_spline(std::vector<KeyFrame>& key_frames,
 	}	
 	target.camera_rel_orientation = catmull_rom_spline(per_bone_camera_rot, t);
 
+	// morph weights are not rotations, blend them linearly
+	int frame_index = glm::clamp<int>(t, 0, key_frames.size() - 1);
+	int next_index = std::min<int>(frame_index + 1, key_frames.size() - 1);
+	KeyFrame linear;
+	interpolate(key_frames[frame_index], key_frames[next_index], glm::fract(t), linear);
+	target.morph_weights = linear.morph_weights;
 
 } 
 
+bool KeyFrame::sample_looped(std::vector<KeyFrame>& clip,
+	                        float t,
+	                        bool spline,
+	                        KeyFrame& target) {
+	if(clip.size() < 2)
+		return false;
+	float duration = clip.size() - 1;
+	t = std::fmod(t, duration);
+	if(t < 0.0f)
+		t += duration;
+	int frame_index = std::min(int(t), int(clip.size()) - 2);
+	if(spline) {
+		target.rel_rot.clear();
+		interpolate_frame_spline(clip, t, target);
+	} else {
+		interpolate(clip[frame_index], clip[frame_index + 1], t - frame_index, target);
+	}
+	return true;
+}
+
+bool KeyFrame::sample(std::vector<KeyFrame>& clip,
+	                 float t,
+	                 bool spline,
+	                 KeyFrame& target) {
+	int frame_index = floor(t);
+	if(t < 0.0f || frame_index + 1 >= int(clip.size()))
+		return false;
+	if(spline) {
+		target.rel_rot.clear();
+		interpolate_frame_spline(clip, t, target);
+	} else {
+		interpolate(clip[frame_index], clip[frame_index + 1], t - frame_index, target);
+	}
+	return true;
+}
+
 // use glm::clamp to get 4 neighboring quaternions for every keyframe. 
 // Reference: https://stackoverflow.com/questions/37230747/how-can-i-generate-a-spline-curve-using-glm-gtx-splinecatmullrom
 glm::fquat KeyFrame::catmull_rom_spline(const std::vector<glm::fquat>& cp, float t)
@@ -192,13 +342,51 @@ Mesh::~Mesh()
 	textures.clear();
 }
 
+namespace {
+	// Textures go through the compressed cache when the GL can sample it
+	std::unique_ptr<TextureCache> open_texture_cache(const std::string& model_fn)
+	{
+		if (!TextureCache::isSupported())
+			return nullptr;
+		return std::unique_ptr<TextureCache>(new TextureCache(model_fn + kTextureCacheSuffix));
+	}
+
+	MMDReader::ImageLoader image_loader(TextureCache* cache)
+	{
+		if (!cache)
+			return readImage;
+		return [cache](const std::string& texfn, Image& image) {
+			return cache->load(texfn, image);
+		};
+	}
+}
+
 void Mesh::loadPmd(const std::string& fn)
 {
+	PROFILE_ZONE("loadPmd");
+	uint64_t source_hash = 0;
+	bool hashed = hash_file(fn, source_hash);
+	ModelTextures textures;
+	if (hashed && load_cooked_model(fn + kCookedModelSuffix, source_hash, *this, textures)) {
+		morph_weights.assign(morphs.size(), 0.0f);
+		computeBounds();
+		linkJoints();
+		ik_solver.build(ik_chains, skeleton);
+		loadTextures(fn, textures);
+		return;
+	}
+
 	MMDReader mr;
 	mr.open(fn);
+	auto texture_cache = open_texture_cache(fn);
+	mr.setImageLoader(image_loader(texture_cache.get()));
+	// Textures decode in the background while geometry and skeleton load
+	TaskGroup material_loading;
+	material_loading.run([this, &mr]() {
+		mr.getMaterial(materials);
+	});
 	mr.getMesh(vertices, faces, vertex_normals, uv_coordinates);
 	computeBounds();
-	mr.getMaterial(materials);
 
 	// FIXME: load skeleton and blend weights from PMD file,
 	//        initialize std::vectors for the vertex attributes,
@@ -210,14 +398,58 @@ void Mesh::loadPmd(const std::string& fn)
 		int parentId;
 		if(mr.getJoint(jointId, wcoord, parentId)) {
 			Joint curr_joint(jointId, wcoord, parentId);
+			curr_joint.name = mr.getJointName(jointId);
 			skeleton.joints.push_back(curr_joint);
 			jointId++;
-			std::cout << "join " << jointId << ": (" << wcoord.x << ", " << wcoord.y << ", " << wcoord.z << ")" << std::endl;
 		}
 		else {
 			break;
 		}
 	}
+	linkJoints();
+	mr.getIKChains(ik_chains);
+	ik_solver.build(ik_chains, skeleton);
+
+	// load wieghts
+	std::vector<SparseTuple> sparse_tuples;
+	mr.getJointWeights(sparse_tuples);
+	mr.getMorphs(morphs);
+	morph_weights.assign(morphs.size(), 0.0f);
+
+	size_t nweights = sparse_tuples.size();
+	joint_ids.resize(nweights);
+	joint_weights.resize(nweights);
+	for (auto& vectors : vector_from_joint)
+		vectors.resize(nweights);
+	parallel_for(0, int(nweights), 4096, [&](int i) {
+		const SparseTuple& tuple = sparse_tuples[i];
+		int vid = tuple.vid;
+		for (int k = 0; k < SparseTuple::kMaxJoints; k++) {
+			int jid = tuple.jid[k];
+			if (jid == -1) {
+				joint_ids[i][k] = 0;	// avoid joints[-1] access
+				joint_weights[i][k] = 0.0f;
+				vector_from_joint[k][i] = glm::vec3(0.0, 0.0, 0.0);
+			} else {
+				joint_ids[i][k] = jid;
+				joint_weights[i][k] = tuple.weight[k];
+				vector_from_joint[k][i] = glm::vec3(vertices[vid]) - skeleton.joints[jid].position;
+			}
+		}
+	});
+	material_loading.wait();
+	if (texture_cache)
+		texture_cache->save();
+	computeBoneSpheres();
+	// updateAnimation();
+	if (hashed) {
+		mr.getTextureFiles(textures.material_texture, textures.files);
+		save_cooked_model(fn + kCookedModelSuffix, source_hash, *this, textures);
+	}
+}
+
+void Mesh::linkJoints()
+{
 	// init orientation, rel_orientation and children list.
 	// computation of orientation: https://stackoverflow.com/questions/1171849/finding-quaternion-representing-the-rotation-from-one-vector-to-another
 	for(int i = 0; i < skeleton.joints.size(); i++) {
@@ -231,28 +463,20 @@ void Mesh::loadPmd(const std::string& fn)
 		}	
 		// skeleton.bone_transforms.push_back(glm::mat4(1.0));	// for tmp use
 	}
+}
 
-	// load wieghts
-	std::vector<SparseTuple> sparse_tuples;
-	mr.getJointWeights(sparse_tuples);
-
-	for(SparseTuple& tuple : sparse_tuples) {
-		int vid = tuple.vid;
-		joint0.push_back(tuple.jid0);
-		weight_for_joint0.push_back(tuple.weight0);
-		vector_from_joint0.push_back(glm::vec3(vertices[vid]) - skeleton.joints[tuple.jid0].position);
-
-		if(tuple.jid1 == -1) {
-			joint1.push_back(0);	// avoid joints[-1] access
-			vector_from_joint1.push_back(glm::vec3(0.0, 0.0, 0.0));
-			// std::cout << "joint1 equals -1" << std::endl;
-		}
-		else {
-			joint1.push_back(tuple.jid1);
-			vector_from_joint1.push_back(glm::vec3(vertices[vid]) - skeleton.joints[tuple.jid1].position);
-		}
-	}
-	// updateAnimation();
+/*
+ * Textures of a cooked model, which has no MMDReader to load them.
+ */
+void Mesh::loadTextures(const std::string& fn, const ModelTextures& textures)
+{
+	auto texture_cache = open_texture_cache(fn);
+	auto images = loadImages(textures.files, image_loader(texture_cache.get()));
+	for (size_t i = 0; i < materials.size() && i < textures.material_texture.size(); i++)
+		if (textures.material_texture[i] >= 0)
+			materials[i].texture = images[textures.material_texture[i]];
+	if (texture_cache)
+		texture_cache->save();
 }
 
 
@@ -276,39 +500,124 @@ void Mesh::computeBounds()
 
 
 
-void Mesh::updateAnimation(float t)
+void Mesh::computeBoneSpheres()
 {
+	std::vector<int> vids(vertices.size());
+	for (size_t i = 0; i < vids.size(); i++)
+		vids[i] = i;
+	fit_bone_spheres(*this, vids, bone_spheres);
+
+	material_bone_spheres.resize(materials.size());
+	std::vector<char> used(vertices.size());
+	for (size_t mid = 0; mid < materials.size(); mid++) {
+		const Material& ma = materials[mid];
+		std::fill(used.begin(), used.end(), 0);
+		vids.clear();
+		for (size_t f = ma.offset; f < ma.offset + ma.nfaces && f < faces.size(); f++) {
+			for (int k = 0; k < 3; k++) {
+				unsigned vid = faces[f][k];
+				if (!used[vid]) {
+					used[vid] = 1;
+					vids.push_back(vid);
+				}
+			}
+		}
+		fit_bone_spheres(*this, vids, material_bone_spheres[mid]);
+	}
+}
 
-	
-	// FIXME: Support Animation Here
+void Mesh::updateSkinnedBounds()
+{
+	computeMaterialBounds(currentQ_, material_bounds, skinned_bounds);
+}
 
-	int frame_index = floor(t);
-	if(t != -1.0 && frame_index + 1 < key_frames.size()) {
+void Mesh::computeMaterialBounds(const Configuration& q,
+                                 std::vector<BoundingBox>& material,
+                                 BoundingBox& total) const
+{
+	material.resize(material_bone_spheres.size());
+	total.reset();
+	for (size_t mid = 0; mid < material_bone_spheres.size(); mid++) {
+		material[mid] = pose_bone_spheres(material_bone_spheres[mid], q);
+		total.merge(material[mid]);
+	}
+}
 
-		float tao = t - frame_index;
-		KeyFrame frame;
-		if(spline_interpolation_enabled) {
-			KeyFrame::interpolate_frame_spline(key_frames, t, frame);
-		}
-		else {
-			KeyFrame::interpolate(key_frames[frame_index], key_frames[frame_index + 1], tao, frame);
-		}
-		skeleton.transform_skeleton_by_frame(frame);
+BoundingBox Mesh::computeSkinnedBounds(const Configuration& q) const
+{
+	return pose_bone_spheres(bone_spheres, q);
+}
+
+void Mesh::updateAnimation(float t)
+{
+	PROFILE_ZONE("updateAnimation");
+	// FIXME: Support Animation Here
+
+	KeyFrame frame;
+	if(KeyFrame::sample(key_frames, t, spline_interpolation_enabled, frame)) {
+		applyKeyFrame(frame);
 		gui_->set_camera_rel_orientation(frame.camera_rel_orientation);
 	}
+	// Pinned effectors stay on their goals whatever the key frames say
+	if (ik_solver.hasPinned())
+		ik_solver.solve(skeleton);
 	skeleton.refreshCache(&currentQ_);
-	
+	updateSkinnedBounds();
+	shown_pose_ = nullptr;
+}
+
+void Mesh::evaluatePose(const KeyFrame* frame, Skeleton& skeleton,
+                        const IKSolver& ik, AnimatedPose& pose) const
+{
+	PROFILE_ZONE("evaluatePose");
+	pose.animated = frame != nullptr;
+	if (frame) {
+		skeleton.transform_skeleton_by_frame(*frame);
+		poseMorphs(*frame, pose.morph_weights);
+		pose.camera_rel_orientation = frame->camera_rel_orientation;
+	}
+	if (ik.hasPinned())
+		ik.solve(skeleton);
+	skeleton.refreshCache(&pose.q);
+	computeMaterialBounds(pose.q, pose.material_bounds, pose.skinned_bounds);
+}
+
+void Mesh::applyKeyFrame(KeyFrame& frame)
+{
+	skeleton.transform_skeleton_by_frame(frame);
+	poseMorphs(frame, morph_weights);
+}
+
+void Mesh::poseMorphs(const KeyFrame& frame, std::vector<float>& weights) const
+{
+	weights.assign(morphs.size(), 0.0f);
+	std::copy(frame.morph_weights.begin(),
+	          frame.morph_weights.begin() + std::min(frame.morph_weights.size(), morphs.size()),
+	          weights.begin());
 }
 
+// Where the joint is drawn, which is the shown pose during playback
 glm::vec3 Mesh::getJointPosition(int joint_index) const
 {
+	if (shown_pose_)
+		return shown_pose_->q.trans[joint_index];
 	return skeleton.joints[joint_index].position;
 }
 
 const Configuration*
 Mesh::getCurrentQ() const
 {
-	return &currentQ_;
+	return shown_pose_ ? &shown_pose_->q : &currentQ_;
+}
+
+const std::vector<float>& Mesh::getMorphWeights() const
+{
+	return shown_pose_ ? shown_pose_->morph_weights : morph_weights;
+}
+
+const std::vector<BoundingBox>& Mesh::getMaterialBounds() const
+{
+	return shown_pose_ ? shown_pose_->material_bounds : material_bounds;
 }
 
 void Mesh::saveKeyFrame() {
@@ -317,11 +626,14 @@ void Mesh::saveKeyFrame() {
 		kf.rel_rot.push_back(skeleton.joints[i].rel_orientation);
 	}
 	kf.camera_rel_orientation = gui_->get_camera_rel_orientation();
+	kf.morph_weights = morph_weights;
 	key_frames.push_back(kf);
+	key_frames_version++;
 }
 
 void Mesh::delete_keyframe(int keyframe_index) {
 	key_frames.erase(key_frames.begin() + keyframe_index);
+	key_frames_version++;
 	// delete mesh_->textures[current_keyframe_];
 	TextureToRender* texture = textures[keyframe_index];
 	textures.erase(textures.begin() + keyframe_index);
@@ -335,6 +647,8 @@ void Mesh::overwrite_keyframe_with_current(int target_keyframe) {
 		kf.rel_rot[i] = skeleton.joints[i].rel_orientation;
 	}
 	kf.camera_rel_orientation = gui_->get_camera_rel_orientation();
+	kf.morph_weights = morph_weights;
+	key_frames_version++;
 	key_frame_to_overwrite = target_keyframe;
 	to_overwrite_keyframe = true;
 
@@ -350,8 +664,10 @@ void Mesh::insert_keyframe_before(int keyframe_index) {
 		keyframe_to_insert.rel_rot.push_back(skeleton.joints[i].rel_orientation);
 	}
 	keyframe_to_insert.camera_rel_orientation = gui_->get_camera_rel_orientation();
+	keyframe_to_insert.morph_weights = morph_weights;
 
 	key_frames.insert(key_frames.begin() + keyframe_index, keyframe_to_insert);	// std::vector::insert() inserts before pos
+	key_frames_version++;
 	textures.insert(textures.begin() + keyframe_index, nullptr);
 	key_frame_to_overwrite = keyframe_index;
 	to_overwrite_keyframe = true;
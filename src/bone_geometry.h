@@ -10,8 +10,10 @@
 #include <glm/gtc/quaternion.hpp>
 #include <mmdadapter.h>
 #include "gui.h"
+#include "ik_solver.h"
 
 class TextureToRender;
+struct ModelTextures;
 
 struct BoundingBox {
 	BoundingBox()
@@ -19,6 +21,36 @@ struct BoundingBox {
 		max(glm::vec3(std::numeric_limits<float>::max())) {}
 	glm::vec3 min;
 	glm::vec3 max;
+
+	// Empty box that any merge overrides
+	void reset()
+	{
+		min = glm::vec3(std::numeric_limits<float>::max());
+		max = glm::vec3(-std::numeric_limits<float>::max());
+	}
+	bool isEmpty() const { return min.x > max.x; }
+	void merge(const glm::vec3& p, float radius = 0.0f)
+	{
+		min = glm::min(min, p - glm::vec3(radius));
+		max = glm::max(max, p + glm::vec3(radius));
+	}
+	void merge(const BoundingBox& rhs)
+	{
+		min = glm::min(min, rhs.min);
+		max = glm::max(max, rhs.max);
+	}
+	BoundingBox transformed(const glm::mat4& m) const;
+};
+
+/*
+ * BoneSphere: sphere around the vertices a joint skins, relative to the
+ * joint (i.e. around vector_from_joint*), so it can be posed by the joint's
+ * rotation and position from a Configuration.
+ */
+struct BoneSphere {
+	int joint;
+	glm::vec3 center;
+	float radius;
 };
 
 struct Joint {
@@ -44,6 +76,7 @@ struct Joint {
 	glm::fquat rel_orientation;     // rotation w.r.t. it's parent. Used for animation.
 	glm::vec3 init_position;        // initial position of this joint
 	std::vector<int> children;
+	std::string name;               // UTF-8, used to match VMD bone tracks
 };
 
 struct Configuration {
@@ -56,6 +89,7 @@ struct Configuration {
 
 struct KeyFrame {
 	std::vector<glm::fquat> rel_rot;
+	std::vector<float> morph_weights;       // per Mesh::morphs, empty if none animated
 
 	glm::fquat camera_rel_orientation;
 	static void interpolate(const KeyFrame& from,
@@ -66,6 +100,36 @@ struct KeyFrame {
 				                        float t,
 				                        KeyFrame& target);
 	static glm::fquat catmull_rom_spline(const std::vector<glm::fquat>& cp, float t);
+	/*
+	 * Sample a clip at time t (in key frames) as playback does. Times
+	 * outside the clip leave target untouched and return false.
+	 */
+	static bool sample(std::vector<KeyFrame>& clip,
+	                   float t,
+	                   bool spline,
+	                   KeyFrame& target);
+	/*
+	 * Sample a clip at time t (in key frames), wrapping around its end.
+	 * Clips with less than two key frames leave target untouched.
+	 */
+	static bool sample_looped(std::vector<KeyFrame>& clip,
+	                          float t,
+	                          bool spline,
+	                          KeyFrame& target);
+};
+
+/*
+ * AnimatedPose: what the renderer reads of an animated mesh, so a pose
+ * evaluated on another thread (see PoseWorker) can be shown by pointing
+ * the mesh at it.
+ */
+struct AnimatedPose {
+	Configuration q;
+	std::vector<float> morph_weights;
+	std::vector<BoundingBox> material_bounds;
+	BoundingBox skinned_bounds;
+	bool animated = false;          // a key frame was sampled, camera is valid
+	glm::fquat camera_rel_orientation;
 };
 
 struct LineMesh {
@@ -75,6 +139,7 @@ struct LineMesh {
 
 struct Skeleton {
 	std::vector<Joint> joints;
+	unsigned pose_version = 0;      // bumped whenever joint positions change
 
 	Configuration cache;
 
@@ -83,13 +148,17 @@ struct Skeleton {
 	const glm::fquat* collectJointRot() const;
 
 	// FIXME: create skeleton and bone data structures
-	const glm::mat4 getBoneTransform(int joint_index) const;
+	// positions come from q if given, e.g. a pose shown instead of the joints'
+	const glm::mat4 getBoneTransform(int joint_index, const Configuration* q = nullptr) const;
 	void rotate_bone(const int bone_index, const glm::fquat& rotate_quat);	// rotate a bone and recompute all children's data
 	void update_children(Joint& parent_joint);
-	void transform_skeleton_by_frame(KeyFrame& frame);
+	void transform_skeleton_by_frame(const KeyFrame& frame);
 	void translate_root(glm::vec3 offset);
 	void set_rest_pose();
-
+	// FK without touching joints, so many characters can share one skeleton
+	void evaluate(const KeyFrame& frame, Configuration& target) const;
+private:
+	void evaluate_children(int parent_index, const KeyFrame& frame, Configuration& target) const;
 };
 
 struct Mesh {
@@ -101,17 +170,22 @@ struct Mesh {
 	/*
 	 * Static per-vertex attrributes for Shaders
 	 */
-	std::vector<int32_t> joint0;
-	std::vector<int32_t> joint1;
-	std::vector<float> weight_for_joint0; // weight_for_joint1 can be calculated
-	std::vector<glm::vec3> vector_from_joint0;
-	std::vector<glm::vec3> vector_from_joint1;
+	// Up to SparseTuple::kMaxJoints joints per vertex, unused ones weigh 0
+	std::vector<glm::ivec4> joint_ids;
+	std::vector<glm::vec4> joint_weights;
+	std::vector<glm::vec3> vector_from_joint[SparseTuple::kMaxJoints];
 	std::vector<glm::vec4> vertex_normals;
 	std::vector<glm::vec4> face_normals;
 	std::vector<glm::vec2> uv_coordinates;
 	std::vector<glm::uvec3> faces;
+	std::vector<MorphTarget> morphs;
+	std::vector<float> morph_weights;       // current weight of each morph
+	std::vector<IKChain> ik_chains;
+	IKSolver ik_solver;                     // solves the pinned chains in updateAnimation
 
 	std::vector<KeyFrame> key_frames;
+	unsigned key_frames_version = 0;        // bumped whenever key_frames change
+	float key_frame_rate = 1.0f;            // key frames per second of playback
 	std::vector<TextureToRender*> textures; // TextureToRender
 	bool to_load_animation = false;	// flag of load animation from external files
 	bool to_overwrite_keyframe = false;
@@ -124,17 +198,55 @@ struct Mesh {
 	void playAnimation();	
 
 	std::vector<Material> materials;
-	BoundingBox bounds;
+	BoundingBox bounds;             // rest pose
 	Skeleton skeleton;
 
+	/*
+	 * Bounds of the skinned mesh. The spheres are fitted once at load time,
+	 * the boxes are refreshed from the current pose by updateAnimation.
+	 */
+	std::vector<BoneSphere> bone_spheres;
+	std::vector<std::vector<BoneSphere>> material_bone_spheres;
+	std::vector<BoundingBox> material_bounds;
+	BoundingBox skinned_bounds;
+	BoundingBox computeSkinnedBounds(const Configuration& q) const;
+	void computeMaterialBounds(const Configuration& q,
+	                           std::vector<BoundingBox>& material,
+	                           BoundingBox& total) const;
+
 	void loadPmd(const std::string& fn);
 	int getNumberOfBones() const;
 	glm::vec3 getCenter() const { return 0.5f * glm::vec3(bounds.min + bounds.max); }
 	const Configuration* getCurrentQ() const; // Configuration is abbreviated as Q
+	const std::vector<float>& getMorphWeights() const;
+	const std::vector<BoundingBox>& getMaterialBounds() const;
 	void updateAnimation(float t = -1.0);
+	// Pose the skeleton and the morphs as in frame
+	void applyKeyFrame(KeyFrame& frame);
+	void poseMorphs(const KeyFrame& frame, std::vector<float>& weights) const;
+	/*
+	 * Draw pose instead of the skeleton's own until the next
+	 * updateAnimation. The pose must outlive its use.
+	 */
+	void showPose(const AnimatedPose* pose) { shown_pose_ = pose; }
+	const AnimatedPose* getShownPose() const { return shown_pose_; }
+	/*
+	 * evaluatePose: updateAnimation on a copy of the skeleton, into pose
+	 * instead of the mesh. Without a frame the skeleton keeps its pose and
+	 * pose.morph_weights are left to the caller. Threads may evaluate at
+	 * once as long as each has its own skeleton.
+	 */
+	void evaluatePose(const KeyFrame* frame, Skeleton& skeleton,
+	                  const IKSolver& ik, AnimatedPose& pose) const;
 
 	void saveAnimationTo(const std::string& fn);
 	void loadAnimationFrom(const std::string& fn);
+	/*
+	 * Replace key_frames with a VMD motion resampled every
+	 * kVmdKeyFrameInterval seconds. Tracks are matched to joints and morphs
+	 * by name.
+	 */
+	bool loadVmd(const std::string& fn);
 
 	glm::vec3 getJointPosition(int joint_index) const;
 
@@ -146,9 +258,14 @@ struct Mesh {
 
 
 private:
+	void linkJoints();
+	void loadTextures(const std::string& fn, const ModelTextures& textures);
 	void computeBounds();
+	void computeBoneSpheres();
+	void updateSkinnedBounds();
 	void computeNormals();
 	Configuration currentQ_;
+	const AnimatedPose* shown_pose_ = nullptr;
 	GUI* gui_;
 };
 
@@ -24,4 +24,39 @@ const float kFloorY = -0.75617 - kFloorEps;
 
 const float kScrollSpeed = 64.0f;
 
+// Distance between neighbouring characters of a crowd preview.
+const float kInstanceSpacing = 20.0f;
+// Samples per second of playback when a crowd clip is baked into a texture.
+const float kBakeRate = 30.0f;
+// Linked programs are cached here, relative to the working directory.
+const char* const kShaderCacheDir = "shader_cache";
+// Compressed textures of a model are cached in <model><suffix>.
+const char* const kTextureCacheSuffix = ".texcache";
+// Cooked models are cached in <model><suffix>.
+const char* const kCookedModelSuffix = ".cooked";
+// Preview textures kept on either side of those in view, the rest are freed.
+const int kPreviewsKept = 16;
+// VMD motions are keyed at 30 frames a second, imports keep every frame.
+const float kVmdFrameRate = 30.0f;
+// CCD sweeps per IK chain and frame at most, whatever the model asks for.
+const int kIKMaxIterations = 32;
+// IK chains stop once the effector is this close to its goal.
+const float kIKTolerance = 1e-3f;
+// Side of the ID picking window around the cursor, in pixels.
+const int kIdPickerSize = 9;
+// Environment variable overriding the number of job system workers.
+const char* const kJobThreadsVariable = "JOB_THREADS";
+// Zones each thread keeps for profile captures, older ones are overwritten.
+const int kProfileRingSize = 1 << 16;
+// Frames in one profile capture, written to <prefix><n>.json.
+const int kProfileCaptureFrames = 8;
+const char* const kProfileCapturePrefix = "profile_";
+// Frames behind the percentiles of the performance overlay.
+const int kHudWindowFrames = 240;
+// Characters the overlay can show, its text is clipped beyond.
+const int kHudMaxCharacters = 1024;
+// Overlay font magnification and distance from the view corner, in pixels.
+const int kHudScale = 2;
+const int kHudMargin = 8;
+
 #endif
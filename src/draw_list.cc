@@ -0,0 +1,114 @@
+#include <GL/glew.h>
+#include <debuggl.h>
+#include "draw_list.h"
+#include <algorithm>
+#include <iostream>
+#include <map>
+
+constexpr int DrawList::kMaxMaterials;
+constexpr unsigned DrawList::kBinding;
+constexpr const char* DrawList::kBlockName;
+
+DrawList::DrawList()
+{
+}
+
+DrawList::~DrawList()
+{
+	if (ubo_)
+		glDeleteBuffers(1, &ubo_);
+}
+
+bool DrawList::build(const std::vector<Material>& materials,
+                     const std::vector<glm::uvec3>& faces)
+{
+	faces_.clear();
+	source_faces_.clear();
+	batches_.clear();
+	batch_materials_.clear();
+	table_.clear();
+	batched_ = materials.size() <= size_t(kMaxMaterials);
+	if (!batched_) {
+		std::cerr << "DrawList: " << materials.size() << " materials exceed "
+		          << kMaxMaterials << ", drawing them one by one" << std::endl;
+		faces_ = faces;
+		for (size_t i = 0; i < faces.size(); i++)
+			source_faces_.emplace_back(int(i));
+		batches_ = materials;
+		for (size_t i = 0; i < materials.size(); i++)
+			batch_materials_.emplace_back(1, int(i));
+		nmaterials_ = 0;
+		return false;
+	}
+
+	// Order textures by first use so the result does not depend on pointers
+	std::map<const Image*, int> first_use;
+	for (size_t i = 0; i < materials.size(); i++)
+		first_use.emplace(materials[i].texture.get(), int(i));
+	std::vector<int> order(materials.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(),
+		[&materials, &first_use](int lhs, int rhs) {
+			return first_use[materials[lhs].texture.get()] <
+			       first_use[materials[rhs].texture.get()];
+		});
+
+	faces_.reserve(faces.size());
+	source_faces_.reserve(faces.size());
+	for (int mid : order) {
+		const Material& ma = materials[mid];
+		if (batches_.empty() || batches_.back().texture != ma.texture) {
+			batches_.emplace_back(ma);
+			batches_.back().offset = faces_.size();
+			batches_.back().nfaces = 0;
+			batch_materials_.emplace_back();
+		}
+		Entry entry;
+		entry.diffuse = ma.diffuse;
+		entry.ambient = ma.ambient;
+		entry.specular = ma.specular;
+		entry.shininess = ma.shininess;
+		entry.first_face = faces_.size();
+		table_.emplace_back(entry);
+
+		faces_.insert(faces_.end(),
+		              faces.begin() + ma.offset,
+		              faces.begin() + ma.offset + ma.nfaces);
+		for (size_t k = 0; k < ma.nfaces; k++)
+			source_faces_.emplace_back(int(ma.offset + k));
+		batches_.back().nfaces += ma.nfaces;
+		batch_materials_.back().emplace_back(mid);
+	}
+	nmaterials_ = table_.size();
+	std::cerr << "DrawList: " << materials.size() << " materials in "
+	          << batches_.size() << " batches" << std::endl;
+	return true;
+}
+
+void DrawList::upload()
+{
+	if (!batched_)
+		return;
+	if (!ubo_)
+		CHECK_GL_ERROR(glGenBuffers(1, &ubo_));
+	CHECK_GL_ERROR(glBindBuffer(GL_UNIFORM_BUFFER, ubo_));
+	CHECK_GL_ERROR(glBufferData(GL_UNIFORM_BUFFER, kMaxMaterials * sizeof(Entry),
+	                            nullptr, GL_STATIC_DRAW));
+	CHECK_GL_ERROR(glBufferSubData(GL_UNIFORM_BUFFER, 0, table_.size() * sizeof(Entry),
+	                               table_.data()));
+	CHECK_GL_ERROR(glBindBufferBase(GL_UNIFORM_BUFFER, kBinding, ubo_));
+	CHECK_GL_ERROR(glBindBuffer(GL_UNIFORM_BUFFER, 0));
+}
+
+BoundingBox DrawList::getBatchBounds(int i, const std::vector<BoundingBox>& material_bounds) const
+{
+	BoundingBox bounds;
+	bounds.reset();
+	for (int mid : batch_materials_[i]) {
+		if (mid >= int(material_bounds.size()))
+			return BoundingBox();
+		bounds.merge(material_bounds[mid]);
+	}
+	return bounds;
+}
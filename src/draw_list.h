@@ -0,0 +1,70 @@
+#ifndef DRAW_LIST_H
+#define DRAW_LIST_H
+
+#include <vector>
+#include <glm/glm.hpp>
+#include <material.h>
+#include "bone_geometry.h"
+
+/*
+ * DrawList: the material ranges of a mesh regrouped into few draws.
+ *
+ * Materials are stably sorted by texture and their faces copied in that
+ * order, so every run of materials sharing a texture becomes one batch.
+ * Batches are plain Materials (a texture and a face range), hence a
+ * RenderPass fed with getFaces() and getBatches() draws one batch per
+ * renderWithMaterial call and binds a texture only when it changes.
+ *
+ * The Phong parameters of the original materials go to the MaterialTable
+ * uniform block, sorted by first face. shaders/batched.geom looks the
+ * material of each face up there, see shaders/batched.frag.
+ */
+class DrawList {
+public:
+	static constexpr int kMaxMaterials = 256;  // 64 bytes each, fills the 16KB block minimum
+	static constexpr unsigned kBinding = 1;
+	static constexpr const char* kBlockName = "MaterialTable";
+
+	DrawList();
+	~DrawList();
+
+	/*
+	 * build: group materials by texture.
+	 * Return: false if the materials don't fit the table. The batches are
+	 *         the materials as they are then, for the unbatched shaders.
+	 */
+	bool build(const std::vector<Material>& materials,
+	           const std::vector<glm::uvec3>& faces);
+	void upload();
+
+	bool isBatched() const { return batched_; }
+	const std::vector<glm::uvec3>& getFaces() const { return faces_; }
+	// Index into the faces given to build() of every face in getFaces()
+	const std::vector<int>& getSourceFaces() const { return source_faces_; }
+	const std::vector<Material>& getBatches() const { return batches_; }
+	int getNumberOfMaterials() const { return int(table_.size()); }
+	const int* getNumberOfMaterialsPointer() const { return &nmaterials_; }
+	// Union of the bounds of the materials in batch i, infinite if unknown
+	BoundingBox getBatchBounds(int i, const std::vector<BoundingBox>& material_bounds) const;
+private:
+	// std140 layout of one MaterialTable entry
+	struct Entry {
+		glm::vec4 diffuse;
+		glm::vec4 ambient;
+		glm::vec4 specular;
+		float shininess;
+		int first_face;
+		float padding[2];
+	};
+
+	bool batched_ = false;
+	int nmaterials_ = 0;
+	std::vector<glm::uvec3> faces_;
+	std::vector<int> source_faces_;
+	std::vector<Material> batches_;
+	std::vector<std::vector<int>> batch_materials_;
+	std::vector<Entry> table_;
+	unsigned ubo_ = 0;
+};
+
+#endif
@@ -0,0 +1,60 @@
+#include <GL/glew.h>
+#include <debuggl.h>
+#include "frame_uniforms.h"
+#include <cstring>
+#include <iostream>
+
+constexpr unsigned FrameUniforms::kBinding;
+constexpr const char* FrameUniforms::kBlockName;
+const char* const FrameUniforms::kBlockSource = R"zzz(
+layout(std140) uniform FrameConstants {
+	mat4 projection;
+	mat4 view;
+	mat4 model;
+	vec4 light_position;
+	vec3 camera_position;
+};
+)zzz";
+
+FrameUniforms::FrameUniforms()
+{
+	CHECK_GL_ERROR(glGenBuffers(1, &ubo_));
+	CHECK_GL_ERROR(glBindBuffer(GL_UNIFORM_BUFFER, ubo_));
+	CHECK_GL_ERROR(glBufferData(GL_UNIFORM_BUFFER, sizeof(Block), nullptr, GL_DYNAMIC_DRAW));
+	CHECK_GL_ERROR(glBindBufferBase(GL_UNIFORM_BUFFER, kBinding, ubo_));
+	CHECK_GL_ERROR(glBindBuffer(GL_UNIFORM_BUFFER, 0));
+}
+
+FrameUniforms::~FrameUniforms()
+{
+	glDeleteBuffers(1, &ubo_);
+}
+
+void FrameUniforms::update(const MatrixPointers& mats,
+                           const glm::vec4& light_position,
+                           const glm::vec3& camera_position)
+{
+	std::memcpy(&block_.projection[0][0], mats.projection, sizeof(glm::mat4));
+	std::memcpy(&block_.view[0][0], mats.view, sizeof(glm::mat4));
+	std::memcpy(&block_.model[0][0], mats.model, sizeof(glm::mat4));
+	block_.light_position = light_position;
+	block_.camera_position = glm::vec4(camera_position, 1.0f);
+	upload();
+}
+
+void FrameUniforms::setProjection(const glm::mat4& projection)
+{
+	block_.projection = projection;
+	upload();
+}
+
+void FrameUniforms::upload()
+{
+	if (valid_ && std::memcmp(&block_, &uploaded_, sizeof(Block)) == 0)
+		return;
+	CHECK_GL_ERROR(glBindBuffer(GL_UNIFORM_BUFFER, ubo_));
+	CHECK_GL_ERROR(glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Block), &block_));
+	CHECK_GL_ERROR(glBindBuffer(GL_UNIFORM_BUFFER, 0));
+	uploaded_ = block_;
+	valid_ = true;
+}
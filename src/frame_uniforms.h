@@ -0,0 +1,50 @@
+#ifndef FRAME_UNIFORMS_H
+#define FRAME_UNIFORMS_H
+
+#include <glm/glm.hpp>
+#include "gui.h"
+
+/*
+ * FrameUniforms: camera and light shared by all programs through the
+ * FrameConstants uniform block, so passes don't bind them one by one.
+ *
+ * kBlockSource declares the block; main.cc has RenderPass prepend it to
+ * every shader and bind it to kBinding at link time, so shaders use the
+ * members without declaring them.
+ *
+ * Call update() once per frame, and again for render targets with their
+ * own camera. Unchanged constants are not uploaded again.
+ */
+class FrameUniforms {
+public:
+	static constexpr unsigned kBinding = 0;
+	static constexpr const char* kBlockName = "FrameConstants";
+	static const char* const kBlockSource;
+
+	FrameUniforms();
+	~FrameUniforms();
+
+	void update(const MatrixPointers& mats,
+	            const glm::vec4& light_position,
+	            const glm::vec3& camera_position);
+	// setProjection: replace only the projection, e.g. for IdPicker.
+	void setProjection(const glm::mat4& projection);
+private:
+	// Mirrors the std140 layout of kBlockSource
+	struct Block {
+		glm::mat4 projection;
+		glm::mat4 view;
+		glm::mat4 model;
+		glm::vec4 light_position;
+		glm::vec4 camera_position;  // w is padding
+	};
+
+	void upload();
+
+	Block block_;
+	Block uploaded_;
+	bool valid_ = false;
+	unsigned ubo_ = 0;
+};
+
+#endif
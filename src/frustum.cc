@@ -0,0 +1,30 @@
+#include "frustum.h"
+#include "bone_geometry.h"
+
+// Gribb & Hartmann, "Fast Extraction of Viewing Frustum Planes from the
+// World-View-Projection Matrix". glm matrices are column major.
+Frustum::Frustum(const glm::mat4& mvp)
+{
+	glm::vec4 rows[4];
+	for (int i = 0; i < 4; i++)
+		rows[i] = glm::vec4(mvp[0][i], mvp[1][i], mvp[2][i], mvp[3][i]);
+	for (int i = 0; i < 3; i++) {
+		planes[2 * i] = rows[3] + rows[i];
+		planes[2 * i + 1] = rows[3] - rows[i];
+	}
+}
+
+bool Frustum::intersects(const BoundingBox& box) const
+{
+	if (box.isEmpty())
+		return false;
+	for (const auto& plane : planes) {
+		// The corner furthest along the normal decides
+		glm::vec3 p(plane.x >= 0.0f ? box.max.x : box.min.x,
+		            plane.y >= 0.0f ? box.max.y : box.min.y,
+		            plane.z >= 0.0f ? box.max.z : box.min.z);
+		if (glm::dot(glm::vec3(plane), p) + plane.w < 0.0f)
+			return false;
+	}
+	return true;
+}
@@ -0,0 +1,21 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+#include <glm/glm.hpp>
+
+struct BoundingBox;
+
+/*
+ * Frustum: the six clip planes of a projection * view * model matrix,
+ * used to skip geometry that can't reach the screen.
+ */
+struct Frustum {
+	Frustum(const glm::mat4& mvp);
+
+	// Conservative: boxes near the corners may pass although invisible.
+	bool intersects(const BoundingBox& box) const;
+
+	glm::vec4 planes[6]; // xyz: inward normal, w: offset
+};
+
+#endif
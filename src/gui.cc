@@ -3,6 +3,7 @@
 #include <jpegio.h>
 #include "bone_geometry.h"
 #include "texture_to_render.h"
+#include "profiler.h"
 
 #include <iostream>
 #include <debuggl.h>
@@ -36,13 +37,12 @@ GUI::GUI(GLFWwindow* window, int view_width, int view_height, int preview_height
 	}
 	float aspect_ = static_cast<float>(view_width_) / view_height_;
 	projection_matrix_ = glm::perspective((float)(kFov * (M_PI / 180.0f)), aspect_, kNear, kFar);
-	*timer_ = tic();
+	play_clock_ = Profiler::nowNs();
 
 }
 
 GUI::~GUI()
 {
-	free(timer_);
 }
 
 void GUI::assignMesh(Mesh* mesh)
@@ -119,7 +119,7 @@ void GUI::keyCallback(int key, int scancode, int action, int mods)
 	} else if (key == GLFW_KEY_P && action != GLFW_RELEASE) {	// resume/pause timer
 		if(!play_) {
 			play_ = true;
-			*timer_ = tic();
+			play_clock_ = Profiler::nowNs();
 		} else {
 			play_ = false;
 		}
@@ -136,7 +136,7 @@ void GUI::keyCallback(int key, int scancode, int action, int mods)
 		}
 	} else if(key == GLFW_KEY_SPACE && action != GLFW_RELEASE) {
 		if(current_keyframe_ != -1) {	// bone selected
-			mesh_->skeleton.transform_skeleton_by_frame(mesh_->key_frames[current_keyframe_]);
+			mesh_->applyKeyFrame(mesh_->key_frames[current_keyframe_]);
 			set_camera_rel_orientation(mesh_->key_frames[current_keyframe_].camera_rel_orientation);
 			mesh_->updateAnimation();
 		}
@@ -151,9 +151,28 @@ void GUI::keyCallback(int key, int scancode, int action, int mods)
 
 	} else if(key == GLFW_KEY_O && action != GLFW_RELEASE) {
 		time_ = 0;
-		*timer_ = tic();
+		play_clock_ = Profiler::nowNs();
 		play_ = true;
 		to_export_video_ = true;
+	} else if(key == GLFW_KEY_B && action != GLFW_RELEASE) {
+		// toggle baked crowd playback, rebaked from the current keyframes
+		baked_playback_ = !baked_playback_;
+		std::cout << "baked crowd playback enabled? " << baked_playback_ << std::endl;
+	} else if(key == GLFW_KEY_G && action != GLFW_RELEASE) {
+		// toggle hover picking between the ID buffer and the bone BVH
+		gpu_picking_ = !gpu_picking_;
+		std::cout << "GPU picking enabled? " << gpu_picking_ << std::endl;
+	} else if(key == GLFW_KEY_K && action != GLFW_RELEASE) {
+		// toggle IK dragging, leaving it lets go of the pinned effectors
+		ik_mode_ = !ik_mode_;
+		if (!ik_mode_)
+			mesh_->ik_solver.releaseAll();
+		std::cout << "IK dragging enabled? " << ik_mode_ << std::endl;
+	} else if(key == GLFW_KEY_H && action == GLFW_PRESS) {
+		show_hud_ = !show_hud_;
+	} else if(key == GLFW_KEY_L && action == GLFW_PRESS) {
+		// profile the next few frames into a trace file
+		Profiler::capture();
 	} else if(key == GLFW_KEY_PAGE_UP && action != GLFW_RELEASE) {
 		if(mesh_->textures.size() > 0) {
 			current_keyframe_ = (int) (current_keyframe_ - 1 + mesh_->textures.size()) % mesh_->textures.size();
@@ -224,6 +243,22 @@ void GUI::mousePosCallback(double mouse_x, double mouse_y)
 		tangent_ = glm::column(orientation_, 0);
 		up_ = glm::column(orientation_, 1);
 		look_ = glm::column(orientation_, 2);
+	} else if (drag_bone && ik_mode_ && current_bone_ != -1 &&
+	           mesh_->ik_solver.findChain(current_bone_) != -1) {
+		// Move the goal of the effector in the view plane, updateAnimation
+		// solves its chain once per frame
+		IKSolver& ik = mesh_->ik_solver;
+		int chain = ik.findChain(current_bone_);
+		glm::vec3 goal = ik.isPinned(chain) ? ik.getGoal(chain)
+		                                    : mesh_->getJointPosition(current_bone_);
+		float projected_depth = glm::project(goal, view_matrix_, projection_matrix_, viewport).z;
+		glm::vec3 cursor_pos_3d_0 = glm::unProject(glm::vec3(last_x_, last_y_, projected_depth),
+		                                           view_matrix_, projection_matrix_, viewport);
+		glm::vec3 cursor_pos_3d_1 = glm::unProject(glm::vec3(current_x_, current_y_, projected_depth),
+		                                           view_matrix_, projection_matrix_, viewport);
+		ik.pin(chain, goal + cursor_pos_3d_1 - cursor_pos_3d_0);
+		setPoseDirty();
+		return ;
 	} else if (drag_bone && current_bone_ != -1) {
 		// FIXME: Handle bone rotation
 		int parent_index = mesh_->skeleton.joints[current_bone_].parent_index;
@@ -277,7 +312,10 @@ void GUI::mousePosCallback(double mouse_x, double mouse_y)
 	}
 
 	// FIXME: highlight bones that have been moused over
-	current_bone_ = -1;
+	// Keep the highlight while orbiting, the bones don't move under the cursor
+	// The ID buffer reports its hover result through setPickResult
+	if (drag_camera || gpu_picking_)
+		return;
 	glm::vec3 mouse_pos = glm::unProject(glm::vec3(current_x_, current_y_, 1.0f),
 											view_matrix_,
 											projection_matrix_,
@@ -285,21 +323,49 @@ void GUI::mousePosCallback(double mouse_x, double mouse_y)
 	// std::cout << "current position in world coords: (" << mouse_pos.x << ", " << mouse_pos.y << ", " << mouse_pos.z << ")" << std::endl;
 	glm::vec3 click_ray_direct = glm::normalize(mouse_pos - eye_);
 	glm::vec3 click_ray_end = eye_ + PICK_RAY_LEN * click_ray_direct;
-	float min_distance = std::numeric_limits<float>::max();
-	for(int i = 0; i < mesh_->getNumberOfBones(); i++) {	// iterate all bones, and find the one with min distance
-		int parent_index = mesh_->skeleton.joints[i].parent_index;
-		if(parent_index == -1) {
-			continue;	// this joint is a root.
-		}
-		glm::vec3 bone_start_position = mesh_->getJointPosition(i);
-		glm::vec3 bone_end_position = mesh_->getJointPosition(parent_index);
-		float curr_distance = line_segment_distance(eye_, click_ray_end, bone_start_position, bone_end_position);
-		if(curr_distance < kCylinderRadius && curr_distance < min_distance) {
-			min_distance = curr_distance;
-			current_bone_ = i;
+	current_bone_ = pickBone(eye_, click_ray_end);
+}
+
+// Find the bone with min distance to the ray. The BVH is rebuilt when
+// bones are added and refitted whenever the drawn pose changed: during
+// playback that is the pose the worker published, which changes every
+// frame and is not tracked by pose_version.
+int GUI::pickBone(const glm::vec3& ray_start, const glm::vec3& ray_end)
+{
+	const Skeleton& skeleton = mesh_->skeleton;
+	bool playing_pose = mesh_->getShownPose() != nullptr;
+	if (bone_capsules_.empty() || playing_pose || bvh_pose_version_ != skeleton.pose_version) {
+		bone_capsules_.clear();
+		for(const Joint& joint : skeleton.joints) {
+			if(joint.parent_index == -1)
+				continue;	// this joint is a root.
+			bone_capsules_.push_back({ mesh_->getJointPosition(joint.joint_index),
+			                           mesh_->getJointPosition(joint.parent_index),
+			                           joint.joint_index });
 		}
+		if (bone_bvh_.size() != bone_capsules_.size())
+			bone_bvh_.build(bone_capsules_);
+		else
+			bone_bvh_.refit(bone_capsules_);
+		bvh_pose_version_ = skeleton.pose_version;
 	}
+	return bone_bvh_.pick(ray_start, ray_end, kCylinderRadius);
+}
+
+bool GUI::isCursorInMainView() const
+{
+	return current_x_ >= 0.0f && current_x_ < view_width_ &&
+	       current_y_ >= 0.0f && current_y_ < view_height_;
+}
 
+void GUI::setPickResult(const IdPicker::Result& result)
+{
+	hovered_face_ = result.face;
+	hovered_material_ = result.material;
+	// Never switch bones in the middle of a drag
+	if (!gpu_picking_ || drag_state_)
+		return;
+	current_bone_ = result.bone;
 }
 
 void GUI::mouseButtonCallback(int button, int action, int mods)
@@ -307,6 +373,11 @@ void GUI::mouseButtonCallback(int button, int action, int mods)
 	if (current_x_ <= view_width_) {
 		drag_state_ = (action == GLFW_PRESS);
 		current_button_ = button;
+		if (gpu_picking_ && action == GLFW_PRESS &&
+		    button == GLFW_MOUSE_BUTTON_LEFT && hovered_face_ >= 0) {
+			std::cout << "picked face " << hovered_face_
+			          << " of material " << hovered_material_ << std::endl;
+		}
 		return ;
 	} else if(current_x_ > (window_width_ - scroll_bar_width_) && current_x_ < window_width_) {	// drag scroll bar
 		drag_scroll_bar_state_ = (action == GLFW_PRESS);
@@ -379,8 +450,9 @@ bool GUI::setCurrentBone(int i)
 
 float GUI::getCurrentPlayTime()
 {
-	double delta_time = toc(timer_);
-	time_ += delta_time;
+	uint64_t now = Profiler::nowNs();
+	time_ += (now - play_clock_) * 1e-9;
+	play_clock_ = now;
 	return time_;
 	// return 0.0f;
 }
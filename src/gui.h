@@ -5,7 +5,8 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <GLFW/glfw3.h>
 #include "procedure_geometry.h"
-#include "tictoc.h"
+#include "bone_bvh.h"
+#include "id_picker.h"
 
 #define PICK_RAY_LEN 1000.0f	// shoot a ray of this len when picking bones
 
@@ -30,6 +31,9 @@ public:
 	void mouseScrollCallback(double dx, double dy);
 	void updateMatrices();
 	MatrixPointers getMatrixPointers() const;
+	glm::mat4 getViewProjectionMatrix() const { return projection_matrix_ * view_matrix_ * model_matrix_; }
+	glm::mat4 getModelViewMatrix() const { return view_matrix_ * model_matrix_; }
+	const glm::mat4& getProjectionMatrix() const { return projection_matrix_; }
 
 	static void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods);
 	static void MousePosCallback(GLFWwindow* window, double mouse_x, double mouse_y);
@@ -46,6 +50,13 @@ public:
 	int getCurrentBone() const { return current_bone_; }
 	const int* getCurrentBonePointer() const { return &current_bone_; }
 	bool setCurrentBone(int i);
+	/*
+	 * Cursor in main view pixels, origin at the bottom left.
+	 */
+	glm::vec2 getCursor() const { return glm::vec2(current_x_, current_y_); }
+	bool isCursorInMainView() const;
+	// Hover result of the ID buffer, used instead of the BVH unless G toggled it off
+	void setPickResult(const IdPicker::Result& result);
 
 	bool isTransparent() const { return transparent_; }
 	bool isPlaying() const { return play_; }
@@ -66,6 +77,8 @@ public:
 
 
 	bool to_export_video_ = false;
+	bool baked_playback_ = false;	// crowd plays from a baked texture, toggled by B
+	bool show_hud_ = false;	// performance overlay, toggled by H
 	FILE* export_file = NULL;
 
 private:
@@ -84,6 +97,10 @@ private:
 
 	bool insert_keyframe_enabled_ = false;
 	int current_bone_ = -1;
+	bool gpu_picking_ = true;
+	bool ik_mode_ = false;          // left drag moves IK effectors, toggled by K
+	int hovered_face_ = -1;
+	int hovered_material_ = -1;
 	int current_keyframe_ = -1;
 	int current_button_ = -1;
 	float roll_speed_ = M_PI / 64.0f;
@@ -94,7 +111,7 @@ private:
 	float zoom_speed_ = 0.1f;
 	float aspect_;
 
-	TicTocTimer* timer_ = (TicTocTimer*) malloc(sizeof(TicTocTimer));
+	uint64_t play_clock_ = 0;	// Profiler::nowNs() when time_ was last advanced
 	float time_ = 0.0;	// fake timer for temp use.
 
 	int frame_shift = 0;
@@ -127,6 +144,11 @@ private:
 
 
 	bool captureWASDUPDOWN(int key, int action);
+	int pickBone(const glm::vec3& ray_start, const glm::vec3& ray_end);
+
+	BoneBVH bone_bvh_;
+	std::vector<BoneBVH::Capsule> bone_capsules_;
+	unsigned bvh_pose_version_ = 0;
 	unsigned char* export_buffer_;
 	bool play_ = false;
 
@@ -0,0 +1,53 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <string>
+
+/*
+ * 64 bit FNV-1a for cache keys. Chain calls by passing the previous hash.
+ * Not cryptographic: a collision only costs a stale cache entry.
+ */
+const uint64_t kHashSeed = 14695981039346656037ull;
+
+inline uint64_t hash_bytes(const void* data, size_t bytes, uint64_t hash = kHashSeed)
+{
+	const unsigned char* p = (const unsigned char*)data;
+	for (size_t i = 0; i < bytes; i++) {
+		hash ^= p[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+inline uint64_t hash_string(const std::string& s, uint64_t hash = kHashSeed)
+{
+	// Hash the terminator too, so ("ab", "c") and ("a", "bc") differ
+	return hash_bytes(s.c_str(), s.size() + 1, hash);
+}
+
+// hash_file: hash of the whole file, false if it cannot be read
+inline bool hash_file(const std::string& fn, uint64_t& hash)
+{
+	FILE* file = fopen(fn.c_str(), "rb");
+	if (!file)
+		return false;
+	hash = kHashSeed;
+	char buf[1 << 16];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), file)) > 0)
+		hash = hash_bytes(buf, n, hash);
+	fclose(file);
+	return true;
+}
+
+inline std::string hash_to_hex(uint64_t hash)
+{
+	char buf[17];
+	snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)hash);
+	return buf;
+}
+
+#endif
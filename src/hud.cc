@@ -0,0 +1,246 @@
+#include <GL/glew.h>
+#include <debuggl.h>
+#include "hud.h"
+#include "config.h"
+#include "profiler.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <iostream>
+
+namespace {
+	const int kFirstGlyph = 32;
+	const int kGlyphs = 64;
+	const int kCellWidth = 6;       // 5 pixels of glyph and one of spacing
+	const int kCellHeight = 8;
+
+	// One byte per row, top row first, bit 4 is the leftmost pixel
+	const unsigned char kFont[kGlyphs][7] = {
+		{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // space
+		{ 0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04 },  // !
+		{ 0x0a, 0x0a, 0x0a, 0x00, 0x00, 0x00, 0x00 },  // double quote
+		{ 0x0a, 0x0a, 0x1f, 0x0a, 0x1f, 0x0a, 0x0a },  // #
+		{ 0x04, 0x0f, 0x14, 0x0e, 0x05, 0x1e, 0x04 },  // $
+		{ 0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03 },  // %
+		{ 0x0c, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0d },  // &
+		{ 0x04, 0x04, 0x04, 0x00, 0x00, 0x00, 0x00 },  // quote
+		{ 0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02 },  // (
+		{ 0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08 },  // )
+		{ 0x00, 0x04, 0x15, 0x0e, 0x15, 0x04, 0x00 },  // *
+		{ 0x00, 0x04, 0x04, 0x1f, 0x04, 0x04, 0x00 },  // +
+		{ 0x00, 0x00, 0x00, 0x00, 0x0c, 0x04, 0x08 },  // ,
+		{ 0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00 },  // -
+		{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c },  // .
+		{ 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00 },  // /
+		{ 0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e },  // 0
+		{ 0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e },  // 1
+		{ 0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f },  // 2
+		{ 0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e },  // 3
+		{ 0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02 },  // 4
+		{ 0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e },  // 5
+		{ 0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e },  // 6
+		{ 0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 },  // 7
+		{ 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e },  // 8
+		{ 0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c },  // 9
+		{ 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00 },  // :
+		{ 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x04, 0x08 },  // ;
+		{ 0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02 },  // <
+		{ 0x00, 0x00, 0x1f, 0x00, 0x1f, 0x00, 0x00 },  // =
+		{ 0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08 },  // >
+		{ 0x0e, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04 },  // ?
+		{ 0x0e, 0x11, 0x01, 0x0d, 0x15, 0x15, 0x0e },  // @
+		{ 0x0e, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 },  // A
+		{ 0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e },  // B
+		{ 0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e },  // C
+		{ 0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c },  // D
+		{ 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f },  // E
+		{ 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10 },  // F
+		{ 0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f },  // G
+		{ 0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 },  // H
+		{ 0x0e, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e },  // I
+		{ 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0c },  // J
+		{ 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 },  // K
+		{ 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f },  // L
+		{ 0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11 },  // M
+		{ 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11 },  // N
+		{ 0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e },  // O
+		{ 0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10 },  // P
+		{ 0x0e, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0d },  // Q
+		{ 0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11 },  // R
+		{ 0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e },  // S
+		{ 0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 },  // T
+		{ 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e },  // U
+		{ 0x11, 0x11, 0x11, 0x11, 0x11, 0x0a, 0x04 },  // V
+		{ 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a },  // W
+		{ 0x11, 0x11, 0x0a, 0x04, 0x0a, 0x11, 0x11 },  // X
+		{ 0x11, 0x11, 0x0a, 0x04, 0x04, 0x04, 0x04 },  // Y
+		{ 0x1f, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1f },  // Z
+		{ 0x0e, 0x08, 0x08, 0x08, 0x08, 0x08, 0x0e },  // [
+		{ 0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00 },  // backslash
+		{ 0x0e, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0e },  // ]
+		{ 0x04, 0x0a, 0x11, 0x00, 0x00, 0x00, 0x00 },  // ^
+		{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1f },  // _
+	};
+}
+
+void Hud::Window::push(float sample)
+{
+	if (samples.size() < size_t(kHudWindowFrames)) {
+		samples.emplace_back(sample);
+		return;
+	}
+	samples[next] = sample;
+	next = (next + 1) % samples.size();
+}
+
+float Hud::Window::percentile(float p) const
+{
+	if (samples.empty())
+		return 0.0f;
+	std::vector<float> sorted = samples;
+	size_t k = std::min(sorted.size() - 1, size_t(p * sorted.size()));
+	std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+	return sorted[k];
+}
+
+Hud::Hud()
+{
+	int width = kGlyphs * kCellWidth;
+	std::vector<unsigned char> pixels(width * kCellHeight, 0);
+	for (int g = 0; g < kGlyphs; g++)
+		for (int y = 0; y < 7; y++)
+			for (int x = 0; x < 5; x++)
+				if (kFont[g][y] & (0x10 >> x))
+					pixels[y * width + g * kCellWidth + x] = 255;
+	CHECK_GL_ERROR(glGenTextures(1, &font_tex_));
+	CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_2D, font_tex_));
+	CHECK_GL_ERROR(glPixelStorei(GL_UNPACK_ALIGNMENT, 1));
+	CHECK_GL_ERROR(glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, width, kCellHeight, 0,
+	                            GL_RED, GL_UNSIGNED_BYTE, pixels.data()));
+	CHECK_GL_ERROR(glPixelStorei(GL_UNPACK_ALIGNMENT, 4));
+	CHECK_GL_ERROR(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+	CHECK_GL_ERROR(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+	CHECK_GL_ERROR(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+	CHECK_GL_ERROR(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+	CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_2D, 0));
+
+	for (auto& timing : timings_) {
+		CHECK_GL_ERROR(glGenQueries(1, &timing.begin));
+		CHECK_GL_ERROR(glGenQueries(1, &timing.end));
+	}
+
+	// Counter-clockwise: top left, bottom left, bottom right, top right
+	for (unsigned i = 0; i < unsigned(kHudMaxCharacters); i++) {
+		faces_.emplace_back(4 * i, 4 * i + 1, 4 * i + 2);
+		faces_.emplace_back(4 * i, 4 * i + 2, 4 * i + 3);
+	}
+	vertices_.reserve(4 * kHudMaxCharacters);
+}
+
+Hud::~Hud()
+{
+	for (auto& timing : timings_) {
+		glDeleteQueries(1, &timing.begin);
+		glDeleteQueries(1, &timing.end);
+	}
+	glDeleteTextures(1, &font_tex_);
+}
+
+void Hud::resolveGpuTimings()
+{
+	for (auto& timing : timings_) {
+		if (!timing.pending)
+			continue;
+		GLint available = 0;
+		CHECK_GL_ERROR(glGetQueryObjectiv(timing.end, GL_QUERY_RESULT_AVAILABLE, &available));
+		if (!available)
+			continue;
+		GLuint64 begin = 0, end = 0;
+		CHECK_GL_ERROR(glGetQueryObjectui64v(timing.begin, GL_QUERY_RESULT, &begin));
+		CHECK_GL_ERROR(glGetQueryObjectui64v(timing.end, GL_QUERY_RESULT, &end));
+		gpu_ms_.push((end - begin) * 1e-6f);
+		timing.pending = false;
+	}
+}
+
+void Hud::beginFrame()
+{
+	resolveGpuTimings();
+	// Skip GPU timing rather than wait when the GPU is kTimings frames behind
+	GpuTiming& timing = timings_[frame_ % kTimings];
+	timing_gpu_ = !timing.pending;
+	if (timing_gpu_)
+		CHECK_GL_ERROR(glQueryCounter(timing.begin, GL_TIMESTAMP));
+
+	cpu_begin_ = Profiler::nowNs();
+	if (last_begin_)
+		interval_ms_.push((cpu_begin_ - last_begin_) * 1e-6f);
+	last_begin_ = cpu_begin_;
+}
+
+void Hud::endFrame()
+{
+	cpu_ms_.push((Profiler::nowNs() - cpu_begin_) * 1e-6f);
+	GpuTiming& timing = timings_[frame_ % kTimings];
+	if (timing_gpu_) {
+		CHECK_GL_ERROR(glQueryCounter(timing.end, GL_TIMESTAMP));
+		timing.pending = true;
+	}
+	frame_++;
+}
+
+void Hud::layout(const HudCounters& counters, int view_width, int view_height)
+{
+	vertices_.clear();
+	char line[128];
+	int row = 0;
+	float interval = interval_ms_.percentile(0.5f);
+	snprintf(line, sizeof(line), "FPS %.0f", interval > 0.0f ? 1000.0f / interval : 0.0f);
+	addLine(line, row++, view_width, view_height);
+	snprintf(line, sizeof(line), "CPU MS  P50 %6.2f  P95 %6.2f  P99 %6.2f",
+	         cpu_ms_.percentile(0.5f), cpu_ms_.percentile(0.95f), cpu_ms_.percentile(0.99f));
+	addLine(line, row++, view_width, view_height);
+	if (gpu_ms_.samples.empty())
+		snprintf(line, sizeof(line), "GPU MS  -");
+	else
+		snprintf(line, sizeof(line), "GPU MS  P50 %6.2f  P95 %6.2f  P99 %6.2f",
+		         gpu_ms_.percentile(0.5f), gpu_ms_.percentile(0.95f), gpu_ms_.percentile(0.99f));
+	addLine(line, row++, view_width, view_height);
+	snprintf(line, sizeof(line), "DRAWS %zu  TRIANGLES %zu", counters.draws, counters.triangles);
+	addLine(line, row++, view_width, view_height);
+	snprintf(line, sizeof(line), "UNIFORMS %zu  SKIPPED %zu",
+	         counters.uniforms_issued, counters.uniforms_skipped);
+	addLine(line, row++, view_width, view_height);
+	snprintf(line, sizeof(line), "BONES %d", counters.bones);
+	addLine(line, row++, view_width, view_height);
+	snprintf(line, sizeof(line), "PREVIEWS %zu  %.1f MB", counters.previews,
+	         counters.preview_bytes / (1024.0 * 1024.0));
+	addLine(line, row++, view_width, view_height);
+	if (counters.export_frames < 0)
+		snprintf(line, sizeof(line), "EXPORT IDLE");
+	else
+		snprintf(line, sizeof(line), "EXPORT %d FRAMES", counters.export_frames);
+	addLine(line, row++, view_width, view_height);
+}
+
+void Hud::addLine(const char* text, int row, int view_width, int view_height)
+{
+	float cell_w = kCellWidth * kHudScale, cell_h = kCellHeight * kHudScale;
+	float y0 = kHudMargin + row * cell_h;
+	for (int col = 0; text[col] && vertices_.size() < size_t(4 * kHudMaxCharacters); col++) {
+		int glyph = std::toupper((unsigned char)text[col]) - kFirstGlyph;
+		if (glyph < 0 || glyph >= kGlyphs)
+			glyph = '?' - kFirstGlyph;
+		float x0 = kHudMargin + col * cell_w;
+		// Pixels to clip space, y down from the top of the view
+		float left = 2.0f * x0 / view_width - 1.0f;
+		float right = 2.0f * (x0 + cell_w) / view_width - 1.0f;
+		float top = 1.0f - 2.0f * y0 / view_height;
+		float bottom = 1.0f - 2.0f * (y0 + cell_h) / view_height;
+		float u0 = float(glyph) / kGlyphs, u1 = float(glyph + 1) / kGlyphs;
+		vertices_.emplace_back(left, top, u0, 0.0f);
+		vertices_.emplace_back(left, bottom, u0, 1.0f);
+		vertices_.emplace_back(right, bottom, u1, 1.0f);
+		vertices_.emplace_back(right, top, u1, 0.0f);
+	}
+}
@@ -0,0 +1,85 @@
+#ifndef HUD_H
+#define HUD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+/*
+ * HudCounters: what the frame did, gathered by main.cc for the overlay.
+ */
+struct HudCounters {
+	size_t draws = 0;
+	size_t triangles = 0;
+	size_t uniforms_issued = 0;
+	size_t uniforms_skipped = 0;
+	int bones = 0;
+	size_t previews = 0;
+	size_t preview_bytes = 0;
+	int export_frames = -1;         // frames piped to the encoder, -1 when not exporting
+};
+
+/*
+ * Hud: performance overlay drawn over the main view.
+ *
+ * Frame times of the last kHudWindowFrames frames are shown as p50, p95
+ * and p99: CPU time from beginFrame() to endFrame(), and GPU time between
+ * GL timestamps queried at the same points. The queries are read back
+ * frames later, once available, so the overlay never waits for the GPU.
+ *
+ * Text uses a built-in 5x7 font of ASCII 32 to 95, lower case is drawn
+ * as upper case. Each character is one quad whose cell, spacing included,
+ * gets a dark backdrop, so no extra geometry is needed behind the lines.
+ */
+class Hud {
+public:
+	Hud();
+	~Hud();
+
+	void beginFrame();
+	// endFrame: call after the last draw of the frame, before swapping
+	void endFrame();
+
+	/*
+	 * layout: fill getVertices() with the text for counters, in the top
+	 * left corner of a view_width x view_height view.
+	 */
+	void layout(const HudCounters& counters, int view_width, int view_height);
+	// xy: clip space, zw: font texture coordinates, 4 vertices a character
+	const std::vector<glm::vec4>& getVertices() const { return vertices_; }
+	// Two triangles for each of kHudMaxCharacters characters
+	const std::vector<glm::uvec3>& getFaces() const { return faces_; }
+	size_t getNumberOfIndices() const { return vertices_.size() / 4 * 6; }
+	unsigned getFontTexture() const { return font_tex_; }
+private:
+	// Window: the latest samples, oldest overwritten first
+	struct Window {
+		std::vector<float> samples;
+		size_t next = 0;
+
+		void push(float sample);
+		float percentile(float p) const;
+	};
+	struct GpuTiming {
+		unsigned begin = 0, end = 0;    // GL_TIMESTAMP queries
+		bool pending = false;
+	};
+	static const int kTimings = 4;      // frames the GPU may lag behind
+
+	void resolveGpuTimings();
+	void addLine(const char* text, int row, int view_width, int view_height);
+
+	unsigned font_tex_ = 0;
+	GpuTiming timings_[kTimings];
+	int frame_ = 0;
+	bool timing_gpu_ = false;           // this frame's queries were issued
+	uint64_t cpu_begin_ = 0;
+	uint64_t last_begin_ = 0;
+	Window cpu_ms_, gpu_ms_, interval_ms_;
+
+	std::vector<glm::vec4> vertices_;
+	std::vector<glm::uvec3> faces_;
+};
+
+#endif
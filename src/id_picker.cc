@@ -0,0 +1,151 @@
+#include <GL/glew.h>
+#include <debuggl.h>
+#include "id_picker.h"
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <glm/gtx/transform.hpp>
+
+IdPicker::IdPicker(int size)
+	: size_(size)
+{
+	CHECK_GL_ERROR(glGenFramebuffers(1, &fb_));
+	CHECK_GL_ERROR(glBindFramebuffer(GL_FRAMEBUFFER, fb_));
+
+	CHECK_GL_ERROR(glGenTextures(1, &tex_));
+	CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_2D, tex_));
+	CHECK_GL_ERROR(glTexStorage2D(GL_TEXTURE_2D, 1, GL_R32UI, size_, size_));
+	CHECK_GL_ERROR(glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, tex_, 0));
+	CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_2D, 0));
+
+	CHECK_GL_ERROR(glGenRenderbuffers(1, &dep_));
+	CHECK_GL_ERROR(glBindRenderbuffer(GL_RENDERBUFFER, dep_));
+	CHECK_GL_ERROR(glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, size_, size_));
+	CHECK_GL_ERROR(glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, dep_));
+
+	GLenum draw_buffers[1] = {GL_COLOR_ATTACHMENT0};
+	CHECK_GL_ERROR(glDrawBuffers(1, draw_buffers));
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		std::cerr << "Failed to create framebuffer object for ID picking" << std::endl;
+	CHECK_GL_ERROR(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+
+	CHECK_GL_ERROR(glGenBuffers(2, pbo_));
+	for (int i = 0; i < 2; i++) {
+		CHECK_GL_ERROR(glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo_[i]));
+		CHECK_GL_ERROR(glBufferData(GL_PIXEL_PACK_BUFFER,
+		                            size_ * size_ * sizeof(GLuint),
+		                            nullptr, GL_STREAM_READ));
+	}
+	CHECK_GL_ERROR(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+}
+
+IdPicker::~IdPicker()
+{
+	glDeleteBuffers(2, pbo_);
+	glDeleteFramebuffers(1, &fb_);
+	glDeleteTextures(1, &tex_);
+	glDeleteRenderbuffers(1, &dep_);
+}
+
+void IdPicker::setBoneLines(const std::vector<glm::uvec2>& lines)
+{
+	bone_lines_ = lines;
+}
+
+void IdPicker::setMaterials(const std::vector<Material>& materials)
+{
+	material_offsets_.clear();
+	for (const auto& ma : materials)
+		material_offsets_.emplace_back(ma.offset);
+}
+
+void IdPicker::setFaceOrder(const std::vector<int>& order)
+{
+	face_order_ = order;
+}
+
+void IdPicker::begin(float x, float y, int view_width, int view_height,
+                     const glm::mat4& projection)
+{
+	// Same as gluPickMatrix: blow the size_ x size_ window at (x, y) up to
+	// the whole clip space.
+	float scale_x = float(view_width) / size_;
+	float scale_y = float(view_height) / size_;
+	glm::mat4 pick = glm::translate(glm::vec3((view_width - 2.0f * x) / size_,
+	                                          (view_height - 2.0f * y) / size_,
+	                                          0.0f)) *
+	                 glm::scale(glm::vec3(scale_x, scale_y, 1.0f));
+	projection_ = pick * projection;
+
+	CHECK_GL_ERROR(glBindFramebuffer(GL_FRAMEBUFFER, fb_));
+	CHECK_GL_ERROR(glViewport(0, 0, size_, size_));
+	const GLuint background[4] = { encode(kNone, 0), 0, 0, 0 };
+	CHECK_GL_ERROR(glClearBufferuiv(GL_COLOR, 0, background));
+	CHECK_GL_ERROR(glClear(GL_DEPTH_BUFFER_BIT));
+}
+
+void IdPicker::end()
+{
+	CHECK_GL_ERROR(glReadBuffer(GL_COLOR_ATTACHMENT0));
+	CHECK_GL_ERROR(glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo_[frame_ % 2]));
+	CHECK_GL_ERROR(glReadPixels(0, 0, size_, size_, GL_RED_INTEGER, GL_UNSIGNED_INT, 0));
+	if (frame_ > 0) {
+		// Last frame's copy has had a whole frame to land
+		CHECK_GL_ERROR(glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo_[(frame_ + 1) % 2]));
+		const unsigned* ids = nullptr;
+		CHECK_GL_ERROR(ids = (const unsigned*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+		                                                       size_ * size_ * sizeof(GLuint),
+		                                                       GL_MAP_READ_BIT));
+		if (ids)
+			resolve(ids);
+		CHECK_GL_ERROR(glUnmapBuffer(GL_PIXEL_PACK_BUFFER));
+	}
+	frame_++;
+	CHECK_GL_ERROR(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+	CHECK_GL_ERROR(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+}
+
+void IdPicker::reset()
+{
+	frame_ = 0;
+	result_ = Result();
+}
+
+/*
+ * Bones win over faces, like the bones drawn over the transparent model.
+ * Among bones the pixel closest to the cursor wins, so thin lines still get
+ * picked when the cursor is a few pixels off.
+ */
+void IdPicker::resolve(const unsigned* ids)
+{
+	result_ = Result();
+	int best_bone_distance = std::numeric_limits<int>::max();
+	int best_face_distance = std::numeric_limits<int>::max();
+	int center = size_ / 2;
+	for (int row = 0; row < size_; row++) {
+		for (int col = 0; col < size_; col++) {
+			unsigned id = ids[row * size_ + col];
+			Kind kind = Kind(id >> 30);
+			unsigned value = id & ((1u << 30) - 1);
+			int distance = (row - center) * (row - center) + (col - center) * (col - center);
+			if (kind == kJoint || kind == kBoneLine) {
+				if (distance >= best_bone_distance)
+					continue;
+				if (kind == kBoneLine && value >= bone_lines_.size())
+					continue;
+				best_bone_distance = distance;
+				result_.bone = kind == kJoint ? int(value) : int(bone_lines_[value][0]);
+			} else if (kind == kFace && distance < best_face_distance) {
+				best_face_distance = distance;
+				result_.face = value;
+			}
+		}
+	}
+	if (result_.face >= 0 && !face_order_.empty())
+		result_.face = result_.face < int(face_order_.size()) ? face_order_[result_.face] : -1;
+	if (result_.face >= 0 && !material_offsets_.empty()) {
+		auto iter = std::upper_bound(material_offsets_.begin(), material_offsets_.end(),
+		                             size_t(result_.face));
+		result_.material = int(iter - material_offsets_.begin()) - 1;
+	}
+}
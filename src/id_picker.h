@@ -0,0 +1,74 @@
+#ifndef ID_PICKER_H
+#define ID_PICKER_H
+
+#include <vector>
+#include <glm/glm.hpp>
+#include <material.h>
+
+/*
+ * IdPicker: pixel accurate picking through an ID render target.
+ *
+ * Every frame the passes of shaders/id.frag render a small R32UI window
+ * centered at the cursor (see begin()). Each pixel holds
+ *      kind << 30 | value
+ * with the kinds below. The pixels are read back into a PBO, and mapped
+ * one frame later so the CPU never waits for the GPU; getResult() therefore
+ * describes the previous frame.
+ */
+class IdPicker {
+public:
+	enum Kind {
+		kNone = 0,
+		kJoint = 1,     // value: joint index
+		kBoneLine = 2,  // value: index into the bone lines, see setBoneLines
+		kFace = 3,      // value: face index
+	};
+	static unsigned encode(Kind kind, unsigned value) { return (unsigned(kind) << 30) | value; }
+
+	struct Result {
+		int bone = -1;      // joint at the end of the bone, as in GUI::getCurrentBone
+		int face = -1;
+		int material = -1;
+	};
+
+	IdPicker(int size);
+	~IdPicker();
+
+	// Map bone line i (as drawn by the bone pass) to joint lines[i][0].
+	void setBoneLines(const std::vector<glm::uvec2>& lines);
+	void setMaterials(const std::vector<Material>& materials);
+	/*
+	 * setFaceOrder: face i as drawn by the ID pass is mesh face order[i],
+	 * e.g. DrawList::getSourceFaces(). Results report mesh faces.
+	 */
+	void setFaceOrder(const std::vector<int>& order);
+
+	/*
+	 * begin: bind the ID target for a cursor at (x, y) in a view_width x
+	 * view_height viewport. Passes must use getProjection() instead of the
+	 * view projection while the target is bound.
+	 */
+	void begin(float x, float y, int view_width, int view_height,
+	           const glm::mat4& projection);
+	// end: queue the readback and resolve the one queued last frame.
+	void end();
+	// reset: forget the pending readback, e.g. when the cursor left the view.
+	void reset();
+
+	const glm::mat4& getProjection() const { return projection_; }
+	const Result& getResult() const { return result_; }
+private:
+	void resolve(const unsigned* ids);
+
+	int size_;
+	unsigned fb_ = 0, tex_ = 0, dep_ = 0;
+	unsigned pbo_[2] = {0, 0};
+	int frame_ = 0;         // readbacks queued since the last reset
+	glm::mat4 projection_;
+	std::vector<glm::uvec2> bone_lines_;
+	std::vector<size_t> material_offsets_;
+	std::vector<int> face_order_;
+	Result result_;
+};
+
+#endif
@@ -0,0 +1,166 @@
+#include "ik_solver.h"
+#include "bone_geometry.h"
+#include "config.h"
+#include "profiler.h"
+#include <job_system.h>
+#include <algorithm>
+#include <cmath>
+
+namespace {
+	// a is b or one of its ancestors
+	bool is_ancestor(const Skeleton& skeleton, int a, int b)
+	{
+		for (; b >= 0; b = skeleton.joints[b].parent_index)
+			if (b == a)
+				return true;
+		return false;
+	}
+}
+
+void IKSolver::build(const std::vector<IKChain>& chains, const Skeleton& skeleton)
+{
+	int njoints = int(skeleton.joints.size());
+	chains_.clear();
+	for (const auto& chain : chains) {
+		bool ok = !chain.links.empty() && chain.effector >= 0 && chain.effector < njoints;
+		int below = chain.effector;
+		for (size_t i = 0; ok && i < chain.links.size(); i++) {
+			int joint = chain.links[i].joint;
+			ok = joint >= 0 && joint < njoints && joint != below &&
+			     is_ancestor(skeleton, joint, below);
+			below = joint;
+		}
+		if (ok)
+			chains_.emplace_back(chain);
+	}
+	goals_.assign(chains_.size(), glm::vec3(0.0f));
+	pinned_.assign(chains_.size(), 0);
+	version_++;
+
+	// A chain rewrites the subtree of its top link, so chains go into the
+	// same batch as long as none of those subtrees nest.
+	batches_.clear();
+	for (size_t i = 0; i < chains_.size(); i++) {
+		int top = chains_[i].links.back().joint;
+		bool overlap = batches_.empty();
+		for (size_t j = 0; !overlap && j < batches_.back().size(); j++) {
+			int other = chains_[batches_.back()[j]].links.back().joint;
+			overlap = is_ancestor(skeleton, top, other) || is_ancestor(skeleton, other, top);
+		}
+		if (overlap)
+			batches_.emplace_back();
+		batches_.back().emplace_back(int(i));
+	}
+}
+
+int IKSolver::findChain(int joint) const
+{
+	for (size_t i = 0; i < chains_.size(); i++)
+		if (chains_[i].effector == joint)
+			return int(i);
+	return -1;
+}
+
+void IKSolver::pin(int chain, const glm::vec3& goal)
+{
+	goals_[chain] = goal;
+	pinned_[chain] = 1;
+	version_++;
+}
+
+void IKSolver::releaseAll()
+{
+	std::fill(pinned_.begin(), pinned_.end(), 0);
+	version_++;
+}
+
+bool IKSolver::hasPinned() const
+{
+	return std::find(pinned_.begin(), pinned_.end(), 1) != pinned_.end();
+}
+
+int IKSolver::solve(Skeleton& skeleton) const
+{
+	PROFILE_ZONE("IKSolver::solve");
+	int solved = 0;
+	for (const auto& batch : batches_) {
+		parallel_for(0, int(batch.size()), 1, [&](int i) {
+			if (pinned_[batch[i]])
+				solveChain(batch[i], skeleton);
+		});
+		for (int chain : batch)
+			solved += pinned_[chain];
+	}
+	if (solved > 0)
+		skeleton.pose_version++;
+	return solved;
+}
+
+/*
+ * Links are visited from the effector upward. Rotating link k turns
+ * every link below it and the effector around its position, so only
+ * those entries of the flat arrays change; the skeleton is touched once
+ * the sweeps are done.
+ */
+void IKSolver::solveChain(int c, Skeleton& skeleton) const
+{
+	const IKChain& chain = chains_[c];
+	const glm::vec3& goal = goals_[c];
+	std::vector<Joint>& joints = skeleton.joints;
+	size_t n = chain.links.size();
+	std::vector<glm::fquat> rot(n), parent_rot(n);
+	std::vector<glm::vec3> pos(n);
+	for (size_t k = 0; k < n; k++) {
+		const Joint& joint = joints[chain.links[k].joint];
+		rot[k] = joint.orientation;
+		pos[k] = joint.position;
+		if (joint.parent_index >= 0)
+			parent_rot[k] = joints[joint.parent_index].orientation;
+	}
+	glm::vec3 effector = joints[chain.effector].position;
+
+	int iterations = std::min(std::max(chain.iterations, 1), kIKMaxIterations);
+	float max_angle = chain.max_angle > 0.0f ? chain.max_angle : float(M_PI);
+	for (int iter = 0; iter < iterations; iter++) {
+		glm::vec3 error = goal - effector;
+		if (glm::dot(error, error) < kIKTolerance * kIKTolerance)
+			break;
+		for (size_t k = 0; k < n; k++) {
+			glm::vec3 from = effector - pos[k];
+			glm::vec3 to = goal - pos[k];
+			if (glm::dot(from, from) < 1e-12f || glm::dot(to, to) < 1e-12f)
+				continue;
+			from = glm::normalize(from);
+			to = glm::normalize(to);
+			glm::vec3 axis = glm::cross(from, to);
+			float axis_length = glm::length(axis);
+			if (axis_length < 1e-6f)
+				continue;
+			float angle = std::acos(glm::clamp(glm::dot(from, to), -1.0f, 1.0f));
+			glm::fquat q = glm::angleAxis(std::min(angle, max_angle), axis / axis_length);
+
+			const IKLink& link = chain.links[k];
+			if (link.limited) {
+				// Clamp the rotation relative to the parent, e.g. knees
+				// only bend backward around their X axis
+				glm::fquat local = glm::inverse(parent_rot[k]) * q * rot[k];
+				glm::vec3 euler = glm::clamp(glm::eulerAngles(local), link.lo, link.hi);
+				q = parent_rot[k] * glm::fquat(euler) * glm::inverse(rot[k]);
+			}
+
+			rot[k] = glm::normalize(q * rot[k]);
+			for (size_t j = 0; j < k; j++) {
+				pos[j] = pos[k] + q * (pos[j] - pos[k]);
+				rot[j] = glm::normalize(q * rot[j]);
+				parent_rot[j] = glm::normalize(q * parent_rot[j]);
+			}
+			effector = pos[k] + q * (effector - pos[k]);
+		}
+	}
+
+	for (size_t k = 0; k < n; k++)
+		joints[chain.links[k].joint].rel_orientation = glm::normalize(rot[k] * glm::inverse(parent_rot[k]));
+	Joint& top = joints[chain.links.back().joint];
+	top.orientation = rot.back();
+	skeleton.update_children(top);
+}
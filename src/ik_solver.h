@@ -0,0 +1,54 @@
+#ifndef IK_SOLVER_H
+#define IK_SOLVER_H
+
+#include <vector>
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <mmdadapter.h>
+
+struct Skeleton;
+
+/*
+ * IKSolver: CCD over the IK chains of a model.
+ *
+ * A chain is only solved while it is pinned to a goal, e.g. while its
+ * effector is dragged, and stays pinned during playback so a foot keeps
+ * its place. Each chain works on a flat copy of its links (world
+ * rotation and position) and writes relative rotations back into the
+ * skeleton. Chains whose subtrees do not overlap are solved in parallel.
+ * The work per chain is capped by kIKMaxIterations sweeps.
+ */
+class IKSolver {
+public:
+	/*
+	 * build: keep the chains of skeleton whose links follow its parent
+	 * links and group them into batches of independent chains.
+	 */
+	void build(const std::vector<IKChain>& chains, const Skeleton& skeleton);
+	// Chain whose effector is joint, or -1
+	int findChain(int joint) const;
+	void pin(int chain, const glm::vec3& goal);
+	void releaseAll();
+	bool isPinned(int chain) const { return pinned_[chain] != 0; }
+	bool hasPinned() const;
+	const glm::vec3& getGoal(int chain) const { return goals_[chain]; }
+	// Bumped whenever chains or goals change
+	unsigned getVersion() const { return version_; }
+	/*
+	 * solve: move the effectors of the pinned chains towards their goals.
+	 * Return: the number of chains solved.
+	 */
+	int solve(Skeleton& skeleton) const;
+
+	size_t size() const { return chains_.size(); }
+private:
+	void solveChain(int chain, Skeleton& skeleton) const;
+
+	std::vector<IKChain> chains_;
+	std::vector<glm::vec3> goals_;
+	std::vector<char> pinned_;
+	std::vector<std::vector<int>> batches_;  // chains of a batch do not overlap
+	unsigned version_ = 0;
+};
+
+#endif
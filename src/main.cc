@@ -7,6 +7,17 @@
 #include "config.h"
 #include "gui.h"
 #include "texture_to_render.h"
+#include "scene.h"
+#include "frustum.h"
+#include "id_picker.h"
+#include "frame_uniforms.h"
+#include "draw_list.h"
+#include "shader_reloader.h"
+#include "morph_targets.h"
+#include "pose_worker.h"
+#include "profiler.h"
+#include "hud.h"
+#include <job_system.h>
 
 #include <memory>
 #include <algorithm>
@@ -14,6 +25,7 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <cstdlib>
 
 #include <glm/gtx/component_wise.hpp>
 #include <glm/gtx/rotate_vector.hpp>
@@ -47,6 +59,14 @@ const char* blending_shader =
 #include "shaders/blending.vert"
 ;
 
+const char* instanced_shader =
+#include "shaders/instanced.vert"
+;
+
+const char* baked_shader =
+#include "shaders/baked.vert"
+;
+
 const char* geometry_shader =
 #include "shaders/default.geom"
 ;
@@ -55,6 +75,14 @@ const char* fragment_shader =
 #include "shaders/default.frag"
 ;
 
+const char* batched_geometry_shader =
+#include "shaders/batched.geom"
+;
+
+const char* batched_fragment_shader =
+#include "shaders/batched.frag"
+;
+
 const char* floor_fragment_shader =
 #include "shaders/floor.frag"
 ;
@@ -92,6 +120,22 @@ const char* scroll_bar_fragment_shader  =
 #include "shaders/scroll_bar.frag"
 ;
 
+const char* id_geometry_shader =
+#include "shaders/id.geom"
+;
+
+const char* id_fragment_shader =
+#include "shaders/id.frag"
+;
+
+const char* hud_vertex_shader =
+#include "shaders/hud.vert"
+;
+
+const char* hud_fragment_shader =
+#include "shaders/hud.frag"
+;
+
 void ErrorCallback(int error, const char* description) {
 	std::cerr << "GLFW Error: " << description << "\n";
 }
@@ -126,9 +170,12 @@ int main(int argc, char* argv[])
 {
 	if (argc < 2) {
 		std::cerr << "Input model file is missing" << std::endl;
-		std::cerr << "Usage: " << argv[0] << " <PMD file>" << std::endl;
+		std::cerr << "Usage: " << argv[0] << " <PMD/PMX file> [animation json or VMD] [number of instances]" << std::endl;
 		return -1;
 	}
+	if (const char* threads = getenv(kJobThreadsVariable))
+		JobSystem::setWorkerCount(atoi(threads));
+	Profiler::setThreadName("main");
 	GLFWwindow *window = init_glefw();
 	GUI gui(window, main_view_width, main_view_height, preview_height, scroll_bar_width);
 
@@ -161,6 +208,7 @@ int main(int argc, char* argv[])
 	FILE* export_file;
 	unsigned char* export_buffer = (unsigned char*) malloc (sizeof(char) * 960 * 720 * 3);
 	bool export_file_opened = false;
+	int exported_frames = 0;
 
 	// FIXME: we already created meshes for cylinders. Use them to render
 	//        the cylinder and axes if required by the assignment.
@@ -184,8 +232,35 @@ int main(int argc, char* argv[])
 	gui.assignMesh(&mesh);
 	mesh.assignGUI(&gui);
 
+	/*
+	 * Crowd preview: extra copies of the model playing the same clip.
+	 */
+	Scene scene(mesh);
+	if (argc >= 4)
+		scene.populateGrid(std::max(0, atoi(argv[3])), kInstanceSpacing);
+
 	glm::vec4 light_position = glm::vec4(0.0f, 100.0f, 0.0f, 1.0f);
 	MatrixPointers mats; // Define MatrixPointers here for lambda to capture
+	/*
+	 * Camera and light reach every program through one uniform block, see
+	 * frame_uniforms.h. Register it before any RenderPass gets linked.
+	 */
+	FrameUniforms frame_uniforms;
+	RenderPass::setUniformBlockBinding(FrameUniforms::kBlockName, FrameUniforms::kBinding);
+	RenderPass::addShaderHeader(FrameUniforms::kBlockSource);
+
+	/*
+	 * Materials sharing a texture are drawn together, their parameters
+	 * come from a uniform block. See draw_list.h.
+	 */
+	DrawList draw_list;
+	draw_list.build(mesh.materials, mesh.faces);
+	draw_list.upload();
+	RenderPass::setUniformBlockBinding(DrawList::kBlockName, DrawList::kBinding);
+
+	// Vertex morphs, offsets sorted by vertex. See morph_targets.h.
+	MorphTargets morph_targets;
+	morph_targets.build(mesh.morphs, mesh.vertices.size());
 	/*
 	 * In the following we are going to define several lambda functions to bind Uniforms.
 	 *
@@ -215,6 +290,9 @@ int main(int argc, char* argv[])
 	auto int_binder = [](int loc, const void* data) {
 		glUniform1iv(loc, 1, (const GLint*)data);
 	};
+	auto uint_binder = [](int loc, const void* data) {
+		glUniform1uiv(loc, 1, (const GLuint*)data);
+	};
 	auto joint_trans_binder = [&mesh](int loc, const void *data) {
 		// std::cerr << "Trans Binder: " << mesh.getNumberOfBones() << std::endl;
 		// for (const auto& q : mesh.skeleton.cache.trans) {
@@ -234,29 +312,35 @@ int main(int argc, char* argv[])
 		CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_2D, (long)data));
 		//std::cerr << " bind texture " << long(data) << std::endl;
 	};
-
-	/*
-	 * The lambda functions below are used to retrieve data
-	 */
-	auto std_model_data = [&mats]() -> const void* {
-		return mats.model;
-	}; // This returns point to model matrix
-	glm::mat4 floor_model_matrix = glm::mat4(1.0f);
-	auto floor_model_data = [&floor_model_matrix]() -> const void* {
-		return &floor_model_matrix[0][0];
-	}; // This return model matrix for the floor.
-	auto std_view_data = [&mats]() -> const void* {
-		return mats.view;
+	auto palette_binder = [](int loc, const void* data) {
+		// Unit 0 belongs to the material textures
+		CHECK_GL_ERROR(glUniform1i(loc, 1));
+		CHECK_GL_ERROR(glActiveTexture(GL_TEXTURE0 + 1));
+		CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_BUFFER, (long)data));
+		CHECK_GL_ERROR(glActiveTexture(GL_TEXTURE0 + 0));
 	};
-	auto std_camera_data  = [&gui]() -> const void* {
-		return &gui.getCamera()[0];
+	auto morph_offsets_binder = [](int loc, const void* data) {
+		CHECK_GL_ERROR(glUniform1i(loc, 3));
+		CHECK_GL_ERROR(glActiveTexture(GL_TEXTURE0 + 3));
+		CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_BUFFER, (long)data));
+		CHECK_GL_ERROR(glActiveTexture(GL_TEXTURE0 + 0));
 	};
-	auto std_proj_data = [&mats]() -> const void* {
-		return mats.projection;
+	auto morph_weights_binder = [](int loc, const void* data) {
+		CHECK_GL_ERROR(glUniform1i(loc, 4));
+		CHECK_GL_ERROR(glActiveTexture(GL_TEXTURE0 + 4));
+		CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_BUFFER, (long)data));
+		CHECK_GL_ERROR(glActiveTexture(GL_TEXTURE0 + 0));
 	};
-	auto std_light_data = [&light_position]() -> const void* {
-		return &light_position[0];
+	auto baked_animation_binder = [](int loc, const void* data) {
+		CHECK_GL_ERROR(glUniform1i(loc, 2));
+		CHECK_GL_ERROR(glActiveTexture(GL_TEXTURE0 + 2));
+		CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_2D, (long)data));
+		CHECK_GL_ERROR(glActiveTexture(GL_TEXTURE0 + 0));
 	};
+
+	/*
+	 * The lambda functions below are used to retrieve data
+	 */
 	auto alpha_data  = [&gui]() -> const void* {
 		static const float transparet = 0.5; // Alpha constant goes here
 		static const float non_transparet = 1.0;
@@ -265,6 +349,9 @@ int main(int argc, char* argv[])
 		else
 			return &non_transparet;
 	};
+	auto material_count_data = [&draw_list]() -> const void* {
+		return draw_list.getNumberOfMaterialsPointer();
+	};
 	auto joint_trans_data = [&mesh]() -> const void* {
 		auto ret = mesh.getCurrentQ()->transData();
 		return ret;
@@ -272,13 +359,19 @@ int main(int argc, char* argv[])
 	auto joint_rot_data = [&mesh]() -> const void* {
 		return mesh.getCurrentQ()->rotData();
 	};
+	auto morph_offsets_data = [&morph_targets]() -> const void* {
+		return (const void*)(intptr_t)morph_targets.getOffsetTexture();
+	};
+	auto morph_weights_data = [&morph_targets, &mesh]() -> const void* {
+		return (const void*)(intptr_t)morph_targets.update(mesh.getMorphWeights());
+	};
 	// FIXME: add more lambdas for data_source if you want to use RenderPass.
 	//        Otherwise, do whatever you like here
 	glm::mat4 bone_transform_matrix;
 	auto bone_transform_data = [&mesh, &bone_transform_matrix, &gui]() -> const void* {
 		int current_bone = gui.getCurrentBone();
 		if(current_bone != -1) {
-			bone_transform_matrix = mesh.skeleton.getBoneTransform(current_bone);	
+			bone_transform_matrix = mesh.skeleton.getBoneTransform(current_bone, mesh.getCurrentQ());
 		}
 		else {
 			bone_transform_matrix = glm::mat4(1.0f);	// won't be used anyway
@@ -317,6 +410,54 @@ int main(int argc, char* argv[])
 		return &show_insert_cursor;
 	};
 
+	// crowd uniforms
+	auto palette_data = [&scene]() -> const void* {
+		return (const void*)(intptr_t)scene.getPaletteTexture();
+	};
+	int palette_stride = 0;
+	auto palette_stride_data = [&palette_stride, &scene]() -> const void* {
+		palette_stride = scene.getPaletteStride();
+		return &palette_stride;
+	};
+	int morph_count = int(mesh.morphs.size());
+	auto morph_count_data = [&morph_count]() -> const void* {
+		return &morph_count;
+	};
+	auto baked_animation_data = [&scene]() -> const void* {
+		return (const void*)(intptr_t)scene.getBakedAnimation().getTexture();
+	};
+	float baked_rate = kBakeRate;
+	auto baked_rate_data = [&baked_rate, &scene]() -> const void* {
+		baked_rate = scene.getBakedAnimation().getRate();
+		return &baked_rate;
+	};
+	auto scene_time_data = [&scene]() -> const void* {
+		return scene.getTimePointer();
+	};
+
+	// picking uniforms
+	IdPicker picker(kIdPickerSize);
+	const unsigned face_id_base = IdPicker::encode(IdPicker::kFace, 0);
+	auto face_id_base_data = [&face_id_base]() -> const void* {
+		return &face_id_base;
+	};
+	const unsigned bone_id_base = IdPicker::encode(IdPicker::kBoneLine, 0);
+	auto bone_id_base_data = [&bone_id_base]() -> const void* {
+		return &bone_id_base;
+	};
+	unsigned cylinder_id_base = 0;
+	auto cylinder_id_base_data = [&cylinder_id_base, &gui]() -> const void* {
+		cylinder_id_base = IdPicker::encode(IdPicker::kJoint, std::max(0, gui.getCurrentBone()));
+		return &cylinder_id_base;
+	};
+	const int one = 1, zero = 0;
+	auto per_primitive_data = [&one]() -> const void* {
+		return &one;
+	};
+	auto per_draw_data = [&zero]() -> const void* {
+		return &zero;
+	};
+
 	int total_preview_num = 0;
 	auto total_preview_num_data =  [&total_preview_num, &mesh]() -> const void* {
 		total_preview_num = mesh.textures.size();
@@ -326,28 +467,40 @@ int main(int argc, char* argv[])
 	
 
 
-	ShaderUniform std_model = { "model", matrix_binder, std_model_data };
-	ShaderUniform floor_model = { "model", matrix_binder, floor_model_data };
-	ShaderUniform std_view = { "view", matrix_binder, std_view_data };
-	ShaderUniform std_camera = { "camera_position", vector3_binder, std_camera_data };
-	ShaderUniform std_proj = { "projection", matrix_binder, std_proj_data };
-	ShaderUniform std_light = { "light_position", vector_binder, std_light_data };
-	ShaderUniform object_alpha = { "alpha", float_binder, alpha_data };
-	ShaderUniform joint_trans = { "joint_trans", joint_trans_binder, joint_trans_data };
-	ShaderUniform joint_rot = { "joint_rot", joint_rot_binder, joint_rot_data };
+	ShaderUniform object_alpha = { "alpha", float_binder, alpha_data, sizeof(float) };
+	ShaderUniform material_count = { "material_count", int_binder, material_count_data, sizeof(int) };
+	ShaderUniform joint_trans = { "joint_trans", joint_trans_binder, joint_trans_data, mesh.getNumberOfBones() * sizeof(glm::vec3) };
+	ShaderUniform joint_rot = { "joint_rot", joint_rot_binder, joint_rot_data, mesh.getNumberOfBones() * sizeof(glm::vec4) };
+	ShaderUniform morph_offsets = { "morph_offsets", morph_offsets_binder, morph_offsets_data, ShaderUniform::kByValue };
+	ShaderUniform morph_weights = { "morph_weights", morph_weights_binder, morph_weights_data, ShaderUniform::kByValue };
 	// FIXME: define more ShaderUniforms for RenderPass if you want to use it.
 	//        Otherwise, do whatever you like here
-	ShaderUniform bone_transform = { "bone_transform", matrix_binder, bone_transform_data };
-	ShaderUniform cylinder_radius = { "cylinder_radius", float_binder, cylinder_radius_data};
+	ShaderUniform bone_transform = { "bone_transform", matrix_binder, bone_transform_data, sizeof(glm::mat4) };
+	ShaderUniform cylinder_radius = { "cylinder_radius", float_binder, cylinder_radius_data, sizeof(float) };
 
 	// preview uniforms
-	ShaderUniform sampler_uniform = { "sampler", texture0_binder, sampler_data };
-	ShaderUniform show_border_uniform = { "show_border", int_binder, show_border_data };
-	ShaderUniform orthomat_uniform = { "orthomat", matrix_binder, orthomat_data };
-	ShaderUniform frame_shift_uniform = { "frame_shift", float_binder, frame_shift_data };
-	ShaderUniform show_insert_cursor_uniform = {"show_insert_cursor", int_binder, show_insert_cursor_data};
-
-	ShaderUniform total_preview_num_uniform = {"total_preview_num", int_binder, total_preview_num_data};
+	ShaderUniform sampler_uniform = { "sampler", texture0_binder, sampler_data, ShaderUniform::kByValue };
+	ShaderUniform show_border_uniform = { "show_border", int_binder, show_border_data, sizeof(int) };
+	ShaderUniform orthomat_uniform = { "orthomat", matrix_binder, orthomat_data, sizeof(glm::mat4) };
+	ShaderUniform frame_shift_uniform = { "frame_shift", float_binder, frame_shift_data, sizeof(float) };
+	ShaderUniform show_insert_cursor_uniform = {"show_insert_cursor", int_binder, show_insert_cursor_data, sizeof(int) };
+
+	ShaderUniform total_preview_num_uniform = {"total_preview_num", int_binder, total_preview_num_data, sizeof(int) };
+
+	// crowd uniforms
+	ShaderUniform instance_palette = { "instance_palette", palette_binder, palette_data, ShaderUniform::kByValue };
+	ShaderUniform instance_palette_stride = { "palette_stride", int_binder, palette_stride_data, sizeof(int) };
+	ShaderUniform morph_count_uniform = { "morph_count", int_binder, morph_count_data, sizeof(int) };
+	ShaderUniform baked_animation = { "baked_animation", baked_animation_binder, baked_animation_data, ShaderUniform::kByValue };
+	ShaderUniform baked_rate_uniform = { "baked_rate", float_binder, baked_rate_data, sizeof(float) };
+	ShaderUniform scene_time = { "scene_time", float_binder, scene_time_data, sizeof(float) };
+
+	// picking uniforms
+	ShaderUniform face_id_base_uniform = { "id_base", uint_binder, face_id_base_data, sizeof(unsigned) };
+	ShaderUniform bone_id_base_uniform = { "id_base", uint_binder, bone_id_base_data, sizeof(unsigned) };
+	ShaderUniform cylinder_id_base_uniform = { "id_base", uint_binder, cylinder_id_base_data, sizeof(unsigned) };
+	ShaderUniform per_primitive_uniform = { "id_per_primitive", int_binder, per_primitive_data, sizeof(int) };
+	ShaderUniform per_draw_uniform = { "id_per_primitive", int_binder, per_draw_data, sizeof(int) };
 
 
 	// Floor render pass
@@ -357,7 +510,7 @@ int main(int argc, char* argv[])
 	RenderPass floor_pass(-1,
 			floor_pass_input,
 			{ vertex_shader, geometry_shader, floor_fragment_shader},
-			{ floor_model, std_view, std_proj, std_light },
+			{ },
 			{ "fragment_color" }
 			);
 
@@ -365,29 +518,67 @@ int main(int argc, char* argv[])
 	// FIXME: initialize the input data at Mesh::loadPmd
 	std::vector<glm::vec2>& uv_coordinates = mesh.uv_coordinates;
 	RenderDataInput object_pass_input;
-	object_pass_input.assign(0, "jid0", mesh.joint0.data(), mesh.joint0.size(), 1, GL_INT);
-	object_pass_input.assign(1, "jid1", mesh.joint1.data(), mesh.joint1.size(), 1, GL_INT);
-	object_pass_input.assign(2, "w0", mesh.weight_for_joint0.data(), mesh.weight_for_joint0.size(), 1, GL_FLOAT);
-	object_pass_input.assign(3, "vector_from_joint0", mesh.vector_from_joint0.data(), mesh.vector_from_joint0.size(), 3, GL_FLOAT);
-	object_pass_input.assign(4, "vector_from_joint1", mesh.vector_from_joint1.data(), mesh.vector_from_joint1.size(), 3, GL_FLOAT);
-	object_pass_input.assign(5, "normal", mesh.vertex_normals.data(), mesh.vertex_normals.size(), 4, GL_FLOAT);
-	object_pass_input.assign(6, "uv", uv_coordinates.data(), uv_coordinates.size(), 2, GL_FLOAT);
+	object_pass_input.assign(0, "jid", mesh.joint_ids.data(), mesh.joint_ids.size(), 4, GL_INT);
+	object_pass_input.assign(1, "weight", mesh.joint_weights.data(), mesh.joint_weights.size(), 4, GL_FLOAT);
+	object_pass_input.assign(2, "vector_from_joint0", mesh.vector_from_joint[0].data(), mesh.vector_from_joint[0].size(), 3, GL_FLOAT);
+	object_pass_input.assign(3, "vector_from_joint1", mesh.vector_from_joint[1].data(), mesh.vector_from_joint[1].size(), 3, GL_FLOAT);
+	object_pass_input.assign(4, "vector_from_joint2", mesh.vector_from_joint[2].data(), mesh.vector_from_joint[2].size(), 3, GL_FLOAT);
+	object_pass_input.assign(5, "vector_from_joint3", mesh.vector_from_joint[3].data(), mesh.vector_from_joint[3].size(), 3, GL_FLOAT);
+	object_pass_input.assign(6, "normal", mesh.vertex_normals.data(), mesh.vertex_normals.size(), 4, GL_FLOAT);
+	object_pass_input.assign(7, "uv", uv_coordinates.data(), uv_coordinates.size(), 2, GL_FLOAT);
 	// TIPS: You won't need vertex position in your solution.
 	//       This only serves the stub shader.
-	object_pass_input.assign(7, "vert", mesh.vertices.data(), mesh.vertices.size(), 4, GL_FLOAT);
+	object_pass_input.assign(8, "vert", mesh.vertices.data(), mesh.vertices.size(), 4, GL_FLOAT);
+	object_pass_input.assign(9, "morph_range", morph_targets.getRanges().data(), morph_targets.getRanges().size(), 2, GL_INT);
 	object_pass_input.assignIndex(mesh.faces.data(), mesh.faces.size(), 3);
 	object_pass_input.useMaterials(mesh.materials);
+	// Same vertices, faces regrouped into the batches of draw_list
+	RenderDataInput batched_pass_input = object_pass_input;
+	batched_pass_input.assignIndex(draw_list.getFaces().data(), draw_list.getFaces().size(), 3);
+	batched_pass_input.useMaterials(draw_list.getBatches());
+	const char* object_geometry_shader = draw_list.isBatched() ? batched_geometry_shader : geometry_shader;
+	const char* object_fragment_shader = draw_list.isBatched() ? batched_fragment_shader : fragment_shader;
 	RenderPass object_pass(-1,
-			object_pass_input,
+			batched_pass_input,
 			{
 			  blending_shader,
-			  geometry_shader,
-			  fragment_shader
+			  object_geometry_shader,
+			  object_fragment_shader
 			},
-			{ std_model, std_view, std_proj,
-			  std_light,
-			  std_camera, object_alpha,
-			  joint_trans, joint_rot
+			{ object_alpha, material_count,
+			  joint_trans, joint_rot,
+			  morph_offsets, morph_weights
+			},
+			{ "fragment_color" }
+			);
+
+	// Crowd render pass: same vertex data, bones come from the scene palette
+	RenderPass crowd_pass(-1,
+			batched_pass_input,
+			{
+			  instanced_shader,
+			  object_geometry_shader,
+			  object_fragment_shader
+			},
+			{ object_alpha, material_count,
+			  instance_palette, instance_palette_stride,
+			  morph_offsets, morph_count_uniform
+			},
+			{ "fragment_color" }
+			);
+
+	// Baked crowd render pass: poses are sampled from the baked texture
+	RenderPass baked_crowd_pass(-1,
+			batched_pass_input,
+			{
+			  baked_shader,
+			  object_geometry_shader,
+			  object_fragment_shader
+			},
+			{ object_alpha, material_count,
+			  instance_palette, instance_palette_stride,
+			  morph_offsets, morph_count_uniform,
+			  baked_animation, baked_rate_uniform, scene_time
 			},
 			{ "fragment_color" }
 			);
@@ -410,7 +601,7 @@ int main(int argc, char* argv[])
 	bone_pass_input.assignIndex(bone_indices.data(), bone_indices.size(), 2);
 	RenderPass bone_pass(-1, bone_pass_input,
 			{ bone_vertex_shader, nullptr, bone_fragment_shader},
-			{ std_model, std_view, std_proj, joint_trans },
+			{ joint_trans },
 			{ "fragment_color" }
 			);
 
@@ -422,10 +613,38 @@ int main(int argc, char* argv[])
 	cylinder_pass_input.assignIndex(cylinder_mesh.indices.data(), cylinder_mesh.indices.size(), 2);
 	RenderPass cylinder_pass(-1, cylinder_pass_input,
 			{ cylinder_vertex_shader, nullptr, cylinder_fragment_shader },
-			{ std_model, std_view, std_proj, bone_transform, cylinder_radius },
+			{ bone_transform, cylinder_radius },
 			{ "fragment_color" }
 			);
 
+	// ID passes: the same geometry as above, writing IdPicker ids instead
+	// of colors into the small window around the cursor
+	// Batched like object_pass, the picker maps the faces back
+	RenderPass id_object_pass(-1,
+			batched_pass_input,
+			{ blending_shader, id_geometry_shader, id_fragment_shader },
+			{ joint_trans, joint_rot,
+			  morph_offsets, morph_weights,
+			  face_id_base_uniform, per_primitive_uniform
+			},
+			{ "fragment_id" }
+			);
+	RenderPass id_bone_pass(-1, bone_pass_input,
+			{ bone_vertex_shader, nullptr, id_fragment_shader },
+			{ joint_trans,
+			  bone_id_base_uniform, per_primitive_uniform },
+			{ "fragment_id" }
+			);
+	RenderPass id_cylinder_pass(-1, cylinder_pass_input,
+			{ cylinder_vertex_shader, nullptr, id_fragment_shader },
+			{ bone_transform, cylinder_radius,
+			  cylinder_id_base_uniform, per_draw_uniform },
+			{ "fragment_id" }
+			);
+	picker.setBoneLines(bone_indices);
+	picker.setMaterials(mesh.materials);
+	picker.setFaceOrder(draw_list.getSourceFaces());
+
 	RenderDataInput preview_pass_input;
 	preview_pass_input.assign(0, "vertex_position", quad_vertices.data(), quad_vertices.size(), 4, GL_FLOAT);
 	preview_pass_input.assign(1, "tex_coord_in", quad_coords.data(), quad_coords.size(), 2, GL_FLOAT);
@@ -448,6 +667,80 @@ int main(int argc, char* argv[])
 			{"fragment_color"}
 			);
 
+	// Performance overlay, its text is streamed every frame
+	Hud hud;
+	auto hud_font_data = [&hud]() -> const void* {
+		return (const void*)(intptr_t)hud.getFontTexture();
+	};
+	// The font has no mip chain, so it must not go through a sampler
+	// object some other pass may have left on unit 0
+	auto hud_font_binder = [](int loc, const void* data) {
+		CHECK_GL_ERROR(glUniform1i(loc, 0));
+		CHECK_GL_ERROR(glActiveTexture(GL_TEXTURE0 + 0));
+		CHECK_GL_ERROR(glBindSampler(0, 0));
+		CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_2D, (long)data));
+	};
+	ShaderUniform hud_font = { "font", hud_font_binder, hud_font_data, ShaderUniform::kByValue };
+	RenderDataInput hud_pass_input;
+	hud_pass_input.assignStream(0, "vertex_position", hud.getVertices().data(), hud.getVertices().size(), 4, GL_FLOAT);
+	hud_pass_input.assignIndex(hud.getFaces().data(), hud.getFaces().size(), 3);
+	RenderPass hud_pass(-1, hud_pass_input,
+			{hud_vertex_shader, nullptr, hud_fragment_shader},
+			{hud_font},
+			{"fragment_color"}
+			);
+
+	// Development mode: rebuild programs when files in $SHADER_DIR change
+	std::unique_ptr<ShaderReloader> shader_reloader;
+	if (const char* shader_dir = std::getenv("SHADER_DIR")) {
+		shader_reloader.reset(new ShaderReloader(shader_dir));
+		const std::pair<const char*, const char*> shader_files[] = {
+			{vertex_shader, "default.vert"},
+			{blending_shader, "blending.vert"},
+			{instanced_shader, "instanced.vert"},
+			{baked_shader, "baked.vert"},
+			{geometry_shader, "default.geom"},
+			{fragment_shader, "default.frag"},
+			{batched_geometry_shader, "batched.geom"},
+			{batched_fragment_shader, "batched.frag"},
+			{floor_fragment_shader, "floor.frag"},
+			{bone_vertex_shader, "bone.vert"},
+			{bone_fragment_shader, "bone.frag"},
+			{cylinder_vertex_shader, "cylinder.vert"},
+			{cylinder_fragment_shader, "cylinder.frag"},
+			{preview_vertex_shader, "preview.vert"},
+			{preview_fragment_shader, "preview.frag"},
+			{scroll_bar_vertex_shader, "scroll_bar.vert"},
+			{scroll_bar_fragment_shader, "scroll_bar.frag"},
+			{id_geometry_shader, "id.geom"},
+			{id_fragment_shader, "id.frag"},
+			{hud_vertex_shader, "hud.vert"},
+			{hud_fragment_shader, "hud.frag"},
+		};
+		for (const auto& shader_file : shader_files)
+			shader_reloader->track(shader_file.first, shader_file.second);
+		for (RenderPass* pass : { &floor_pass, &object_pass, &crowd_pass,
+		                          &baked_crowd_pass, &bone_pass, &cylinder_pass,
+		                          &id_object_pass, &id_bone_pass, &id_cylinder_pass,
+		                          &preview_pass, &scroll_bar_pass, &hud_pass })
+			shader_reloader->addPass(pass);
+		shader_reloader->loadFiles();
+	}
+
+	// Draw the batches of the model whose skinned bounds reach the screen,
+	// for passes built from batched_pass_input. The camera may change
+	// between calls (keyframe previews), the projection with the pass
+	// (IdPicker only looks at the pixels around the cursor).
+	auto draw_object_batches = [&mesh, &gui, &draw_list](RenderPass& pass, const glm::mat4& projection) {
+		Frustum frustum(projection * gui.getModelViewMatrix());
+		pass.setup();
+		for (int bid = 0; bid < int(draw_list.getBatches().size()); bid++) {
+			if (!frustum.intersects(draw_list.getBatchBounds(bid, mesh.getMaterialBounds())))
+				continue;
+			pass.renderWithMaterial(bid);
+		}
+	};
+
 	float aspect = 0.0f;
 	std::cout << "center = " << mesh.getCenter() << "\n";
 
@@ -458,12 +751,45 @@ int main(int argc, char* argv[])
 	bool draw_scroll_bar = true;
 
 	if (argc >= 3) {
-		mesh.loadAnimationFrom(argv[2]);
+		std::string animation_fn = argv[2];
+		if (animation_fn.size() > 4 &&
+		    (animation_fn.compare(animation_fn.size() - 4, 4, ".vmd") == 0 ||
+		     animation_fn.compare(animation_fn.size() - 4, 4, ".VMD") == 0))
+			mesh.loadVmd(animation_fn);
+		else
+			mesh.loadAnimationFrom(animation_fn);
 		// load external animation files
 		mesh.to_load_animation = true;	
 	}
+	if (scene.getNumberOfInstances() > 0)
+		scene.update(0.0f);
+
+	// Playback poses are evaluated one frame ahead on the worker
+	PoseWorker pose_worker(mesh);
+	bool was_playing = false;
+	float last_play_time = 0.0f;	// in key frames
+
+	auto preview_visible = [&gui](int i) {
+		int preview_y = main_view_height - (i + 1) * preview_height + gui.get_frame_shift();
+		return preview_y < main_view_height && preview_y + preview_height > 0;
+	};
+
+	// Names label the GPU zones of the passes in profile captures
+	const std::pair<RenderPass*, const char*> pass_names[] = {
+		{&floor_pass, "floor"}, {&object_pass, "object"}, {&crowd_pass, "crowd"},
+		{&baked_crowd_pass, "baked crowd"}, {&bone_pass, "bone"},
+		{&cylinder_pass, "cylinder"}, {&id_object_pass, "id object"},
+		{&id_bone_pass, "id bone"}, {&id_cylinder_pass, "id cylinder"},
+		{&preview_pass, "preview"}, {&scroll_bar_pass, "scroll bar"},
+		{&hud_pass, "hud"},
+	};
+	for (const auto& pass_name : pass_names)
+		pass_name.first->setName(pass_name.second);
 
 	while (!glfwWindowShouldClose(window)) {
+		hud.beginFrame();
+		if (shader_reloader)
+			shader_reloader->poll();
 		// Setup some basic window stuff.
 		glfwGetFramebufferSize(window, &window_width, &window_height);
 		glViewport(0, 0, main_view_width, main_view_height);
@@ -479,8 +805,19 @@ int main(int argc, char* argv[])
 
 		gui.updateMatrices();
 		mats = gui.getMatrixPointers();
+		frame_uniforms.update(mats, light_position, gui.getCamera());
+		RenderPass::resetUniformStats();	// counters are per frame
+		RenderPass::resetDrawStats();
+
+		if (scene.getNumberOfInstances() > 0 && gui.baked_playback_ != scene.isBaked()) {
+			if (gui.baked_playback_)
+				scene.bake(kBakeRate / mesh.key_frame_rate);
+			else
+				scene.unbake();
+		}
 
 		if (gui.isPlaying()) {
+			PROFILE_ZONE("playback");
 			std::stringstream title;
 			float cur_time = gui.getCurrentPlayTime();
 			// float cur_time = gui.time_;
@@ -491,42 +828,104 @@ int main(int argc, char* argv[])
 			      << std::setfill('0') << std::setw(6)
 			      << cur_time << " sec";
 			glfwSetWindowTitle(window, title.str().data());
-			mesh.updateAnimation(cur_time);
+			// Animation times are in key frames from here on
+			float key_time = cur_time * mesh.key_frame_rate;
+			float play_step = 0.0f;
+			if (!was_playing) {
+				pose_worker.reset();
+				mesh.updateAnimation(key_time);
+			} else {
+				play_step = key_time - last_play_time;
+				if (pose_worker.acquire()) {
+					const AnimatedPose& pose = pose_worker.front();
+					mesh.showPose(&pose);
+					if (pose.animated)
+						gui.set_camera_rel_orientation(pose.camera_rel_orientation);
+				}
+			}
+			pose_worker.sync(mesh);
+			pose_worker.request(key_time + play_step);
+			was_playing = true;
+			last_play_time = key_time;
+			if (scene.getNumberOfInstances() > 0)
+				scene.update(key_time);
+		} else if (was_playing) {
+			// Bring the skeleton to the pose last shown
+			mesh.updateAnimation(last_play_time);
+			was_playing = false;
 		} else if (gui.isPoseDirty()) {
 			mesh.updateAnimation();
 			gui.clearPose();
 		}
 
 		
-		// render keyframes that loaded from json file into preview textures 
+		// Key frames loaded from a file get their previews once scrolled to
 		if(mesh.to_load_animation) {
-			for(int i = 0; i < mesh.key_frames.size(); i++) {
-				mesh.skeleton.transform_skeleton_by_frame(mesh.key_frames[i]);
-				gui.set_camera_rel_orientation(mesh.key_frames[i].camera_rel_orientation);
-				mesh.updateAnimation();
-				TextureToRender* texture = new TextureToRender();
-				texture->create(main_view_width, main_view_height);
-				texture->bind();
-
-				floor_pass.setup();
-				CHECK_GL_ERROR(glDrawElements(GL_TRIANGLES,
-				                              floor_faces.size() * 3,
-				                              GL_UNSIGNED_INT, 0));
-				object_pass.setup();
-				int mid = 0;
-				while (object_pass.renderWithMaterial(mid))
-					mid++;
-	
-				mesh.textures.push_back(texture);
-				texture->unbind();		
-			}
+			for (TextureToRender* texture : mesh.textures)
+				delete texture;
+			mesh.textures.assign(mesh.key_frames.size(), nullptr);
 			mesh.to_load_animation = false;
 			mesh.skeleton.set_rest_pose();
 			gui.set_camera_rel_orientation(glm::fquat());
+			frame_uniforms.update(mats, light_position, gui.getCamera());
 			mesh.updateAnimation();
 		}
 
+		/*
+		 * Render the missing previews in view and free those far out of it,
+		 * imported motions have thousands of key frames.
+		 */
+		{
+			int first_visible = -1, last_visible = -1;
+			std::vector<int> missing;
+			for (int i = 0; i < int(mesh.textures.size()); i++) {
+				if (!preview_visible(i))
+					continue;
+				if (first_visible < 0)
+					first_visible = i;
+				last_visible = i;
+				if (!mesh.textures[i] && i < int(mesh.key_frames.size()))
+					missing.emplace_back(i);
+			}
+			for (int i = 0; i < int(mesh.textures.size()); i++) {
+				if (i >= first_visible - kPreviewsKept && i <= last_visible + kPreviewsKept)
+					continue;
+				delete mesh.textures[i];
+				mesh.textures[i] = nullptr;
+			}
+			if (!missing.empty()) {
+				PROFILE_ZONE("preview renders");
+				// Pose them on the job system, then draw them in order
+				std::vector<AnimatedPose> poses(missing.size());
+				parallel_for(0, int(poses.size()), 1, [&](int k) {
+					Skeleton skeleton = mesh.skeleton;
+					mesh.evaluatePose(&mesh.key_frames[missing[k]], skeleton, mesh.ik_solver, poses[k]);
+				});
+				const AnimatedPose* shown_pose = mesh.getShownPose();
+				glm::fquat camera_rel_orientation = gui.get_camera_rel_orientation();
+				for (size_t k = 0; k < missing.size(); k++) {
+					mesh.showPose(&poses[k]);
+					gui.set_camera_rel_orientation(poses[k].camera_rel_orientation);
+					frame_uniforms.update(mats, light_position, gui.getCamera());
+					TextureToRender* texture = new TextureToRender();
+					texture->create(main_view_width, main_view_height);
+					texture->bind();
+
+					floor_pass.setup();
+					floor_pass.drawElements(GL_TRIANGLES, floor_faces.size() * 3);
+					draw_object_batches(object_pass, gui.getProjectionMatrix());
+
+					mesh.textures[missing[k]] = texture;
+					texture->unbind();
+				}
+				mesh.showPose(shown_pose);
+				gui.set_camera_rel_orientation(camera_rel_orientation);
+				frame_uniforms.update(mats, light_position, gui.getCamera());
+			}
+		}
+
 		if(mesh.to_overwrite_keyframe) {
+			PROFILE_ZONE("preview renders");
 			int key_frame_idx = mesh.key_frame_to_overwrite;
 			TextureToRender* new_texture = new TextureToRender();
 
@@ -534,13 +933,8 @@ int main(int argc, char* argv[])
 			new_texture->bind();
 
 			floor_pass.setup();
-			CHECK_GL_ERROR(glDrawElements(GL_TRIANGLES,
-			                              floor_faces.size() * 3,
-			                              GL_UNSIGNED_INT, 0));
-			object_pass.setup();
-			int mid = 0;
-			while (object_pass.renderWithMaterial(mid))
-				mid++;
+			floor_pass.drawElements(GL_TRIANGLES, floor_faces.size() * 3);
+			draw_object_batches(object_pass, gui.getProjectionMatrix());
 
 			// mesh.textures.push_back(texture);	
 			TextureToRender* old_texture = mesh.textures[key_frame_idx];
@@ -552,13 +946,36 @@ int main(int argc, char* argv[])
 
 
 
+		// Render ids around the cursor, bones on top of the faces just
+		// like the transparent view. The result lags one frame behind.
+		if (gui.isCursorInMainView()) {
+			PROFILE_ZONE("picking");
+			glm::vec2 cursor = gui.getCursor();
+			picker.begin(cursor.x, cursor.y, main_view_width, main_view_height,
+			             gui.getProjectionMatrix());
+			frame_uniforms.setProjection(picker.getProjection());
+			if (draw_object)
+				draw_object_batches(id_object_pass, picker.getProjection());
+			glClear(GL_DEPTH_BUFFER_BIT);
+			id_bone_pass.setup();
+			id_bone_pass.drawElements(GL_LINES, bone_indices.size() * 2);
+			if (gui.getCurrentBone() != -1) {
+				id_cylinder_pass.setup();
+				id_cylinder_pass.drawElements(GL_LINES, cylinder_mesh.indices.size() * 2);
+			}
+			picker.end();
+			frame_uniforms.setProjection(gui.getProjectionMatrix());
+			gui.setPickResult(picker.getResult());
+			glViewport(0, 0, main_view_width, main_view_height);
+		} else {
+			picker.reset();
+		}
+
 		// draw scroll bar
 		if(draw_scroll_bar) {
 			glViewport(window_width - scroll_bar_width, 0, scroll_bar_width, window_height);
 			scroll_bar_pass.setup();
-			CHECK_GL_ERROR(glDrawElements(GL_TRIANGLES,
-			                              scroll_bar_faces.size() * 3,
-			                              GL_UNSIGNED_INT, 0));
+			scroll_bar_pass.drawElements(GL_TRIANGLES, scroll_bar_faces.size() * 3);
 			glViewport(0, 0, main_view_width, main_view_height);
 		}
 		
@@ -570,56 +987,49 @@ int main(int argc, char* argv[])
 			// Draw our lines.
 			// FIXME: you need setup skeleton.joints properly in
 			//        order to see the bones.
-			CHECK_GL_ERROR(glDrawElements(GL_LINES,
-			                              bone_indices.size() * 2,
-			                              GL_UNSIGNED_INT, 0));
+			bone_pass.drawElements(GL_LINES, bone_indices.size() * 2);
 		}
 		draw_cylinder = (current_bone != -1 && gui.isTransparent());
 		if(draw_cylinder) {
 			cylinder_pass.setup();
-			CHECK_GL_ERROR(glDrawElements(GL_LINES,
-		                              cylinder_mesh.indices.size() * 2,
-		                              GL_UNSIGNED_INT, 0));
+			cylinder_pass.drawElements(GL_LINES, cylinder_mesh.indices.size() * 2);
 		}
 		
 		// Then draw floor.
 		if (draw_floor) {
 			floor_pass.setup();
 			// Draw our triangles.
-			CHECK_GL_ERROR(glDrawElements(GL_TRIANGLES,
-			                              floor_faces.size() * 3,
-			                              GL_UNSIGNED_INT, 0));
+			floor_pass.drawElements(GL_TRIANGLES, floor_faces.size() * 3);
 		}
 
 		// Draw the model
 		if (draw_object) {
-			object_pass.setup();
+			draw_object_batches(object_pass, gui.getProjectionMatrix());
+		}
+
+		// Draw the crowd, one instanced call per material
+		if (draw_object && scene.getNumberOfInstances() > 0) {
+			scene.cull(Frustum(gui.getViewProjectionMatrix()));
+			RenderPass& pass = scene.isBaked() ? baked_crowd_pass : crowd_pass;
+			pass.setup();
 			int mid = 0;
-			while (object_pass.renderWithMaterial(mid))
+			while (scene.getNumberOfVisibleInstances() > 0 &&
+			       pass.renderWithMaterial(mid, scene.getNumberOfVisibleInstances()))
 				mid++;
-#if 0
-			// For debugging also
-			if (mid == 0) // Fallback
-				CHECK_GL_ERROR(glDrawElements(GL_TRIANGLES, mesh.faces.size() * 3, GL_UNSIGNED_INT, 0));
-#endif
 		}
 
 		
 
 		// FIXME: update the preview textures here
 		if(mesh.to_save_preview) {
+			PROFILE_ZONE("preview renders");
 			TextureToRender* texture = new TextureToRender();
 			texture->create(main_view_width, main_view_height);
 			texture->bind();
 
 			floor_pass.setup();
-			CHECK_GL_ERROR(glDrawElements(GL_TRIANGLES,
-			                              floor_faces.size() * 3,
-			                              GL_UNSIGNED_INT, 0));
-			object_pass.setup();
-			int mid = 0;
-			while (object_pass.renderWithMaterial(mid))
-				mid++;
+			floor_pass.drawElements(GL_TRIANGLES, floor_faces.size() * 3);
+			draw_object_batches(object_pass, gui.getProjectionMatrix());
 				
 			mesh.textures.push_back(texture);
 			texture->unbind();
@@ -630,7 +1040,10 @@ int main(int argc, char* argv[])
 		
 		// FIXME: Draw previews here, note you need to call glViewport
 		for(int i = 0; i < mesh.textures.size(); i++) {
-			glViewport(main_view_width, main_view_height - (i + 1) * preview_height + gui.get_frame_shift(), preview_width, preview_height);
+			if (!preview_visible(i) || !mesh.textures[i])
+				continue;	// scrolled out of the preview bar
+			int preview_y = main_view_height - (i + 1) * preview_height + gui.get_frame_shift();
+			glViewport(main_view_width, preview_y, preview_width, preview_height);
 			// std::cout << "shift is " << gui.get_frame_shift() << std::endl;
 			sampler = mesh.textures[i]->getTexture();
 
@@ -651,17 +1064,42 @@ int main(int argc, char* argv[])
 			}
 			// std::cout << "texture " << i << ", show cursor? " << show_insert_cursor << ", show border? " << show_border << std::endl;
 			preview_pass.setup();
-			CHECK_GL_ERROR(glDrawElements(GL_TRIANGLES,
-			                              quad_faces.size() * 3,
-			                              GL_UNSIGNED_INT, 0));
+			preview_pass.drawElements(GL_TRIANGLES, quad_faces.size() * 3);
 		}	
 		glViewport(0, 0, main_view_width, main_view_height);
 
 		
+		// Overlay last, on top of everything in the main view
+		if (gui.show_hud_) {
+			HudCounters counters;
+			counters.draws = RenderPass::getDrawStats().draws;
+			counters.triangles = RenderPass::getDrawStats().triangles;
+			counters.uniforms_issued = RenderPass::getUniformStats().issued;
+			counters.uniforms_skipped = RenderPass::getUniformStats().skipped;
+			counters.bones = mesh.getNumberOfBones();
+			counters.previews = mesh.textures.size();
+			for (const TextureToRender* texture : mesh.textures)
+				if (texture)
+					counters.preview_bytes += texture->getBytes();
+			counters.export_frames = gui.to_export_video_ ? exported_frames : -1;
+			hud.layout(counters, main_view_width, main_view_height);
+			hud_pass.updateVBO(0, hud.getVertices().data(), hud.getVertices().size());
+			glDisable(GL_DEPTH_TEST);
+			hud_pass.setup();
+			hud_pass.drawElements(GL_TRIANGLES, hud.getNumberOfIndices());
+			glEnable(GL_DEPTH_TEST);
+		}
+		hud.endFrame();
+
 		// Poll and swap.
+		PROFILE_GPU_END();
 		glfwPollEvents();
-		glfwSwapBuffers(window);
+		{
+			PROFILE_ZONE("swap");
+			glfwSwapBuffers(window);
+		}
 		if (gui.to_export_video_) {
+			PROFILE_ZONE("export readback");
 			if(!export_file_opened) {
 				export_file = popen(export_cmd, "w");
 				export_file_opened = true;
@@ -671,15 +1109,18 @@ int main(int argc, char* argv[])
 			glReadPixels(0, 0, 960, 720, GL_RGB, GL_UNSIGNED_BYTE, export_buffer);
 
 			fwrite(export_buffer, 960 *720*3 , 1, export_file);
+			exported_frames++;
 			
-			if(gui.getCurrentPlayTime() > mesh.key_frames.size() * 1.0 - 1.0) {
+			if(gui.getCurrentPlayTime() * mesh.key_frame_rate > mesh.key_frames.size() * 1.0 - 1.0) {
 				
 				pclose(export_file);
 				export_file_opened = false;
+				exported_frames = 0;
 				gui.to_export_video_ = false;
 				std::cout << "export video done" << std::endl;
 			}
 		}
+		PROFILE_FRAME();
 
 	}
 	glfwDestroyWindow(window);
@@ -0,0 +1,474 @@
+#include "model_cache.h"
+#include "bone_geometry.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+	const char kMagic[4] = { 'C', 'M', 'D', 'L' };
+	const uint32_t kVersion = 6;
+	const size_t kAlignment = 16;   // sections start aligned for SIMD loads
+
+	struct Header {
+		char magic[4];
+		uint32_t version;
+		uint64_t source_hash;
+	};
+
+	struct SectionHeader {
+		uint64_t count;
+		uint64_t element_size;
+	};
+
+	struct CookedJoint {
+		int32_t parent;
+		glm::vec3 position;
+	};
+
+	struct CookedMaterial {
+		glm::vec4 diffuse, ambient, specular;
+		float shininess;
+		int32_t texture;
+		uint64_t offset;
+		uint64_t nfaces;
+	};
+
+	struct CookedIKChain {
+		int32_t effector;
+		uint32_t nlinks;
+		int32_t iterations;
+		float max_angle;
+	};
+
+	struct CookedIKLink {
+		int32_t joint;
+		int32_t limited;
+		glm::vec3 lo, hi;
+	};
+
+	// Strings are stored NUL terminated, one after the other
+	std::vector<char> join_strings(const std::vector<std::string>& strings)
+	{
+		std::vector<char> ret;
+		for (const auto& s : strings)
+			ret.insert(ret.end(), s.c_str(), s.c_str() + s.size() + 1);
+		return ret;
+	}
+
+	std::vector<std::string> split_strings(const std::vector<char>& joined)
+	{
+		std::vector<std::string> ret;
+		for (size_t begin = 0; begin < joined.size(); ) {
+			size_t end = std::find(joined.begin() + begin, joined.end(), '\0') - joined.begin();
+			ret.emplace_back(joined.data() + begin, end - begin);
+			begin = end + 1;
+		}
+		return ret;
+	}
+
+	size_t aligned(size_t offset)
+	{
+		return (offset + kAlignment - 1) / kAlignment * kAlignment;
+	}
+
+	class SectionWriter {
+	public:
+		SectionWriter(std::ofstream& fout) : fout_(fout) {}
+
+		template<typename T>
+		void write(const std::vector<T>& array)
+		{
+			SectionHeader header = { array.size(), sizeof(T) };
+			put(&header, sizeof(header));
+			put(array.data(), array.size() * sizeof(T));
+		}
+
+		void put(const void* data, size_t bytes)
+		{
+			fout_.write((const char*)data, bytes);
+			offset_ += bytes;
+			static const char zeros[kAlignment] = {};
+			size_t pad = aligned(offset_) - offset_;
+			fout_.write(zeros, pad);
+			offset_ += pad;
+		}
+	private:
+		std::ofstream& fout_;
+		size_t offset_ = 0;
+	};
+
+	class SectionReader {
+	public:
+		SectionReader(const unsigned char* begin, const unsigned char* end)
+			: begin_(begin), cursor_(begin), end_(end) {}
+
+		// Fails on anything that does not match the layout written above
+		template<typename T>
+		bool read(std::vector<T>& array)
+		{
+			const SectionHeader* header = (const SectionHeader*)take(sizeof(SectionHeader));
+			if (!header || header->element_size != sizeof(T) ||
+			    header->count > size_t(end_ - cursor_) / sizeof(T))
+				return false;
+			const void* data = take(header->count * sizeof(T));
+			if (!data)
+				return false;
+			array.resize(header->count);
+			if (!array.empty())
+				memcpy((void*)array.data(), data, array.size() * sizeof(T));
+			return true;
+		}
+
+		const void* take(size_t bytes)
+		{
+			if (bytes > size_t(end_ - cursor_))
+				return nullptr;
+			const unsigned char* ret = cursor_;
+			cursor_ += bytes;
+			cursor_ = begin_ + std::min(aligned(cursor_ - begin_), size_t(end_ - begin_));
+			return ret;
+		}
+	private:
+		const unsigned char* begin_;
+		const unsigned char* cursor_;
+		const unsigned char* end_;
+	};
+
+	// Everything read_sections decodes, kept aside until all of it checks out
+	struct Decoded {
+		std::vector<glm::vec4> vertices;
+		std::vector<glm::uvec3> faces;
+		std::vector<glm::vec4> vertex_normals;
+		std::vector<glm::vec2> uv_coordinates;
+		std::vector<glm::ivec4> joint_ids;
+		std::vector<glm::vec4> joint_weights;
+		std::vector<glm::vec3> vector_from_joint[SparseTuple::kMaxJoints];
+		std::vector<Joint> joints;
+		std::vector<Material> materials;
+		std::vector<BoneSphere> bone_spheres;
+		std::vector<std::vector<BoneSphere>> material_bone_spheres;
+		std::vector<MorphTarget> morphs;
+		std::vector<IKChain> ik_chains;
+		ModelTextures textures;
+	};
+
+	bool valid_joint(int joint, size_t njoints)
+	{
+		return joint >= 0 && size_t(joint) < njoints;
+	}
+
+	bool valid_spheres(const std::vector<BoneSphere>& spheres, size_t njoints)
+	{
+		for (const auto& sphere : spheres)
+			if (!valid_joint(sphere.joint, njoints))
+				return false;
+		return true;
+	}
+
+	/*
+	 * Indices are checked against the arrays they index: a stale or
+	 * corrupt file must fail here, not crash in the renderer.
+	 */
+	bool read_sections(SectionReader& reader, Decoded& out)
+	{
+		std::vector<CookedJoint> joints;
+		std::vector<CookedMaterial> materials;
+		std::vector<char> names;
+		std::vector<char> joint_names;
+		std::vector<uint32_t> sphere_counts;
+		std::vector<BoneSphere> material_spheres;
+		std::vector<char> morph_names;
+		std::vector<uint32_t> morph_sizes;
+		std::vector<int32_t> morph_vertices;
+		std::vector<glm::vec3> morph_offsets;
+		std::vector<char> ik_names;
+		std::vector<CookedIKChain> ik_chains;
+		std::vector<CookedIKLink> ik_links;
+		bool ok = reader.read(out.vertices) &&
+		          reader.read(out.faces) &&
+		          reader.read(out.vertex_normals) &&
+		          reader.read(out.uv_coordinates) &&
+		          reader.read(out.joint_ids) &&
+		          reader.read(out.joint_weights) &&
+		          reader.read(out.vector_from_joint[0]) &&
+		          reader.read(out.vector_from_joint[1]) &&
+		          reader.read(out.vector_from_joint[2]) &&
+		          reader.read(out.vector_from_joint[3]) &&
+		          reader.read(joints) &&
+		          reader.read(materials) &&
+		          reader.read(names) &&
+		          reader.read(joint_names) &&
+		          reader.read(out.bone_spheres) &&
+		          reader.read(sphere_counts) &&
+		          reader.read(material_spheres) &&
+		          reader.read(morph_names) &&
+		          reader.read(morph_sizes) &&
+		          reader.read(morph_vertices) &&
+		          reader.read(morph_offsets) &&
+		          reader.read(ik_names) &&
+		          reader.read(ik_chains) &&
+		          reader.read(ik_links);
+		if (!ok || sphere_counts.size() != materials.size())
+			return false;
+
+		size_t nverts = out.vertices.size();
+		size_t njoints = joints.size();
+		for (const auto& face : out.faces)
+			if (face.x >= nverts || face.y >= nverts || face.z >= nverts)
+				return false;
+		size_t nweights = out.joint_ids.size();
+		if (out.joint_weights.size() != nweights)
+			return false;
+		for (const auto& vectors : out.vector_from_joint)
+			if (vectors.size() != nweights)
+				return false;
+		for (const glm::ivec4& ids : out.joint_ids)
+			for (int k = 0; k < SparseTuple::kMaxJoints; k++)
+				if (!valid_joint(ids[k], njoints))
+					return false;
+		if (!valid_spheres(out.bone_spheres, njoints) ||
+		    !valid_spheres(material_spheres, njoints))
+			return false;
+
+		out.textures.files = split_strings(names);
+		std::vector<std::string> joint_name_list = split_strings(joint_names);
+		if (joint_name_list.size() != njoints)
+			return false;
+		for (size_t i = 0; i < njoints; i++) {
+			if (joints[i].parent < -1 || joints[i].parent >= int(njoints))
+				return false;
+			out.joints.emplace_back(int(i), joints[i].position, joints[i].parent);
+			out.joints.back().name = joint_name_list[i];
+		}
+
+		std::vector<std::string> morph_name_list = split_strings(morph_names);
+		if (morph_name_list.size() != morph_sizes.size() ||
+		    morph_vertices.size() != morph_offsets.size())
+			return false;
+		for (int32_t vertex : morph_vertices)
+			if (vertex < 0 || size_t(vertex) >= nverts)
+				return false;
+		out.morphs.resize(morph_sizes.size());
+		size_t first_offset = 0;
+		for (size_t i = 0; i < morph_sizes.size(); i++) {
+			if (morph_sizes[i] > morph_vertices.size() - first_offset)
+				return false;
+			MorphTarget& morph = out.morphs[i];
+			morph.name = morph_name_list[i];
+			morph.vertices.assign(morph_vertices.begin() + first_offset,
+			                      morph_vertices.begin() + first_offset + morph_sizes[i]);
+			morph.offsets.assign(morph_offsets.begin() + first_offset,
+			                     morph_offsets.begin() + first_offset + morph_sizes[i]);
+			first_offset += morph_sizes[i];
+		}
+
+		std::vector<std::string> ik_name_list = split_strings(ik_names);
+		if (ik_name_list.size() != ik_chains.size())
+			return false;
+		for (const auto& link : ik_links)
+			if (!valid_joint(link.joint, njoints))
+				return false;
+		out.ik_chains.resize(ik_chains.size());
+		size_t first_link = 0;
+		for (size_t i = 0; i < ik_chains.size(); i++) {
+			const CookedIKChain& cooked = ik_chains[i];
+			if (cooked.nlinks > ik_links.size() - first_link ||
+			    !valid_joint(cooked.effector, njoints))
+				return false;
+			IKChain& chain = out.ik_chains[i];
+			chain.name = ik_name_list[i];
+			chain.effector = cooked.effector;
+			chain.iterations = cooked.iterations;
+			chain.max_angle = cooked.max_angle;
+			for (size_t j = first_link; j < first_link + cooked.nlinks; j++)
+				chain.links.push_back({ ik_links[j].joint, ik_links[j].limited != 0,
+				                        ik_links[j].lo, ik_links[j].hi });
+			first_link += cooked.nlinks;
+		}
+
+		size_t nfaces = out.faces.size();
+		out.materials.resize(materials.size());
+		out.textures.material_texture.resize(materials.size());
+		out.material_bone_spheres.resize(materials.size());
+		size_t first_sphere = 0;
+		for (size_t i = 0; i < materials.size(); i++) {
+			const CookedMaterial& cooked = materials[i];
+			if (cooked.offset > nfaces || cooked.nfaces > nfaces - cooked.offset)
+				return false;
+			if (cooked.texture < -1 || cooked.texture >= int(out.textures.files.size()))
+				return false;
+			Material& ma = out.materials[i];
+			ma.diffuse = cooked.diffuse;
+			ma.ambient = cooked.ambient;
+			ma.specular = cooked.specular;
+			ma.shininess = cooked.shininess;
+			ma.offset = cooked.offset;
+			ma.nfaces = cooked.nfaces;
+			out.textures.material_texture[i] = cooked.texture;
+			if (sphere_counts[i] > material_spheres.size() - first_sphere)
+				return false;
+			out.material_bone_spheres[i].assign(material_spheres.begin() + first_sphere,
+			                                    material_spheres.begin() + first_sphere + sphere_counts[i]);
+			first_sphere += sphere_counts[i];
+		}
+		return true;
+	}
+
+	void move_into(Decoded& in, Mesh& mesh, ModelTextures& textures)
+	{
+		mesh.vertices = std::move(in.vertices);
+		mesh.faces = std::move(in.faces);
+		mesh.vertex_normals = std::move(in.vertex_normals);
+		mesh.uv_coordinates = std::move(in.uv_coordinates);
+		mesh.joint_ids = std::move(in.joint_ids);
+		mesh.joint_weights = std::move(in.joint_weights);
+		for (int k = 0; k < SparseTuple::kMaxJoints; k++)
+			mesh.vector_from_joint[k] = std::move(in.vector_from_joint[k]);
+		mesh.skeleton.joints = std::move(in.joints);
+		mesh.materials = std::move(in.materials);
+		mesh.bone_spheres = std::move(in.bone_spheres);
+		mesh.material_bone_spheres = std::move(in.material_bone_spheres);
+		mesh.morphs = std::move(in.morphs);
+		mesh.ik_chains = std::move(in.ik_chains);
+		textures = std::move(in.textures);
+	}
+}
+
+bool load_cooked_model(const std::string& fn, uint64_t source_hash,
+                       Mesh& mesh, ModelTextures& textures)
+{
+	int fd = open(fn.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(Header)) {
+		close(fd);
+		return false;
+	}
+	size_t size = size_t(st.st_size);
+	void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+
+	const unsigned char* begin = (const unsigned char*)data;
+	SectionReader reader(begin, begin + size);
+	const Header* header = (const Header*)reader.take(sizeof(Header));
+	bool ok = header && memcmp(header->magic, kMagic, 4) == 0 &&
+	          header->version == kVersion &&
+	          header->source_hash == source_hash;
+	// mesh is left alone unless the whole file decodes
+	Decoded decoded;
+	if (ok)
+		ok = read_sections(reader, decoded);
+	munmap(data, size);
+	if (ok) {
+		move_into(decoded, mesh, textures);
+		std::cerr << "Loaded cooked model " << fn << std::endl;
+	}
+	return ok;
+}
+
+bool save_cooked_model(const std::string& fn, uint64_t source_hash,
+                       const Mesh& mesh, const ModelTextures& textures)
+{
+	std::vector<CookedJoint> joints;
+	std::vector<std::string> joint_name_list;
+	for (const auto& joint : mesh.skeleton.joints) {
+		joints.push_back({ joint.parent_index, joint.init_position });
+		joint_name_list.emplace_back(joint.name);
+	}
+	std::vector<CookedMaterial> materials;
+	std::vector<uint32_t> sphere_counts;
+	std::vector<BoneSphere> material_spheres;
+	for (size_t i = 0; i < mesh.materials.size(); i++) {
+		const Material& ma = mesh.materials[i];
+		CookedMaterial cooked = CookedMaterial();
+		cooked.diffuse = ma.diffuse;
+		cooked.ambient = ma.ambient;
+		cooked.specular = ma.specular;
+		cooked.shininess = ma.shininess;
+		cooked.texture = i < textures.material_texture.size() ? textures.material_texture[i] : -1;
+		cooked.offset = ma.offset;
+		cooked.nfaces = ma.nfaces;
+		materials.emplace_back(cooked);
+		sphere_counts.emplace_back(0);
+		if (i < mesh.material_bone_spheres.size()) {
+			const auto& spheres = mesh.material_bone_spheres[i];
+			sphere_counts.back() = spheres.size();
+			material_spheres.insert(material_spheres.end(), spheres.begin(), spheres.end());
+		}
+	}
+	std::vector<char> names = join_strings(textures.files);
+	std::vector<char> joint_names = join_strings(joint_name_list);
+	std::vector<std::string> morph_name_list;
+	std::vector<uint32_t> morph_sizes;
+	std::vector<int32_t> morph_vertices;
+	std::vector<glm::vec3> morph_offsets;
+	for (const auto& morph : mesh.morphs) {
+		morph_name_list.emplace_back(morph.name);
+		morph_sizes.emplace_back(morph.vertices.size());
+		morph_vertices.insert(morph_vertices.end(), morph.vertices.begin(), morph.vertices.end());
+		morph_offsets.insert(morph_offsets.end(), morph.offsets.begin(), morph.offsets.end());
+	}
+	std::vector<char> morph_names = join_strings(morph_name_list);
+	std::vector<std::string> ik_name_list;
+	std::vector<CookedIKChain> ik_chains;
+	std::vector<CookedIKLink> ik_links;
+	for (const auto& chain : mesh.ik_chains) {
+		ik_name_list.emplace_back(chain.name);
+		ik_chains.push_back({ chain.effector, uint32_t(chain.links.size()),
+		                      chain.iterations, chain.max_angle });
+		for (const auto& link : chain.links)
+			ik_links.push_back({ link.joint, link.limited, link.lo, link.hi });
+	}
+	std::vector<char> ik_names = join_strings(ik_name_list);
+
+	std::string tmp = fn + ".tmp";
+	{
+		std::ofstream fout(tmp, std::ios::binary);
+		if (!fout.good()) {
+			std::cerr << "Cannot write cooked model " << fn << std::endl;
+			return false;
+		}
+		SectionWriter writer(fout);
+		Header header;
+		memcpy(header.magic, kMagic, 4);
+		header.version = kVersion;
+		header.source_hash = source_hash;
+		writer.put(&header, sizeof(header));
+		writer.write(mesh.vertices);
+		writer.write(mesh.faces);
+		writer.write(mesh.vertex_normals);
+		writer.write(mesh.uv_coordinates);
+		writer.write(mesh.joint_ids);
+		writer.write(mesh.joint_weights);
+		for (const auto& vectors : mesh.vector_from_joint)
+			writer.write(vectors);
+		writer.write(joints);
+		writer.write(materials);
+		writer.write(names);
+		writer.write(joint_names);
+		writer.write(mesh.bone_spheres);
+		writer.write(sphere_counts);
+		writer.write(material_spheres);
+		writer.write(morph_names);
+		writer.write(morph_sizes);
+		writer.write(morph_vertices);
+		writer.write(morph_offsets);
+		writer.write(ik_names);
+		writer.write(ik_chains);
+		writer.write(ik_links);
+		if (!fout.good()) {
+			std::cerr << "Cannot write cooked model " << fn << std::endl;
+			return false;
+		}
+	}
+	return std::rename(tmp.c_str(), fn.c_str()) == 0;
+}
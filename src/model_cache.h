@@ -0,0 +1,31 @@
+#ifndef MODEL_CACHE_H
+#define MODEL_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct Mesh;
+
+/*
+ * Cooked models: the arrays Mesh::loadPmd produces (vertex attributes,
+ * faces, joints and their names, materials, morphs, IK chains, bone
+ * spheres) written as is, so a later load maps the file and copies them
+ * instead of parsing and converting the PMD. The file carries the hash
+ * of the source model and is ignored once the model changes.
+ */
+struct ModelTextures {
+	std::vector<std::string> files;
+	std::vector<int> material_texture;  // index into files, or -1
+};
+
+/*
+ * load_cooked_model: fill mesh (without textures) and textures from fn
+ * if it was cooked from a source with source_hash.
+ */
+bool load_cooked_model(const std::string& fn, uint64_t source_hash,
+                       Mesh& mesh, ModelTextures& textures);
+bool save_cooked_model(const std::string& fn, uint64_t source_hash,
+                       const Mesh& mesh, const ModelTextures& textures);
+
+#endif
@@ -0,0 +1,83 @@
+#include <GL/glew.h>
+#include <debuggl.h>
+#include "morph_targets.h"
+#include <algorithm>
+#include <iostream>
+
+MorphTargets::MorphTargets()
+	: weight_stream_(GL_TEXTURE_BUFFER)
+{
+}
+
+MorphTargets::~MorphTargets()
+{
+	if (offset_texture_)
+		glDeleteTextures(1, &offset_texture_);
+	if (offset_buffer_)
+		glDeleteBuffers(1, &offset_buffer_);
+	if (weight_texture_)
+		glDeleteTextures(1, &weight_texture_);
+}
+
+void MorphTargets::build(const std::vector<MorphTarget>& morphs, size_t nvertices)
+{
+	nmorphs_ = morphs.size();
+	ranges_.assign(nvertices, glm::ivec2(0, 0));
+	for (const auto& morph : morphs)
+		for (int vid : morph.vertices)
+			if (vid >= 0 && size_t(vid) < nvertices)
+				ranges_[vid][1]++;
+	int first = 0;
+	for (auto& range : ranges_) {
+		range[0] = first;
+		first += range[1];
+		range[1] = 0;
+	}
+	offsets_.resize(first);
+	for (size_t m = 0; m < morphs.size(); m++) {
+		const MorphTarget& morph = morphs[m];
+		for (size_t i = 0; i < morph.vertices.size(); i++) {
+			int vid = morph.vertices[i];
+			if (vid < 0 || size_t(vid) >= nvertices)
+				continue;
+			glm::ivec2& range = ranges_[vid];
+			offsets_[range[0] + range[1]] = glm::vec4(morph.offsets[i], float(m));
+			range[1]++;
+		}
+	}
+	// A buffer texture needs some storage even without morphs
+	std::vector<glm::vec4> texels = offsets_;
+	if (texels.empty())
+		texels.emplace_back(0.0f);
+
+	if (!offset_buffer_) {
+		CHECK_GL_ERROR(glGenBuffers(1, &offset_buffer_));
+		CHECK_GL_ERROR(glGenTextures(1, &offset_texture_));
+	}
+	CHECK_GL_ERROR(glBindBuffer(GL_TEXTURE_BUFFER, offset_buffer_));
+	CHECK_GL_ERROR(glBufferData(GL_TEXTURE_BUFFER, texels.size() * sizeof(glm::vec4),
+	                            texels.data(), GL_STATIC_DRAW));
+	CHECK_GL_ERROR(glBindBuffer(GL_TEXTURE_BUFFER, 0));
+	CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_BUFFER, offset_texture_));
+	CHECK_GL_ERROR(glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, offset_buffer_));
+	CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_BUFFER, 0));
+
+	weights_.clear();
+	std::cerr << nmorphs_ << " morphs, " << offsets_.size() << " offsets" << std::endl;
+}
+
+unsigned MorphTargets::update(const std::vector<float>& weights)
+{
+	std::vector<float> padded(weights);
+	padded.resize(std::max<size_t>(nmorphs_, 1), 0.0f);
+	if (weight_texture_ && padded == weights_)
+		return weight_texture_;
+	weights_ = padded;
+	if (!weight_texture_)
+		CHECK_GL_ERROR(glGenTextures(1, &weight_texture_));
+	unsigned buffer = weight_stream_.update(weights_.data(), weights_.size() * sizeof(float));
+	CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_BUFFER, weight_texture_));
+	CHECK_GL_ERROR(glTexBuffer(GL_TEXTURE_BUFFER, GL_R32F, buffer));
+	CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_BUFFER, 0));
+	return weight_texture_;
+}
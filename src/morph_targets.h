@@ -0,0 +1,47 @@
+#ifndef MORPH_TARGETS_H
+#define MORPH_TARGETS_H
+
+#include <vector>
+#include <glm/glm.hpp>
+#include <mmdadapter.h>
+#include "stream_buffer.h"
+
+/*
+ * MorphTargets: vertex morphs applied by the skinning shader.
+ *
+ * The offsets of all morphs are regrouped by vertex into one RGBA32F
+ * buffer texture, each texel holding
+ *      xyz: offset of the rest position, w: morph index
+ * and every vertex gets a range (first texel, count) as an attribute.
+ * Vertices no morph touches have an empty range, so the shader only
+ * reads offsets of the affected vertices and no per-vertex blend buffer
+ * exists. The weights live in an R32F buffer texture indexed by morph.
+ */
+class MorphTargets {
+public:
+	MorphTargets();
+	~MorphTargets();
+
+	void build(const std::vector<MorphTarget>& morphs, size_t nvertices);
+	// Attribute data, one (first, count) per vertex
+	const std::vector<glm::ivec2>& getRanges() const { return ranges_; }
+	/*
+	 * update: upload weights if they changed since the last call.
+	 * Return: the weight texture.
+	 */
+	unsigned update(const std::vector<float>& weights);
+	unsigned getOffsetTexture() const { return offset_texture_; }
+	unsigned getWeightTexture() const { return weight_texture_; }
+	size_t getNumberOfOffsets() const { return offsets_.size(); }
+private:
+	std::vector<glm::ivec2> ranges_;
+	std::vector<glm::vec4> offsets_;
+	std::vector<float> weights_;    // last upload
+	size_t nmorphs_ = 0;
+	unsigned offset_buffer_ = 0;
+	unsigned offset_texture_ = 0;
+	StreamBuffer weight_stream_;
+	unsigned weight_texture_ = 0;
+};
+
+#endif
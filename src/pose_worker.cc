@@ -0,0 +1,115 @@
+#include "pose_worker.h"
+#include "profiler.h"
+
+PoseWorker::PoseWorker(const Mesh& mesh)
+	: mesh_(mesh), state_(2), tasks_(true)
+{
+}
+
+PoseWorker::~PoseWorker()
+{
+	reset();
+	// tasks_ goes first and waits for a running drain
+}
+
+/*
+ * Copying is skipped while nothing changed, which is every frame of a
+ * plain playback: the render thread does not pose the skeleton then.
+ */
+void PoseWorker::sync(const Mesh& mesh)
+{
+	if (synced_ &&
+	    key_frames_version_ == mesh.key_frames_version &&
+	    pose_version_ == mesh.skeleton.pose_version &&
+	    ik_version_ == mesh.ik_solver.getVersion() &&
+	    spline_ == mesh.spline_interpolation_enabled)
+		return;
+	PROFILE_ZONE("PoseWorker::sync");
+	std::unique_ptr<Snapshot> snapshot(new Snapshot);
+	snapshot->skeleton = mesh.skeleton;
+	snapshot->key_frames = mesh.key_frames;
+	snapshot->spline = mesh.spline_interpolation_enabled;
+	snapshot->ik = mesh.ik_solver;
+	snapshot->morph_weights = mesh.morph_weights;
+	key_frames_version_ = mesh.key_frames_version;
+	pose_version_ = mesh.skeleton.pose_version;
+	ik_version_ = mesh.ik_solver.getVersion();
+	spline_ = mesh.spline_interpolation_enabled;
+	synced_ = true;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	pending_ = std::move(snapshot);
+}
+
+/*
+ * One drain task at a time takes the requests, so the buffers it writes
+ * need no lock of their own.
+ */
+void PoseWorker::request(float t)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		requested_time_ = t;
+		has_request_ = true;
+		if (busy_)
+			return;
+		busy_ = true;
+	}
+	tasks_.run([this] { drain(); });
+}
+
+/*
+ * Poses requested before the last reset are taken off the queue but not
+ * reported, so nothing of the worker may be shown after a reset until
+ * acquire() succeeds again.
+ */
+bool PoseWorker::acquire()
+{
+	if (!(state_.load() & kFresh))
+		return false;
+	front_ = state_.exchange(front_) & ~kFresh;
+	return generations_[front_] == generation_;
+}
+
+void PoseWorker::reset()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	has_request_ = false;
+	generation_++;
+}
+
+void PoseWorker::drain()
+{
+	while (true) {
+		float t;
+		unsigned generation;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (!has_request_) {
+				busy_ = false;
+				return;
+			}
+			has_request_ = false;
+			t = requested_time_;
+			generation = generation_;
+			if (pending_)
+				snapshot_ = std::move(pending_);
+		}
+		if (!snapshot_)
+			continue;
+		evaluate(t, buffers_[back_]);
+		generations_[back_] = generation;
+		back_ = state_.exchange(back_ | kFresh) & ~kFresh;
+	}
+}
+
+// Same steps as Mesh::updateAnimation, on the copies
+void PoseWorker::evaluate(float t, AnimatedPose& pose)
+{
+	Snapshot& snapshot = *snapshot_;
+	KeyFrame frame;
+	bool animated = KeyFrame::sample(snapshot.key_frames, t, snapshot.spline, frame);
+	if (!animated)
+		pose.morph_weights = snapshot.morph_weights;
+	mesh_.evaluatePose(animated ? &frame : nullptr, snapshot.skeleton, snapshot.ik, pose);
+}
@@ -0,0 +1,69 @@
+#ifndef POSE_WORKER_H
+#define POSE_WORKER_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <job_system.h>
+#include "bone_geometry.h"
+
+/*
+ * PoseWorker: evaluates playback poses of a mesh on the job system, in a
+ * background group so the render thread never runs it while it waits.
+ *
+ * The render thread asks for the pose of the next frame with request()
+ * and picks up the newest finished one with acquire(), which only swaps
+ * buffer indices: of the three poses one is shown, one is the newest
+ * finished and one is being written. The worker poses its own copy of the
+ * skeleton, key frames and IK goals, which sync() refreshes when the mesh
+ * changed them.
+ */
+class PoseWorker {
+public:
+	PoseWorker(const Mesh& mesh);
+	~PoseWorker();
+
+	// sync: call on the render thread before request()
+	void sync(const Mesh& mesh);
+	// request: evaluate the pose at time t (in key frames), replacing an older request
+	void request(float t);
+	// acquire: make the newest finished pose front(), false if there is none
+	bool acquire();
+	// reset: forget the poses evaluated so far, e.g. when playback restarts
+	void reset();
+	const AnimatedPose& front() const { return buffers_[front_]; }
+private:
+	struct Snapshot {
+		Skeleton skeleton;
+		std::vector<KeyFrame> key_frames;
+		bool spline;
+		IKSolver ik;
+		std::vector<float> morph_weights;
+	};
+	static const int kFresh = 4;    // state_: ready buffer index | kFresh
+
+	void drain();
+	void evaluate(float t, AnimatedPose& pose);
+
+	const Mesh& mesh_;
+	AnimatedPose buffers_[3];
+	unsigned generations_[3] = {0, 0, 0};
+	int front_ = 0;                 // render thread only
+	int back_ = 1;                  // drain task only
+	std::atomic<int> state_;
+
+	std::unique_ptr<Snapshot> snapshot_;   // drain task only
+	std::unique_ptr<Snapshot> pending_;
+	unsigned key_frames_version_ = 0, pose_version_ = 0, ik_version_ = 0;
+	bool spline_ = false;
+	bool synced_ = false;
+
+	std::mutex mutex_;
+	bool busy_ = false;             // a drain task is queued or running
+	bool has_request_ = false;
+	float requested_time_ = 0.0f;
+	unsigned generation_ = 0;       // bumped by reset, guarded by mutex_
+	TaskGroup tasks_;               // last, destroyed before what drain uses
+};
+
+#endif
@@ -1,6 +1,9 @@
 #include "procedure_geometry.h"
 #include "bone_geometry.h"
 #include "config.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 void create_floor(std::vector<glm::vec4>& floor_vertices, std::vector<glm::uvec3>& floor_faces)
 {
@@ -144,6 +147,89 @@ float line_segment_distance(const glm::vec3& line1_start, const glm::vec3& line1
 }
 
 
+#ifdef __SSE2__
+namespace {
+	inline __m128 select4(__m128 mask, __m128 a, __m128 b)
+	{
+		return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+	}
+}
+#endif
+
+// Same branches as line_segment_distance, evaluated as masks on four lanes.
+void line_segment_distance4(const glm::vec3& line1_start, const glm::vec3& line1_end,
+							const float* start_x, const float* start_y, const float* start_z,
+							const float* end_x, const float* end_y, const float* end_z,
+							float* distances)
+{
+#ifdef __SSE2__
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 small = _mm_set1_ps(SMALL_NUM);
+	const __m128 sign = _mm_set1_ps(-0.0f);
+
+	glm::vec3 u = line1_end - line1_start;
+	__m128 ux = _mm_set1_ps(u.x), uy = _mm_set1_ps(u.y), uz = _mm_set1_ps(u.z);
+	__m128 sx = _mm_loadu_ps(start_x), sy = _mm_loadu_ps(start_y), sz = _mm_loadu_ps(start_z);
+	__m128 vx = _mm_sub_ps(_mm_loadu_ps(end_x), sx);
+	__m128 vy = _mm_sub_ps(_mm_loadu_ps(end_y), sy);
+	__m128 vz = _mm_sub_ps(_mm_loadu_ps(end_z), sz);
+	__m128 wx = _mm_sub_ps(_mm_set1_ps(line1_start.x), sx);
+	__m128 wy = _mm_sub_ps(_mm_set1_ps(line1_start.y), sy);
+	__m128 wz = _mm_sub_ps(_mm_set1_ps(line1_start.z), sz);
+
+	auto dot = [](__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz) {
+		return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+	};
+	__m128 a = _mm_set1_ps(glm::dot(u, u));
+	__m128 b = dot(ux, uy, uz, vx, vy, vz);
+	__m128 c = dot(vx, vy, vz, vx, vy, vz);
+	__m128 d = dot(ux, uy, uz, wx, wy, wz);
+	__m128 e = dot(vx, vy, vz, wx, wy, wz);
+	__m128 D = _mm_sub_ps(_mm_mul_ps(a, c), _mm_mul_ps(b, b));
+
+	// closest points of the infinite lines, or P0 if almost parallel
+	__m128 parallel = _mm_cmplt_ps(D, small);
+	__m128 sN = select4(parallel, zero, _mm_sub_ps(_mm_mul_ps(b, e), _mm_mul_ps(c, d)));
+	__m128 sD = select4(parallel, one, D);
+	__m128 tN = select4(parallel, e, _mm_sub_ps(_mm_mul_ps(a, e), _mm_mul_ps(b, d)));
+	__m128 tD = select4(parallel, c, D);
+
+	// s = 0 or s = 1 edge
+	__m128 s_low = _mm_andnot_ps(parallel, _mm_cmplt_ps(sN, zero));
+	__m128 s_high = _mm_andnot_ps(_mm_or_ps(parallel, s_low), _mm_cmpgt_ps(sN, sD));
+	__m128 s_edge = _mm_or_ps(s_low, s_high);
+	sN = select4(s_low, zero, select4(s_high, sD, sN));
+	tN = select4(s_low, e, select4(s_high, _mm_add_ps(e, b), tN));
+	tD = select4(s_edge, c, tD);
+
+	// t = 0 or t = 1 edge, recompute s for it
+	__m128 t_low = _mm_cmplt_ps(tN, zero);
+	__m128 t_high = _mm_andnot_ps(t_low, _mm_cmpgt_ps(tN, tD));
+	__m128 t_edge = _mm_or_ps(t_low, t_high);
+	tN = select4(t_low, zero, select4(t_high, tD, tN));
+	__m128 x = select4(t_high, _mm_sub_ps(b, d), _mm_xor_ps(d, sign));
+	__m128 x_low = _mm_and_ps(t_edge, _mm_cmplt_ps(x, zero));
+	__m128 x_high = _mm_andnot_ps(x_low, _mm_and_ps(t_edge, _mm_cmpgt_ps(x, a)));
+	__m128 x_mid = _mm_andnot_ps(_mm_or_ps(x_low, x_high), t_edge);
+	sN = select4(x_low, zero, select4(x_high, sD, select4(x_mid, x, sN)));
+	sD = select4(x_mid, a, sD);
+
+	__m128 sc = select4(_mm_cmplt_ps(_mm_andnot_ps(sign, sN), small), zero, _mm_div_ps(sN, sD));
+	__m128 tc = select4(_mm_cmplt_ps(_mm_andnot_ps(sign, tN), small), zero, _mm_div_ps(tN, tD));
+
+	__m128 px = _mm_sub_ps(_mm_add_ps(wx, _mm_mul_ps(sc, ux)), _mm_mul_ps(tc, vx));
+	__m128 py = _mm_sub_ps(_mm_add_ps(wy, _mm_mul_ps(sc, uy)), _mm_mul_ps(tc, vy));
+	__m128 pz = _mm_sub_ps(_mm_add_ps(wz, _mm_mul_ps(sc, uz)), _mm_mul_ps(tc, vz));
+	_mm_storeu_ps(distances, _mm_sqrt_ps(dot(px, py, pz, px, py, pz)));
+#else
+	for (int i = 0; i < 4; i++) {
+		distances[i] = line_segment_distance(line1_start, line1_end,
+				glm::vec3(start_x[i], start_y[i], start_z[i]),
+				glm::vec3(end_x[i], end_y[i], end_z[i]));
+	}
+#endif
+}
 
 // reference: http://www.opengl-tutorial.org/intermediate-tutorials/tutorial-17-quaternions/#how-do-i-find-the-rotation-between-2-vectors-
 glm::fquat quaternion_between_two_directs(glm::vec3 start, glm::vec3 dest){
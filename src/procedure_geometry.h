@@ -18,6 +18,12 @@ void create_axes_mesh(LineMesh& axes_mesh);
 /*---------------my helper functions --------------*/
 float line_segment_distance(const glm::vec3& line1_start, const glm::vec3& line1_end, 
 							const glm::vec3& line2_start, const glm::vec3& line2_end);
+// line_segment_distance from one segment to four others at once (SSE when available).
+// The four segments are given in SoA layout, distances receives four floats.
+void line_segment_distance4(const glm::vec3& line1_start, const glm::vec3& line1_end,
+							const float* start_x, const float* start_y, const float* start_z,
+							const float* end_x, const float* end_y, const float* end_z,
+							float* distances);
 glm::fquat quaternion_between_two_directs(glm::vec3 from, glm::vec3 to);
 float angle_between_two_directs_2D(glm::vec2 direct1, glm::vec2 direct2);
 void printMat4(const glm::mat4& mat);
@@ -0,0 +1,300 @@
+#include <GL/glew.h>
+#include <debuggl.h>
+#include "profiler.h"
+#include "config.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace {
+	struct Event {
+		const char* name;
+		uint64_t begin, end;
+	};
+
+	struct Slot {
+		std::atomic<const char*> name{nullptr};
+		std::atomic<uint64_t> begin{0}, end{0};
+	};
+
+	/*
+	 * Only the owning thread writes to a log, without locking: it fills a
+	 * slot and then publishes it by bumping count. A capture copies the
+	 * ring while the owner keeps recording, and drops the slots the owner
+	 * may have overwritten meanwhile.
+	 */
+	struct ThreadLog {
+		std::unique_ptr<Slot[]> ring;
+		uint64_t size = 0;
+		std::atomic<uint64_t> count{0};     // events ever recorded, the newest is at (count - 1) % size
+		int tid = 0;
+		std::mutex name_mutex;
+		std::string name;
+
+		void push(const Event& event)
+		{
+			uint64_t n = count.load(std::memory_order_relaxed);
+			Slot& slot = ring[n % size];
+			slot.name.store(event.name, std::memory_order_relaxed);
+			slot.begin.store(event.begin, std::memory_order_relaxed);
+			slot.end.store(event.end, std::memory_order_relaxed);
+			count.store(n + 1, std::memory_order_release);
+		}
+
+		// copy: the events in the ring, oldest first. Any thread.
+		void copy(std::vector<Event>& events) const
+		{
+			uint64_t newest = count.load(std::memory_order_acquire);
+			uint64_t oldest = newest > size ? newest - size : 0;
+			for (uint64_t i = oldest; i < newest; i++) {
+				const Slot& slot = ring[i % size];
+				events.push_back({ slot.name.load(std::memory_order_relaxed),
+				                   slot.begin.load(std::memory_order_relaxed),
+				                   slot.end.load(std::memory_order_relaxed) });
+			}
+			// The slot of event now - size may be half rewritten, and older ones are gone
+			std::atomic_thread_fence(std::memory_order_acquire);
+			uint64_t now = count.load(std::memory_order_relaxed);
+			uint64_t overwritten = now + 1 > oldest + size ? now + 1 - size - oldest : 0;
+			events.erase(events.begin(), events.begin() + std::min<uint64_t>(overwritten, events.size()));
+		}
+	};
+
+	// Logs outlive their threads, workers may be gone by the time of a capture
+	std::mutex logs_mutex;
+	std::vector<std::unique_ptr<ThreadLog>> logs;
+	thread_local ThreadLog* thread_log = nullptr;
+
+	ThreadLog* new_log(const std::string& name)
+	{
+		std::unique_ptr<ThreadLog> log(new ThreadLog);
+		log->size = kProfileRingSize;
+		log->ring.reset(new Slot[log->size]);
+		std::lock_guard<std::mutex> lock(logs_mutex);
+		log->tid = int(logs.size());
+		log->name = name.empty() ? "thread " + std::to_string(log->tid) : name;
+		logs.emplace_back(std::move(log));
+		return logs.back().get();
+	}
+
+	ThreadLog& get_thread_log()
+	{
+		if (!thread_log)
+			thread_log = new_log("");
+		return *thread_log;
+	}
+
+	// GL thread only from here on
+	struct GpuZone {
+		const char* name;
+		unsigned begin, end;    // GL_TIMESTAMP queries
+	};
+	ThreadLog* gpu_log = nullptr;
+	std::vector<unsigned> free_queries;
+	std::deque<GpuZone> issued_zones;   // oldest first, results pending
+	GpuZone open_zone;
+	bool zone_open = false;
+	int64_t gpu_to_cpu = 0;         // add to GPU timestamps
+	bool calibrated = false;
+	uint64_t zones_issued = 0, zones_resolved = 0;
+	uint64_t frame_begin = 0;
+
+	bool capture_requested = false;
+	int capture_frames_left = 0;
+	bool capture_waiting = false;   // frames done, GPU results outstanding
+	uint64_t capture_begin = 0, capture_end = 0;
+	uint64_t capture_zones = 0;     // zones_issued at capture_end
+	int capture_number = 0;
+
+	unsigned take_query()
+	{
+		if (free_queries.empty()) {
+			unsigned query;
+			CHECK_GL_ERROR(glGenQueries(1, &query));
+			return query;
+		}
+		unsigned query = free_queries.back();
+		free_queries.pop_back();
+		return query;
+	}
+
+	/*
+	 * GL_TIMESTAMP readings are on the GPU clock; relate it to ours once
+	 * per capture, drift within a few frames is far below a microsecond.
+	 */
+	void calibrate()
+	{
+		GLint64 gpu_now = 0;
+		CHECK_GL_ERROR(glGetInteger64v(GL_TIMESTAMP, &gpu_now));
+		gpu_to_cpu = int64_t(Profiler::nowNs()) - gpu_now;
+		calibrated = true;
+	}
+
+	void resolve_gpu_zones()
+	{
+		while (!issued_zones.empty()) {
+			const GpuZone& zone = issued_zones.front();
+			GLint available = 0;
+			CHECK_GL_ERROR(glGetQueryObjectiv(zone.end, GL_QUERY_RESULT_AVAILABLE, &available));
+			if (!available)
+				break;
+			GLuint64 begin = 0, end = 0;
+			CHECK_GL_ERROR(glGetQueryObjectui64v(zone.begin, GL_QUERY_RESULT, &begin));
+			CHECK_GL_ERROR(glGetQueryObjectui64v(zone.end, GL_QUERY_RESULT, &end));
+			gpu_log->push({ zone.name, uint64_t(int64_t(begin) + gpu_to_cpu),
+			                uint64_t(int64_t(end) + gpu_to_cpu) });
+			free_queries.emplace_back(zone.begin);
+			free_queries.emplace_back(zone.end);
+			issued_zones.pop_front();
+			zones_resolved++;
+		}
+	}
+
+	void write_json_string(std::ostream& out, const std::string& s)
+	{
+		out << '"';
+		for (char c : s) {
+			if (c == '"' || c == '\\')
+				out << '\\';
+			out << c;
+		}
+		out << '"';
+	}
+
+	void write_capture()
+	{
+		std::string fn = kProfileCapturePrefix + std::to_string(capture_number++) + ".json";
+		std::ofstream out(fn);
+		if (!out) {
+			std::cerr << "Cannot write profile capture " << fn << std::endl;
+			return;
+		}
+		std::vector<ThreadLog*> snapshot;
+		{
+			std::lock_guard<std::mutex> lock(logs_mutex);
+			for (const auto& log : logs)
+				snapshot.emplace_back(log.get());
+		}
+		out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+		bool first = true;
+		size_t nevents = 0;
+		for (ThreadLog* log : snapshot) {
+			out << (first ? "\n" : ",\n");
+			first = false;
+			out << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":0,\"tid\":" << log->tid
+			    << ",\"args\":{\"name\":";
+			{
+				std::lock_guard<std::mutex> lock(log->name_mutex);
+				write_json_string(out, log->name);
+			}
+			out << "}}";
+			std::vector<Event> events;
+			log->copy(events);
+			for (const Event& event : events) {
+				if (event.begin < capture_begin || event.end > capture_end || event.begin > event.end)
+					continue;
+				out << ",\n{\"ph\":\"X\",\"pid\":0,\"tid\":" << log->tid << ",\"name\":";
+				write_json_string(out, event.name);
+				out << ",\"ts\":" << (event.begin - capture_begin) / 1000.0
+				    << ",\"dur\":" << (event.end - event.begin) / 1000.0 << "}";
+				nevents++;
+			}
+		}
+		out << "\n]}\n";
+		std::cerr << "Profile capture of " << kProfileCaptureFrames << " frames ("
+		          << nevents << " zones) written to " << fn << std::endl;
+	}
+}
+
+uint64_t Profiler::nowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Profiler::record(const char* name, uint64_t begin, uint64_t end)
+{
+	get_thread_log().push({ name, begin, end });
+}
+
+void Profiler::setThreadName(const char* name)
+{
+	ThreadLog& log = get_thread_log();
+	std::lock_guard<std::mutex> lock(log.name_mutex);
+	log.name = name;
+}
+
+void Profiler::beginGpuZone(const char* name)
+{
+	endGpuZone();
+	// Queries cost GL calls, only record what a capture writes out
+	if (capture_frames_left == 0)
+		return;
+	open_zone.name = name;
+	open_zone.begin = take_query();
+	CHECK_GL_ERROR(glQueryCounter(open_zone.begin, GL_TIMESTAMP));
+	zone_open = true;
+}
+
+void Profiler::endGpuZone()
+{
+	if (!zone_open)
+		return;
+	open_zone.end = take_query();
+	CHECK_GL_ERROR(glQueryCounter(open_zone.end, GL_TIMESTAMP));
+	issued_zones.emplace_back(open_zone);
+	zone_open = false;
+	zones_issued++;
+}
+
+void Profiler::endFrame()
+{
+	if (!gpu_log)
+		gpu_log = new_log("GPU");
+	if (!calibrated)
+		calibrate();
+	endGpuZone();
+	resolve_gpu_zones();
+
+	uint64_t now = nowNs();
+	if (frame_begin)
+		record("frame", frame_begin, now);
+	frame_begin = now;
+
+	if (capture_requested) {
+		capture_requested = false;
+		calibrate();
+		capture_begin = now;
+		capture_frames_left = kProfileCaptureFrames;
+	} else if (capture_frames_left > 0 && --capture_frames_left == 0) {
+		capture_end = now;
+		capture_zones = zones_issued;
+		capture_waiting = true;
+	}
+	if (capture_waiting && zones_resolved >= capture_zones) {
+		capture_waiting = false;
+		write_capture();
+	}
+}
+
+void Profiler::capture()
+{
+#ifndef ENABLE_PROFILER
+	std::cerr << "Built without ENABLE_PROFILER, nothing to capture" << std::endl;
+#else
+	if (!isCapturing())
+		capture_requested = true;
+#endif
+}
+
+bool Profiler::isCapturing()
+{
+	return capture_requested || capture_frames_left > 0 || capture_waiting;
+}
@@ -0,0 +1,75 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <cstdint>
+
+/*
+ * Profiler: nested CPU zones and GPU pass timings, captured on demand as
+ * a Chrome trace (open it in chrome://tracing or ui.perfetto.dev).
+ *
+ * PROFILE_ZONE(name) times the rest of the enclosing scope on the calling
+ * thread. Every thread records into a ring buffer of its own without
+ * locking, so zones do not contend and the oldest events are overwritten. Nesting is recovered
+ * from the timestamps, zones need no parent.
+ *
+ * PROFILE_GPU_ZONE(name) starts timing the GL commands issued from now
+ * until the next GPU zone, PROFILE_GPU_END() or the end of the frame;
+ * RenderPass::setup() starts one per pass. Timestamp queries are only
+ * issued while a capture records, and read back frames later, once
+ * available, so timing never stalls the pipeline.
+ *
+ * Configure with -DENABLE_PROFILER=OFF to compile the macros out.
+ */
+class Profiler {
+public:
+	// nowNs: CPU time in ns, the clock of every zone
+	static uint64_t nowNs();
+	// record: a zone of the calling thread
+	static void record(const char* name, uint64_t begin, uint64_t end);
+	// setThreadName: label of the calling thread in captures
+	static void setThreadName(const char* name);
+
+	// GL thread only
+	static void beginGpuZone(const char* name);
+	static void endGpuZone();
+	/*
+	 * endFrame: call once per frame after swapping buffers. Reads the
+	 * finished timestamp queries and writes a requested capture once the
+	 * GPU caught up with it.
+	 */
+	static void endFrame();
+	// capture: write the next kProfileCaptureFrames frames to a file
+	static void capture();
+	static bool isCapturing();
+};
+
+class ProfileZone {
+public:
+	ProfileZone(const char* name) : name_(name), begin_(Profiler::nowNs()) {}
+	~ProfileZone() { Profiler::record(name_, begin_, Profiler::nowNs()); }
+	ProfileZone(const ProfileZone&) = delete;
+	ProfileZone& operator=(const ProfileZone&) = delete;
+private:
+	const char* name_;
+	uint64_t begin_;
+};
+
+#define PROFILE_JOIN2(a, b) a##b
+#define PROFILE_JOIN(a, b) PROFILE_JOIN2(a, b)
+
+#ifdef ENABLE_PROFILER
+// name must be a string that outlives the capture, e.g. a literal
+#define PROFILE_ZONE(name) ProfileZone PROFILE_JOIN(profile_zone_, __LINE__)(name)
+#define PROFILE_FUNCTION() PROFILE_ZONE(__func__)
+#define PROFILE_GPU_ZONE(name) Profiler::beginGpuZone(name)
+#define PROFILE_GPU_END() Profiler::endGpuZone()
+#define PROFILE_FRAME() Profiler::endFrame()
+#else
+#define PROFILE_ZONE(name) do {} while (0)
+#define PROFILE_FUNCTION() do {} while (0)
+#define PROFILE_GPU_ZONE(name) do {} while (0)
+#define PROFILE_GPU_END() do {} while (0)
+#define PROFILE_FRAME() do {} while (0)
+#endif
+
+#endif
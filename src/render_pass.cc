@@ -3,6 +3,13 @@
 #include <iostream>
 #include <debuggl.h>
 #include <map>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sys/stat.h>
+#include "config.h"
+#include "hash.h"
+#include "profiler.h"
 
 /*
  * For students:
@@ -44,22 +51,17 @@ RenderPass::RenderPass(int vao, // -1: create new VAO, otherwise use given VAO
 	   const std::vector<ShaderUniform> uniforms,
 	   const std::vector<const char*> output // Order: 0, 1, 2...
 	  )
-	: vao_(vao), input_(input), uniforms_(uniforms)
+	: vao_(vao), input_(input), uniforms_(uniforms),
+	sources_(shaders), outputs_(output.begin(), output.end())
 {
 	if (vao_ < 0) {
 		CHECK_GL_ERROR(glGenVertexArrays(1, (GLuint*)&vao_));
+		owns_vao_ = true;
 	}
 	CHECK_GL_ERROR(glBindVertexArray(vao_));
 
-	// Program first
-	vs_ = compileShader(shaders[0], GL_VERTEX_SHADER);
-	gs_ = compileShader(shaders[1], GL_GEOMETRY_SHADER);
-	fs_ = compileShader(shaders[2], GL_FRAGMENT_SHADER);
-	CHECK_GL_ERROR(sp_ = glCreateProgram());
-	glAttachShader(sp_, vs_);
-	glAttachShader(sp_, fs_);
-	if (shaders[1])
-		glAttachShader(sp_, gs_);
+	// Program first, finishProgram() waits for it
+	beginProgram();
 
 	// ... and then buffers
 	size_t nbuffer = input.getNBuffers();
@@ -67,35 +69,23 @@ RenderPass::RenderPass(int vao, // -1: create new VAO, otherwise use given VAO
 		nbuffer++;
 	glbuffers_.resize(nbuffer);
 	CHECK_GL_ERROR(glGenBuffers(nbuffer, glbuffers_.data()));
+	streams_.resize(input.getNBuffers());
 	for (int i = 0; i < input.getNBuffers(); i++) {
 		auto meta = input.getBufferMeta(i);
-		CHECK_GL_ERROR(glBindBuffer(GL_ARRAY_BUFFER, glbuffers_[i]));
-		CHECK_GL_ERROR(glBufferData(GL_ARRAY_BUFFER,
-				meta.getElementSize() * meta.nelements,
-				meta.data,
-				GL_STATIC_DRAW));
-		if (meta.isInteger()) {
-			CHECK_GL_ERROR(glVertexAttribIPointer(meta.position,
-						meta.element_length,
-						meta.element_type,
-						0, 0));
+		size_t bytes = meta.getElementSize() * meta.nelements;
+		if (meta.streamed) {
+			streams_[i].reset(new StreamBuffer(GL_ARRAY_BUFFER));
+			setAttribPointer(meta, streams_[i]->update(meta.data, bytes));
 		} else {
-			CHECK_GL_ERROR(glVertexAttribPointer(meta.position,
-						meta.element_length,
-						meta.element_type,
-						GL_FALSE, 0, 0));
+			CHECK_GL_ERROR(glBindBuffer(GL_ARRAY_BUFFER, glbuffers_[i]));
+			CHECK_GL_ERROR(glBufferData(GL_ARRAY_BUFFER,
+					bytes,
+					meta.data,
+					GL_STATIC_DRAW));
+			setAttribPointer(meta, glbuffers_[i]);
 		}
 		CHECK_GL_ERROR(glEnableVertexAttribArray(meta.position));
-		// ... because we need program to bind location
-		CHECK_GL_ERROR(glBindAttribLocation(sp_, meta.position, meta.name.c_str()));
-	}
-	// .. bind output position
-	for (size_t i = 0; i < output.size(); i++) {
-		CHECK_GL_ERROR(glBindFragDataLocation(sp_, i, output[i]));
 	}
-	// ... then we can link
-	glLinkProgram(sp_);
-	CHECK_GL_PROGRAM_ERROR(sp_);
 
 	if (input.hasIndex()) {
 		auto meta = input.getIndexMeta();
@@ -106,15 +96,298 @@ RenderPass::RenderPass(int vao, // -1: create new VAO, otherwise use given VAO
 					meta.getElementSize() * meta.nelements,
 					meta.data, GL_STATIC_DRAW));
 	}
-	// after linking uniform locations can be determined
-	unilocs_.resize(uniforms.size());
-	for (size_t i = 0; i < uniforms.size(); i++) {
-		CHECK_GL_ERROR(unilocs_[i] = glGetUniformLocation(sp_, uniforms[i].name.c_str()));
-	}
 	if (input_.hasMaterial()) {
 		createMaterialTexture();
 		initMaterialUniform();
 	}
+	size_t nslots = uniforms_.size();
+	if (!material_uniforms_.empty())
+		nslots += material_uniforms_.front().size();
+	cached_values_.resize(nslots);
+	cached_valid_.assign(nslots, false);
+}
+
+/*
+ * Load the program from the binary cache, or start compiling and linking
+ * it. Nothing here waits for the driver.
+ */
+void RenderPass::beginProgram()
+{
+	CHECK_GL_ERROR(sp_ = glCreateProgram());
+	from_cache_ = loadProgramBinary();
+	if (from_cache_)
+		return;
+	vs_ = compileShader(sources_[0], GL_VERTEX_SHADER);
+	gs_ = compileShader(sources_[1], GL_GEOMETRY_SHADER);
+	fs_ = compileShader(sources_[2], GL_FRAGMENT_SHADER);
+	glAttachShader(sp_, vs_);
+	glAttachShader(sp_, fs_);
+	if (sources_[1])
+		glAttachShader(sp_, gs_);
+	// Attribute and output locations are part of the linked binary
+	for (int i = 0; i < input_.getNBuffers(); i++) {
+		auto meta = input_.getBufferMeta(i);
+		CHECK_GL_ERROR(glBindAttribLocation(sp_, meta.position, meta.name.c_str()));
+	}
+	for (size_t i = 0; i < outputs_.size(); i++) {
+		CHECK_GL_ERROR(glBindFragDataLocation(sp_, i, outputs_[i].c_str()));
+	}
+	CHECK_GL_ERROR(glProgramParameteri(sp_, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE));
+	glLinkProgram(sp_);
+}
+
+/*
+ * Wait for the program, then look up everything that depends on it.
+ */
+void RenderPass::finishProgram()
+{
+	if (!from_cache_) {
+		CHECK_GL_SHADER_ERROR(vs_);
+		if (gs_)
+			CHECK_GL_SHADER_ERROR(gs_);
+		CHECK_GL_SHADER_ERROR(fs_);
+		CHECK_GL_PROGRAM_ERROR(sp_);
+		saveProgramBinary();
+	}
+	bindProgramResources();
+	ready_ = true;
+}
+
+/*
+ * Block bindings and uniform locations of sp_.
+ */
+void RenderPass::bindProgramResources()
+{
+	// Block bindings are not part of the binary
+	for (const auto& block : block_bindings_) {
+		GLuint index = glGetUniformBlockIndex(sp_, block.first.c_str());
+		if (index != GL_INVALID_INDEX)
+			CHECK_GL_ERROR(glUniformBlockBinding(sp_, index, block.second));
+	}
+	unilocs_.resize(uniforms_.size());
+	for (size_t i = 0; i < uniforms_.size(); i++) {
+		CHECK_GL_ERROR(unilocs_[i] = glGetUniformLocation(sp_, uniforms_[i].name.c_str()));
+	}
+	malocs_.clear();
+	if (!material_uniforms_.empty()) {
+		for (const auto& uni : material_uniforms_.front())
+			CHECK_GL_ERROR(malocs_.emplace_back(glGetUniformLocation(sp_, uni.name.c_str())));
+	}
+	cached_valid_.assign(cached_valid_.size(), false);
+}
+
+namespace {
+	bool shader_compiled(GLuint shader)
+	{
+		GLint status = GL_FALSE;
+		glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+		if (status == GL_TRUE)
+			return true;
+		GLint length = 0;
+		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+		std::string log(std::max(length, 1), 0);
+		glGetShaderInfoLog(shader, length, nullptr, &log[0]);
+		std::cerr << "Shader reload failed:\n" << log.c_str() << std::endl;
+		return false;
+	}
+
+	bool program_linked(GLuint program)
+	{
+		GLint status = GL_FALSE;
+		glGetProgramiv(program, GL_LINK_STATUS, &status);
+		if (status == GL_TRUE)
+			return true;
+		GLint length = 0;
+		glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+		std::string log(std::max(length, 1), 0);
+		glGetProgramInfoLog(program, length, nullptr, &log[0]);
+		std::cerr << "Program reload failed:\n" << log.c_str() << std::endl;
+		return false;
+	}
+
+	// GL_KHR_parallel_shader_compile lets us ask without blocking
+	const GLenum kCompletionStatus = 0x91B1;
+
+	bool parallel_compile_supported()
+	{
+		static int supported = -1;
+		if (supported < 0) {
+			supported = 0;
+			GLint next = 0;
+			glGetIntegerv(GL_NUM_EXTENSIONS, &next);
+			for (GLint i = 0; i < next; i++) {
+				const char* ext = (const char*)glGetStringi(GL_EXTENSIONS, i);
+				if (ext && std::string(ext) == "GL_KHR_parallel_shader_compile")
+					supported = 1;
+			}
+		}
+		return supported == 1;
+	}
+
+	// Material textures carry their own filtering, other passes reuse
+	// unit 0 with textures that have no mip chain.
+	void set_material_filter()
+	{
+		CHECK_GL_ERROR(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT));
+		CHECK_GL_ERROR(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT));
+		CHECK_GL_ERROR(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+		CHECK_GL_ERROR(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR));
+	}
+}
+
+/*
+ * Unlike beginProgram() the shaders are neither shared nor taken from the
+ * binary cache: the caller may reuse the same pointer for new text.
+ */
+void RenderPass::reloadProgram(const std::vector<const char*>& shaders)
+{
+	if (pending_sp_) {
+		// Superseded before it finished
+		glDeleteProgram(pending_sp_);
+		for (unsigned shader : pending_shaders_)
+			glDeleteShader(shader);
+	}
+	static const GLenum types[] = { GL_VERTEX_SHADER, GL_GEOMETRY_SHADER, GL_FRAGMENT_SHADER };
+	CHECK_GL_ERROR(pending_sp_ = glCreateProgram());
+	pending_shaders_.clear();
+	for (size_t i = 0; i < shaders.size() && i < 3; i++) {
+		if (!shaders[i])
+			continue;
+		GLuint shader = 0;
+		CHECK_GL_ERROR(shader = glCreateShader(types[i]));
+		setShaderSource(shader, shaders[i]);
+		glCompileShader(shader);
+		glAttachShader(pending_sp_, shader);
+		pending_shaders_.emplace_back(shader);
+	}
+	for (int i = 0; i < input_.getNBuffers(); i++) {
+		auto meta = input_.getBufferMeta(i);
+		CHECK_GL_ERROR(glBindAttribLocation(pending_sp_, meta.position, meta.name.c_str()));
+	}
+	for (size_t i = 0; i < outputs_.size(); i++) {
+		CHECK_GL_ERROR(glBindFragDataLocation(pending_sp_, i, outputs_[i].c_str()));
+	}
+	glLinkProgram(pending_sp_);
+}
+
+/*
+ * Swap in the reloaded program if it is done. Returns false while the
+ * driver is still working on it.
+ */
+bool RenderPass::finishReload()
+{
+	if (parallel_compile_supported()) {
+		GLint done = GL_FALSE;
+		glGetProgramiv(pending_sp_, kCompletionStatus, &done);
+		if (done != GL_TRUE)
+			return false;
+	}
+	bool ok = true;
+	for (unsigned shader : pending_shaders_)
+		ok = shader_compiled(shader) && ok;
+	ok = ok && program_linked(pending_sp_);
+	for (unsigned shader : pending_shaders_)
+		glDeleteShader(shader);
+	pending_shaders_.clear();
+	if (!ok) {
+		glDeleteProgram(pending_sp_);
+		pending_sp_ = 0;
+		return true;
+	}
+	glDeleteProgram(sp_);
+	sp_ = pending_sp_;
+	pending_sp_ = 0;
+	bindProgramResources();
+	std::cerr << "Reloaded program " << sp_ << std::endl;
+	return true;
+}
+
+/*
+ * Everything that changes the linked program goes into the key: sources,
+ * attribute and output locations, and the driver.
+ */
+uint64_t RenderPass::getProgramKey() const
+{
+	uint64_t key = kHashSeed;
+	for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION }) {
+		const char* str = (const char*)glGetString(name);
+		key = hash_string(str ? str : "", key);
+	}
+	for (const char* header : shader_headers_)
+		key = hash_string(header, key);
+	for (const char* source : sources_)
+		key = hash_string(source ? source : "", key);
+	for (int i = 0; i < input_.getNBuffers(); i++) {
+		auto meta = input_.getBufferMeta(i);
+		key = hash_string(meta.name, key);
+		key = hash_bytes(&meta.position, sizeof(meta.position), key);
+	}
+	for (const auto& output : outputs_)
+		key = hash_string(output, key);
+	return key;
+}
+
+namespace {
+	std::string program_cache_path(uint64_t key)
+	{
+		return std::string(kShaderCacheDir) + "/" + hash_to_hex(key) + ".bin";
+	}
+
+	bool program_binaries_supported()
+	{
+		GLint nformats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &nformats);
+		return nformats > 0;
+	}
+}
+
+bool RenderPass::loadProgramBinary()
+{
+	if (!program_binaries_supported())
+		return false;
+	std::ifstream fin(program_cache_path(getProgramKey()), std::ios::binary);
+	if (!fin.good())
+		return false;
+	GLenum format = 0;
+	if (!fin.read((char*)&format, sizeof(format)))
+		return false;
+	// istreambuf_iterator reads up to the end without setting eofbit
+	std::vector<char> binary((std::istreambuf_iterator<char>(fin)),
+	                         std::istreambuf_iterator<char>());
+	if (fin.bad() || binary.empty())
+		return false;
+	glProgramBinary(sp_, format, binary.data(), binary.size());
+	GLint status = GL_FALSE;
+	glGetProgramiv(sp_, GL_LINK_STATUS, &status);
+	// A driver update may reject old binaries, compile as usual then
+	glGetError();
+	return status == GL_TRUE;
+}
+
+void RenderPass::saveProgramBinary()
+{
+	if (!program_binaries_supported())
+		return;
+	GLint length = 0;
+	CHECK_GL_ERROR(glGetProgramiv(sp_, GL_PROGRAM_BINARY_LENGTH, &length));
+	if (length <= 0)
+		return;
+	std::vector<char> binary(length);
+	GLenum format = 0;
+	CHECK_GL_ERROR(glGetProgramBinary(sp_, length, nullptr, &format, binary.data()));
+
+	mkdir(kShaderCacheDir, 0755);
+	// Write aside and rename, so a crash never leaves half a binary
+	std::string path = program_cache_path(getProgramKey());
+	std::string tmp_path = path + ".tmp";
+	std::ofstream fout(tmp_path, std::ios::binary);
+	fout.write((const char*)&format, sizeof(format));
+	fout.write(binary.data(), binary.size());
+	fout.close();
+	if (!fout.good() || rename(tmp_path.c_str(), path.c_str()) != 0) {
+		std::cerr << "Failed to write program cache " << path << std::endl;
+		remove(tmp_path.c_str());
+	}
 }
 
 void RenderPass::initMaterialUniform()
@@ -125,15 +398,21 @@ void RenderPass::initMaterialUniform()
 	auto vector_binder = [](int loc, const void* data) {
 		glUniform4fv(loc, 1, (const GLfloat*)data);
 	};
-	auto sampler0_binder = [](int loc, const void* data) {
-		CHECK_GL_ERROR(glBindSampler(0, (GLuint)(long)data));
-	};
 	auto texture0_binder = [](int loc, const void* data) {
-		CHECK_GL_ERROR(glUniform1i(loc, 0));
 		CHECK_GL_ERROR(glActiveTexture(GL_TEXTURE0 + 0));
 		CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_2D, (long)data));
 		//std::cerr << " bind texture " << long(data) << std::endl;
 	};
+	auto int_binder = [](int loc, const void* data) {
+		glUniform1iv(loc, 1, (const GLint*)data);
+	};
+	static const int texture_unit = 0;
+	auto texture_unit_data = []() -> const void* {
+		return &texture_unit;
+	};
+	auto int_value_binder = [](int loc, const void* data) {
+		glUniform1i(loc, (GLint)(intptr_t)data);
+	};
 	material_uniforms_.clear();
 	for (size_t i = 0; i < input_.getNMaterials(); i++) {
 		auto& ma = input_.getMaterial(i);
@@ -153,41 +432,38 @@ void RenderPass::initMaterialUniform()
 		auto texture_data = [texid]() -> const void* {
 			return (const void*)(intptr_t)texid;
 		};
-		int sam = sampler2d_;
-		auto sampler_data = [sam]() -> const void* {
-			return (const void*)(intptr_t)sam;
+		ShaderUniform diffuse = { "diffuse", vector_binder, diffuse_data, sizeof(ma.diffuse) };
+		ShaderUniform ambient = { "ambient", vector_binder, ambient_data, sizeof(ma.ambient) };
+		ShaderUniform specular = { "specular", vector_binder, specular_data, sizeof(ma.specular) };
+		ShaderUniform shininess = { "shininess", float_binder , shininess_data, sizeof(ma.shininess) };
+		ShaderUniform unit = { "textureSampler", int_binder, texture_unit_data, sizeof(texture_unit) };
+		// Bindings only, these names are not uniforms
+		ShaderUniform texture = { "GL_TEXTURE_2D", texture0_binder , texture_data, ShaderUniform::kByValue };
+		// gl_PrimitiveID restarts at every draw, see shaders/id.frag
+		intptr_t offset = ma.offset;
+		auto face_offset_data = [offset]() -> const void* {
+			return (const void*)offset;
 		};
-		ShaderUniform diffuse = { "diffuse", vector_binder, diffuse_data };
-		ShaderUniform ambient = { "ambient", vector_binder, ambient_data };
-		ShaderUniform specular = { "specular", vector_binder, specular_data };
-		ShaderUniform shininess = { "shininess", float_binder , shininess_data };
-		ShaderUniform texture = { "GL_TEXTURE_2D", texture0_binder , texture_data };
-		ShaderUniform sampler = { "textureSampler", sampler0_binder , sampler_data };
+		ShaderUniform face_offset = { "face_offset", int_value_binder, face_offset_data, ShaderUniform::kByValue };
 		std::vector<ShaderUniform> munis = {diffuse, ambient, specular,
-				shininess, texture, sampler};
+				shininess, unit, texture, face_offset};
 		material_uniforms_.emplace_back(munis);
 	}
-	malocs_.clear();
-	CHECK_GL_ERROR(malocs_.emplace_back(glGetUniformLocation(sp_, "diffuse")));
-	CHECK_GL_ERROR(malocs_.emplace_back(glGetUniformLocation(sp_, "ambient")));
-	CHECK_GL_ERROR(malocs_.emplace_back(glGetUniformLocation(sp_, "specular")));
-	CHECK_GL_ERROR(malocs_.emplace_back(glGetUniformLocation(sp_, "shininess")));
-	CHECK_GL_ERROR(malocs_.emplace_back(glGetUniformLocation(sp_, "textureSampler")));
-	CHECK_GL_ERROR(malocs_.emplace_back(glGetUniformLocation(sp_, "textureSampler")));
-	std::cerr << "textureSampler location: " << malocs_.back() << std::endl;
 }
 
 /*
- * Create textures to gltextures_
+ * Create textures to texture_cache_
  * and assign material specified textures to matexids_
  * 
- * Different materials may share textures
+ * Different materials, and different passes over the same model, share
+ * textures
  */
 void RenderPass::createMaterialTexture()
 {
 	CHECK_GL_ERROR(glActiveTexture(GL_TEXTURE0 + 0));
 	matexids_.clear();
-	std::map<Image*, unsigned> tex2id;
+	texture_bytes_.clear();
+	texture_keys_.clear();
 	for (size_t i = 0; i < input_.getNMaterials(); i++) {
 		auto& ma = input_.getMaterial(i);
 #if 0
@@ -195,56 +471,142 @@ void RenderPass::createMaterialTexture()
 #endif
 		if (!ma.texture) {
 			matexids_.emplace_back(0);
+			texture_bytes_.emplace_back(0);
+			texture_keys_.emplace_back();
 			continue;
 		}
-		// Do not create multiple texture for the same data.
-		auto iter = tex2id.find(ma.texture.get());
-		if (iter != tex2id.end()) {
-			matexids_.emplace_back(iter->second);
-			continue;
+		// Do not create multiple texture for the same data, not even
+		// across passes or reloads of the model.
+		std::string key = textureKey(*ma.texture);
+		auto iter = texture_cache_.find(key);
+		if (iter == texture_cache_.end()) {
+			TextureInfo info;
+			info.id = uploadTexture(*ma.texture, info.bytes);
+			iter = texture_cache_.emplace(key, info).first;
+			texture_memory_ += info.bytes;
 		}
+		iter->second.users++;
+		texture_keys_.emplace_back(key);
+		matexids_.emplace_back(iter->second.id);
+		texture_bytes_.emplace_back(iter->second.bytes);
+		std::cerr << __func__ << " material " << i << " uses texture " << iter->second.id
+		          << " (" << iter->second.bytes / 1024 << " KiB)" << std::endl;
+	}
+	std::cerr << __func__ << " texture memory: " << texture_memory_ / 1024 << " KiB" << std::endl;
+}
 
-		// Now create and upload texture data
-		int w = ma.texture->width;
-		int h = ma.texture->height;
-		// TODO: enable stride
-		// Translate RGB to RGBA for alignment
-		std::vector<unsigned int> dummy(w*h);
-		const unsigned char* bytes = ma.texture->bytes.data();
-		for (int row = 0; row < h; row++) {
-			for (int col = 0; col < w; col++) {
-				unsigned r = bytes[row*w*3 + col*3];
-				unsigned g = bytes[row*w*3 + col*3 + 1];
-				unsigned b = bytes[row*w*3 + col*3 + 1];
-				dummy[row*w+col] = r | (g << 8) | (b << 16) | (0xFF << 24);
-			}
-		}
-		GLuint tex = 0;
-		CHECK_GL_ERROR(glGenTextures(1, &tex));
-		CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_2D, tex));
-		CHECK_GL_ERROR(glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8,
-					w,
-					h));
-		CHECK_GL_ERROR(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h,
-					GL_RGBA, GL_UNSIGNED_BYTE,
-					dummy.data()));
-		//CHECK_GL_ERROR(glPixelStorei(GL_UNPACK_ROW_LENGTH, 0));
-		std::cerr << __func__ << " load data into texture " << tex <<
-			" dim: " << w << " x " << h << std::endl;
-		CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_2D, 0));
-		matexids_.emplace_back(tex);
-		tex2id[ma.texture.get()] = tex;
-	}
-	CHECK_GL_ERROR(glGenSamplers(1, &sampler2d_));
-	CHECK_GL_ERROR(glSamplerParameteri(sampler2d_, GL_TEXTURE_WRAP_S, GL_REPEAT));
-	CHECK_GL_ERROR(glSamplerParameteri(sampler2d_, GL_TEXTURE_WRAP_T, GL_REPEAT));
-	CHECK_GL_ERROR(glSamplerParameteri(sampler2d_, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
-	CHECK_GL_ERROR(glSamplerParameteri(sampler2d_, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
+// Drops this pass's references, textures no material uses any more go
+void RenderPass::releaseMaterialTextures()
+{
+	for (const std::string& key : texture_keys_) {
+		if (key.empty())
+			continue;
+		auto iter = texture_cache_.find(key);
+		if (iter == texture_cache_.end() || --iter->second.users > 0)
+			continue;
+		CHECK_GL_ERROR(glDeleteTextures(1, &iter->second.id));
+		texture_memory_ -= iter->second.bytes;
+		texture_cache_.erase(iter);
+	}
+	texture_keys_.clear();
 }
 
+/*
+ * The file an image was loaded from, or a hash of its contents for images
+ * made in memory. Unlike the address, either survives the Image.
+ */
+std::string RenderPass::textureKey(const Image& image)
+{
+	if (!image.source.empty())
+		return image.source;
+	uint64_t hash = hash_bytes(&image.width, sizeof(image.width));
+	hash = hash_bytes(&image.height, sizeof(image.height), hash);
+	hash = hash_bytes(image.bytes.data(), image.bytes.size(), hash);
+	for (const auto& level : image.compressed)
+		hash = hash_bytes(level.data(), level.size(), hash);
+	return "#" + hash_to_hex(hash);
+}
+
+/*
+ * Image rows are tightly packed RGB, so the data goes to GL as is with an
+ * unpack alignment of 1 instead of being expanded to RGBA first. The
+ * driver fills in alpha and builds the mip chain.
+ */
+unsigned RenderPass::uploadTexture(const Image& image, size_t& bytes)
+{
+	int w = image.width;
+	int h = image.height;
+	if (!image.compressed.empty())
+		return uploadCompressedTexture(image, bytes);
+	int levels = 1;
+	while ((std::max(w, h) >> levels) > 0)
+		levels++;
+	GLuint tex = 0;
+	CHECK_GL_ERROR(glGenTextures(1, &tex));
+	CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_2D, tex));
+	CHECK_GL_ERROR(glTexStorage2D(GL_TEXTURE_2D, levels, GL_RGBA8, w, h));
+	CHECK_GL_ERROR(glPixelStorei(GL_UNPACK_ALIGNMENT, 1));
+	CHECK_GL_ERROR(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h,
+				GL_RGB, GL_UNSIGNED_BYTE,
+				image.bytes.data()));
+	CHECK_GL_ERROR(glPixelStorei(GL_UNPACK_ALIGNMENT, 4));
+	CHECK_GL_ERROR(glGenerateMipmap(GL_TEXTURE_2D));
+	set_material_filter();
+	CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_2D, 0));
+	bytes = 0;
+	for (int level = 0; level < levels; level++)
+		bytes += size_t(std::max(w >> level, 1)) * std::max(h >> level, 1) * 4;
+	std::cerr << __func__ << " load data into texture " << tex <<
+		" dim: " << w << " x " << h << ", " << levels << " levels" << std::endl;
+	return tex;
+}
+
+/*
+ * BC1 blocks from TextureCache, mip chain included.
+ */
+unsigned RenderPass::uploadCompressedTexture(const Image& image, size_t& bytes)
+{
+	int w = image.width;
+	int h = image.height;
+	int levels = int(image.compressed.size());
+	GLuint tex = 0;
+	CHECK_GL_ERROR(glGenTextures(1, &tex));
+	CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_2D, tex));
+	CHECK_GL_ERROR(glTexStorage2D(GL_TEXTURE_2D, levels, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, w, h));
+	bytes = 0;
+	for (int level = 0; level < levels; level++) {
+		const auto& blocks = image.compressed[level];
+		CHECK_GL_ERROR(glCompressedTexSubImage2D(GL_TEXTURE_2D, level, 0, 0,
+					std::max(w >> level, 1), std::max(h >> level, 1),
+					GL_COMPRESSED_RGB_S3TC_DXT1_EXT,
+					blocks.size(), blocks.data()));
+		bytes += blocks.size();
+	}
+	set_material_filter();
+	CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_2D, 0));
+	std::cerr << __func__ << " load BC1 data into texture " << tex <<
+		" dim: " << w << " x " << h << ", " << levels << " levels" << std::endl;
+	return tex;
+}
+
+/*
+ * Shaders stay in shader_cache_, other passes may share them.
+ */
 RenderPass::~RenderPass()
 {
-	// TODO: Free resources
+	releaseMaterialTextures();
+	if (pending_sp_) {
+		glDeleteProgram(pending_sp_);
+		for (unsigned shader : pending_shaders_)
+			glDeleteShader(shader);
+	}
+	glDeleteProgram(sp_);
+	if (!glbuffers_.empty())
+		glDeleteBuffers(GLsizei(glbuffers_.size()), glbuffers_.data());
+	if (owns_vao_) {
+		GLuint vao = GLuint(vao_);
+		glDeleteVertexArrays(1, &vao);
+	}
 }
 
 void RenderPass::updateVBO(int position, const void* data, size_t size)
@@ -260,23 +622,94 @@ void RenderPass::updateVBO(int position, const void* data, size_t size)
 	if (bufferid < 0)
 		throw __func__+std::string(": error, can't find buffer with position ")+std::to_string(position);
 	auto meta = input_.getBufferMeta(bufferid);
+	if (streams_[bufferid]) {
+		// The data moved to another segment, repoint the attribute
+		unsigned buffer = streams_[bufferid]->update(data, size * meta.getElementSize());
+		CHECK_GL_ERROR(glBindVertexArray(vao_));
+		setAttribPointer(meta, buffer);
+		return;
+	}
 	CHECK_GL_ERROR(glBindBuffer(GL_ARRAY_BUFFER, glbuffers_[bufferid]));
 	CHECK_GL_ERROR(glBufferData(GL_ARRAY_BUFFER,
 				size * meta.getElementSize(),
 				data, GL_STATIC_DRAW));
 }
 
+// Expects the VAO to be bound
+void RenderPass::setAttribPointer(const RenderInputMeta& meta, unsigned buffer)
+{
+	CHECK_GL_ERROR(glBindBuffer(GL_ARRAY_BUFFER, buffer));
+	if (meta.isInteger()) {
+		CHECK_GL_ERROR(glVertexAttribIPointer(meta.position,
+					meta.element_length,
+					meta.element_type,
+					0, 0));
+	} else {
+		CHECK_GL_ERROR(glVertexAttribPointer(meta.position,
+					meta.element_length,
+					meta.element_type,
+					GL_FALSE, 0, 0));
+	}
+}
+
+void RenderPass::setUniformBlockBinding(const std::string& name, unsigned binding)
+{
+	block_bindings_[name] = binding;
+}
+
+void RenderPass::addShaderHeader(const char* glsl)
+{
+	shader_headers_.emplace_back(glsl);
+}
+
+/*
+ * The source goes in as several strings: its #version line, the headers,
+ * then a #line directive so compile errors still count lines of source.
+ */
+void RenderPass::setShaderSource(unsigned shader, const char* source)
+{
+	const char* body = source;
+	int line = 1;
+	const char* version = source + std::strspn(source, " \t\r\n");
+	if (std::strncmp(version, "#version", 8) == 0) {
+		const char* eol = std::strchr(version, '\n');
+		body = eol ? eol + 1 : version + std::strlen(version);
+		line = 2 + std::count(source, version, '\n');
+	}
+	std::string line_directive = "\n#line " + std::to_string(line) + "\n";
+	std::vector<const char*> strings;
+	std::vector<GLint> lengths;
+	strings.emplace_back(source);
+	lengths.emplace_back(GLint(body - source));
+	for (const char* header : shader_headers_) {
+		strings.emplace_back(header);
+		lengths.emplace_back(-1);
+	}
+	strings.emplace_back(line_directive.c_str());
+	lengths.emplace_back(-1);
+	strings.emplace_back(body);
+	lengths.emplace_back(-1);
+	CHECK_GL_ERROR(glShaderSource(shader, strings.size(), strings.data(), lengths.data()));
+}
+
 void RenderPass::setup()
 {
+	PROFILE_ZONE(name_);
+	PROFILE_GPU_ZONE(name_);
 	// Switch to our object VAO.
 	CHECK_GL_ERROR(glBindVertexArray(vao_));
+	if (!ready_)
+		finishProgram();
+	if (pending_sp_)
+		finishReload();
 	// Use our program.
 	CHECK_GL_ERROR(glUseProgram(sp_));
 
-	bindUniforms(uniforms_, unilocs_);
+	invalidateBindings();
+	bindUniforms(uniforms_, unilocs_, 0);
 }
 
-bool RenderPass::renderWithMaterial(int mid)
+bool RenderPass::renderWithMaterial(int mid, int ninstances)
 {
 	if (mid >= int(material_uniforms_.size()) || mid < 0)
 		return false;
@@ -285,26 +718,88 @@ bool RenderPass::renderWithMaterial(int mid)
 	if (!mat.texture)
 		return true;
 #endif
+	PROFILE_ZONE("renderWithMaterial");
 	auto& matuni = material_uniforms_[mid];
-	bindUniforms(matuni, malocs_);
-	CHECK_GL_ERROR(glDrawElements(GL_TRIANGLES, mat.nfaces * 3,
-	                              GL_UNSIGNED_INT,
-	                              (const void*)(mat.offset * 3 * 4)) // Offset is in bytes
-	              );
+	bindUniforms(matuni, malocs_, uniforms_.size());
+	if (ninstances == 1) {
+		CHECK_GL_ERROR(glDrawElements(GL_TRIANGLES, mat.nfaces * 3,
+		                              GL_UNSIGNED_INT,
+		                              (const void*)(mat.offset * 3 * 4)) // Offset is in bytes
+		              );
+	} else {
+		CHECK_GL_ERROR(glDrawElementsInstanced(GL_TRIANGLES, mat.nfaces * 3,
+		                                       GL_UNSIGNED_INT,
+		                                       (const void*)(mat.offset * 3 * 4),
+		                                       ninstances));
+	}
+	draw_stats_.draws++;
+	draw_stats_.triangles += mat.nfaces * ninstances;
 	return true;
 }
 
+void RenderPass::drawElements(unsigned mode, size_t nindices)
+{
+	CHECK_GL_ERROR(glDrawElements(mode, nindices, GL_UNSIGNED_INT, 0));
+	draw_stats_.draws++;
+	if (mode == GL_TRIANGLES)
+		draw_stats_.triangles += nindices / 3;
+}
+
+/*
+ * Uniform values are program state and stay valid across setup() calls.
+ * Sized uniforms the program does not use (location -1) are never bound.
+ */
 void RenderPass::bindUniforms(std::vector<ShaderUniform>& uniforms,
-		const std::vector<unsigned>& unilocs)
+		const std::vector<int>& unilocs,
+		size_t first_slot)
 {
+	PROFILE_ZONE("bindUniforms");
 	for (size_t i = 0; i < uniforms.size(); i++) {
 		const auto& uni = uniforms[i];
 		// std::cerr << "binding " << uni.name << " to " << unilocs[i] << std::endl;
 		auto ptr = uni.data_source();
+		size_t slot = first_slot + i;
+		if (uni.size != 0) {
+			const char* bytes = (const char*)ptr;
+			size_t nbytes = uni.size;
+			if (uni.size == ShaderUniform::kByValue) {
+				bytes = (const char*)&ptr;
+				nbytes = sizeof(ptr);
+			} else if (unilocs[i] < 0) {
+				uniform_stats_.skipped++;
+				continue;
+			}
+			auto& cached = cached_values_[slot];
+			if (cached_valid_[slot] && cached.size() == nbytes &&
+			    std::memcmp(cached.data(), bytes, nbytes) == 0) {
+				uniform_stats_.skipped++;
+				continue;
+			}
+			cached.assign(bytes, bytes + nbytes);
+			cached_valid_[slot] = true;
+		}
 		CHECK_GL_ERROR(uni.binder(unilocs[i], ptr));
+		uniform_stats_.issued++;
 	}
 }
 
+/*
+ * Texture and sampler bindings may have been changed by anyone since the
+ * last draw of this pass.
+ */
+void RenderPass::invalidateBindings()
+{
+	for (size_t i = 0; i < uniforms_.size(); i++)
+		if (uniforms_[i].size == ShaderUniform::kByValue)
+			cached_valid_[i] = false;
+	if (material_uniforms_.empty())
+		return;
+	const auto& munis = material_uniforms_.front();
+	for (size_t i = 0; i < munis.size(); i++)
+		if (munis[i].size == ShaderUniform::kByValue)
+			cached_valid_[uniforms_.size() + i] = false;
+}
+
 unsigned RenderPass::compileShader(const char* source_ptr, int type)
 {
 	if (!source_ptr)
@@ -318,9 +813,9 @@ unsigned RenderPass::compileShader(const char* source_ptr, int type)
 #if 0
 	std::cerr << __func__ << " shader id " << ret << " type " << type << "\tsource:\n" << source_ptr << std::endl;
 #endif
-	CHECK_GL_ERROR(glShaderSource(ret, 1, &source_ptr, nullptr));
+	setShaderSource(ret, source_ptr);
+	// The status is checked by finishProgram(), after linking
 	glCompileShader(ret);
-	CHECK_GL_SHADER_ERROR(ret);
 	shader_cache_[source_ptr] = ret;
 	return ret;
 }
@@ -335,6 +830,17 @@ void RenderDataInput::assign(int position,
 	meta_.emplace_back(position, name, data, nelements, element_length, element_type);
 }
 
+void RenderDataInput::assignStream(int position,
+                                   const std::string& name,
+                                   const void *data,
+                                   size_t nelements,
+                                   size_t element_length,
+                                   int element_type)
+{
+	meta_.emplace_back(position, name, data, nelements, element_length, element_type);
+	meta_.back().streamed = true;
+}
+
 void RenderDataInput::assignIndex(const void *data, size_t nelements, size_t element_length)
 {
 	has_index_ = true;
@@ -362,3 +868,10 @@ size_t RenderInputMeta::getElementSize() const
 }
 
 std::map<const char*, unsigned> RenderPass::shader_cache_;
+std::map<std::string, unsigned> RenderPass::block_bindings_;
+std::vector<const char*> RenderPass::shader_headers_;
+std::map<std::string, RenderPass::TextureInfo> RenderPass::texture_cache_;
+size_t RenderPass::texture_memory_ = 0;
+UniformStats RenderPass::uniform_stats_;
+DrawStats RenderPass::draw_stats_;
+constexpr size_t ShaderUniform::kByValue;
@@ -17,7 +17,9 @@
 #include <string>
 #include <map>
 #include <functional>
+#include <memory>
 #include <material.h>
+#include "stream_buffer.h"
 
 /*
  * ShaderUniform: description of a uniform in a shader program.
@@ -43,6 +45,33 @@ struct ShaderUniform {
 	 *       the lambda function
 	 */
 	std::function<const void*()> data_source;
+	/*
+	 * size: bytes behind the data pointer, lets RenderPass skip the binder
+	 * when the value did not change since the last bind in this program.
+	 *      0: unknown, always bind
+	 *      kByValue: the pointer itself is the value (texture or sampler
+	 *                names). These bind global state, so they are only
+	 *                cached between one setup() and the next.
+	 */
+	size_t size = 0;
+	static constexpr size_t kByValue = size_t(-1);
+};
+
+/*
+ * UniformStats: binder calls made and skipped by all RenderPasses.
+ */
+struct UniformStats {
+	size_t issued = 0;
+	size_t skipped = 0;
+};
+
+/*
+ * DrawStats: draw calls of all RenderPasses, triangles counted once per
+ * instance.
+ */
+struct DrawStats {
+	size_t draws = 0;
+	size_t triangles = 0;
 };
 
 /*
@@ -55,6 +84,7 @@ struct RenderInputMeta {
 	size_t nelements = 0;
 	size_t element_length = 0;
 	int element_type = 0;
+	bool streamed = false;  // see RenderDataInput::assignStream
 
 	size_t getElementSize() const; // simple check: return 12 (3 * 4 bytes) for float3 
 	RenderInputMeta();
@@ -88,6 +118,17 @@ public:
 	            size_t nelements,
 	            size_t element_length,
 	            int element_type);
+	/*
+	 * assignStream: like assign, for attributes rewritten every frame
+	 * through RenderPass::updateVBO, e.g. CPU skinned vertices. They live
+	 * in a StreamBuffer instead of a static buffer.
+	 */
+	void assignStream(int position,
+	                  const std::string& name,
+	                  const void *data,
+	                  size_t nelements,
+	                  size_t element_length,
+	                  int element_type);
 	/*
 	 * assign_index: assign the index buffer for vertices
 	 * This will bind the data to GL_ELEMENT_ARRAY_BUFFER
@@ -126,6 +167,10 @@ public:
 	 *      output: the FS output variable name.
 	 * RenderPass does not support render-to-texture or multi-target
 	 * rendering for now (and you also don't need it).
+	 *
+	 * The program is compiled and linked (or loaded from the binary cache
+	 * in kShaderCacheDir) without waiting for the driver; the first
+	 * setup() collects the result.
 	 */
 	RenderPass(int vao, // -1: create new VAO, otherwise use given VAO
 	           const RenderDataInput& input,
@@ -134,6 +179,8 @@ public:
 	           const std::vector<const char*> output // Order: 0, 1, 2...
 		  );
 	~RenderPass();
+	RenderPass(const RenderPass&) = delete;
+	RenderPass& operator=(const RenderPass&) = delete;
 
 	unsigned getVAO() const { return unsigned(vao_); }
 	void updateVBO(int position, const void* data, size_t nelement);
@@ -149,28 +196,118 @@ public:
 	/*
 	 * renderWithMaterial: render a part of vertex buffer, after binding
 	 * corresponding uniforms for Phong shading.
+	 *      ninstances: draw this many instances with one call, see Scene
+	 */
+	bool renderWithMaterial(int i, int ninstances = 1); // return false if material id is invalid
+	/*
+	 * drawElements: draw the first nindices of the index buffer, e.g.
+	 * GL_LINES or GL_TRIANGLES, after setup().
+	 */
+	void drawElements(unsigned mode, size_t nindices);
+
+	/*
+	 * setUniformBlockBinding: programs linked from now on read the uniform
+	 * block called name, if they declare it, from the binding point.
+	 */
+	static void setUniformBlockBinding(const std::string& name, unsigned binding);
+	/*
+	 * addShaderHeader: GLSL inserted after the #version line of every
+	 * shader compiled from now on, e.g. shared uniform block declarations.
+	 * glsl must outlive all passes.
 	 */
-	bool renderWithMaterial(int i); // return false if material id is invalid
+	static void addShaderHeader(const char* glsl);
+
+	/*
+	 * reloadProgram: start building a program from new sources, which are
+	 * only read during the call. A later setup() swaps it in once it
+	 * links; if it does not, the log is printed and the current program
+	 * stays.
+	 */
+	void reloadProgram(const std::vector<const char*>& shaders);
+	// getSources: the shaders the pass was constructed from, reloads aside
+	const std::vector<const char*>& getSources() const { return sources_; }
+
+	/*
+	 * getTextureBytes: GPU memory of material i's texture with all mip
+	 * levels. Textures are shared between materials and passes, so the
+	 * sum over materials can exceed getTextureMemory(). The last pass
+	 * using a texture frees it.
+	 */
+	size_t getTextureBytes(int i) const { return texture_bytes_[i]; }
+	static size_t getTextureMemory() { return texture_memory_; }
+
+	// setName: label of the pass in profiles, name must outlive the pass
+	void setName(const char* name) { name_ = name; }
+	const char* getName() const { return name_; }
+
+	static const UniformStats& getUniformStats() { return uniform_stats_; }
+	static void resetUniformStats() { uniform_stats_ = UniformStats(); }
+	static const DrawStats& getDrawStats() { return draw_stats_; }
+	static void resetDrawStats() { draw_stats_ = DrawStats(); }
 private:
 	void initMaterialUniform();
 	void createMaterialTexture();
+	void releaseMaterialTextures();
+	void setAttribPointer(const RenderInputMeta& meta, unsigned buffer);
+	void beginProgram();
+	void finishProgram();
+	void bindProgramResources();
+	bool finishReload();
+	uint64_t getProgramKey() const;
+	bool loadProgramBinary();
+	void saveProgramBinary();
 
 	int vao_;
+	bool owns_vao_ = false;
 	RenderDataInput input_;
 	std::vector<ShaderUniform> uniforms_;
 	std::vector<std::vector<ShaderUniform>> material_uniforms_;
 
-	std::vector<unsigned> glbuffers_, unilocs_, malocs_;
+	std::vector<unsigned> glbuffers_;
+	std::vector<std::unique_ptr<StreamBuffer>> streams_; // per buffer, null unless streamed
+	std::vector<int> unilocs_, malocs_;
 	std::vector<unsigned> gltextures_, matexids_;
-	unsigned sampler2d_;
 	unsigned vs_ = 0, gs_ = 0, fs_ = 0;
 	unsigned sp_ = 0;
+	std::vector<const char*> sources_;  // VS, GS, FS
+	std::vector<std::string> outputs_;
+	bool ready_ = false;                // finishProgram() done
+	bool from_cache_ = false;
+	const char* name_ = "RenderPass";
+	unsigned pending_sp_ = 0;           // reloadProgram() still linking
+	std::vector<unsigned> pending_shaders_;
 	
 	static unsigned compileShader(const char*, int type);
+	static void setShaderSource(unsigned shader, const char* source);
+	static unsigned uploadTexture(const Image& image, size_t& bytes);
+	static unsigned uploadCompressedTexture(const Image& image, size_t& bytes);
+	static std::string textureKey(const Image& image);
 	static std::map<const char*, unsigned> shader_cache_;
+	static std::map<std::string, unsigned> block_bindings_;
+	static std::vector<const char*> shader_headers_;
+	struct TextureInfo {
+		unsigned id = 0;
+		size_t bytes = 0;
+		int users = 0;          // materials of all passes
+	};
+	static std::map<std::string, TextureInfo> texture_cache_;  // by textureKey()
+	static size_t texture_memory_;
+	std::vector<size_t> texture_bytes_; // per material
+	std::vector<std::string> texture_keys_; // per material, empty without texture
+
+	/*
+	 * Last values bound by this program, indexed by slot: uniforms_ come
+	 * first, then the material uniforms.
+	 */
+	std::vector<std::vector<char>> cached_values_;
+	std::vector<bool> cached_valid_;
+	static UniformStats uniform_stats_;
+	static DrawStats draw_stats_;
 
-	static void bindUniforms(std::vector<ShaderUniform>& uniforms,
-	                         const std::vector<unsigned>& unilocs);
+	void bindUniforms(std::vector<ShaderUniform>& uniforms,
+	                  const std::vector<int>& unilocs,
+	                  size_t first_slot);
+	void invalidateBindings();
 };
 
 #endif
@@ -0,0 +1,166 @@
+#include <GL/glew.h>
+#include <debuggl.h>
+#include "scene.h"
+#include "config.h"
+#include "profiler.h"
+#include <job_system.h>
+#include <cmath>
+#include <iostream>
+#include <algorithm>
+#include <glm/gtx/transform.hpp>
+
+Scene::Scene(Mesh& mesh)
+	: mesh_(mesh), palette_stream_(GL_TEXTURE_BUFFER)
+{
+}
+
+Scene::~Scene()
+{
+	if (palette_texture_)
+		glDeleteTextures(1, &palette_texture_);
+}
+
+int Scene::addClip(const std::vector<KeyFrame>& clip)
+{
+	clips.emplace_back(clip);
+	return int(clips.size()) - 1;
+}
+
+int Scene::addInstance(const Instance& instance)
+{
+	instances.emplace_back(instance);
+	palette_dirty_ = true;
+	return int(instances.size()) - 1;
+}
+
+void Scene::populateGrid(int n, float spacing)
+{
+	int side = int(std::ceil(std::sqrt(float(n))));
+	float half = 0.5f * (side - 1) * spacing;
+	for (int i = 0; i < n; i++) {
+		int row = i / side;
+		int col = i % side;
+		// Rows start behind the edited character, which stays at the origin
+		glm::vec3 offset(col * spacing - half, 0.0f, -(row + 1) * spacing);
+		addInstance(Instance(-1, 0.37f * i, glm::translate(offset)));
+	}
+	std::cout << "scene populated with " << n << " instances" << std::endl;
+}
+
+void Scene::update(float t)
+{
+	PROFILE_ZONE("Scene::update");
+	time_ = t;
+	if (baked_) {
+		// Poses come from the baked texture, only the instance list matters
+		if (palette_dirty_)
+			packBakedPalette();
+		return;
+	}
+	int nbones = mesh_.getNumberOfBones();
+	int stride = getPaletteStride();
+	int morph_texels = getMorphTexels();
+	palette_.resize(instances.size() * stride);
+
+	KeyFrame rest;
+	rest.rel_rot.resize(nbones);
+
+	parallel_for(0, int(instances.size()), 4, [&](int i) {
+		Instance& inst = instances[i];
+		std::vector<KeyFrame>& clip = inst.clip < 0 ? mesh_.key_frames : clips[inst.clip];
+		KeyFrame frame;
+		if (!KeyFrame::sample_looped(clip, t + inst.time_offset,
+		                             mesh_.spline_interpolation_enabled, frame))
+			frame = rest;
+		mesh_.skeleton.evaluate(frame, inst.q);
+		inst.bounds = mesh_.computeSkinnedBounds(inst.q).transformed(inst.transform);
+
+		glm::vec4* block = &palette_[i * stride];
+		for (int c = 0; c < 4; c++)
+			block[c] = inst.transform[c];
+		for (int b = 0; b < nbones; b++) {
+			const glm::fquat& r = inst.q.rot[b];
+			block[4 + 2 * b] = glm::vec4(r.x, r.y, r.z, r.w);
+			block[4 + 2 * b + 1] = glm::vec4(inst.q.trans[b], 1.0f);
+		}
+		std::vector<float> weights;
+		mesh_.poseMorphs(frame, weights);
+		glm::vec4* morph_block = block + 4 + 2 * nbones;
+		std::fill(morph_block, morph_block + morph_texels, glm::vec4(0.0f));
+		for (size_t m = 0; m < weights.size(); m++)
+			morph_block[m / 4][m % 4] = weights[m];
+	});
+	upload_pending_ = true;
+}
+
+void Scene::cull(const Frustum& frustum)
+{
+	std::vector<int> visible;
+	visible.reserve(instances.size());
+	for (size_t i = 0; i < instances.size(); i++) {
+		if (frustum.intersects(instances[i].bounds))
+			visible.push_back(i);
+	}
+	if (visible == visible_ && !upload_pending_)
+		return;
+	visible_.swap(visible);
+
+	int stride = getPaletteStride();
+	upload_.resize(visible_.size() * stride);
+	for (size_t i = 0; i < visible_.size(); i++)
+		std::copy(palette_.begin() + visible_[i] * stride,
+		          palette_.begin() + (visible_[i] + 1) * stride,
+		          upload_.begin() + i * stride);
+	uploadPalette();
+	upload_pending_ = false;
+}
+
+void Scene::bake(float rate)
+{
+	PROFILE_ZONE("Scene::bake");
+	baked_animation_.clear();
+	baked_animation_.addClip(mesh_, mesh_.key_frames,
+	                         mesh_.spline_interpolation_enabled, rate);
+	for (auto& clip : clips)
+		baked_animation_.addClip(mesh_, clip,
+		                         mesh_.spline_interpolation_enabled, rate);
+	baked_animation_.upload();
+	baked_ = true;
+	packBakedPalette();
+}
+
+void Scene::unbake()
+{
+	baked_ = false;
+	palette_dirty_ = true;
+	update(time_);
+}
+
+void Scene::packBakedPalette()
+{
+	int stride = getPaletteStride();
+	palette_.resize(instances.size() * stride);
+	for (size_t i = 0; i < instances.size(); i++) {
+		Instance& inst = instances[i];
+		// Range 0 is Mesh::key_frames, clip k was baked into range k + 1
+		const auto& range = baked_animation_.getClipRange(inst.clip + 1);
+		glm::vec4* block = &palette_[i * stride];
+		for (int c = 0; c < 4; c++)
+			block[c] = inst.transform[c];
+		block[4] = glm::vec4(inst.time_offset, range.first_row, range.nrows, 0.0f);
+		inst.bounds = range.bounds.transformed(inst.transform);
+	}
+	upload_pending_ = true;
+	palette_dirty_ = false;
+}
+
+void Scene::uploadPalette()
+{
+	if (!palette_texture_)
+		CHECK_GL_ERROR(glGenTextures(1, &palette_texture_));
+	unsigned buffer = palette_stream_.update(upload_.data(),
+	                                         upload_.size() * sizeof(glm::vec4));
+	CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_BUFFER, palette_texture_));
+	CHECK_GL_ERROR(glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, buffer));
+	CHECK_GL_ERROR(glBindTexture(GL_TEXTURE_BUFFER, 0));
+}
@@ -0,0 +1,107 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "bone_geometry.h"
+#include "baked_animation.h"
+#include "frustum.h"
+#include "stream_buffer.h"
+
+/*
+ * Instance: one character of a crowd, sharing the Mesh it was created from.
+ */
+struct Instance {
+	Instance(int clip_id = -1,
+	         float offset = 0.0f,
+	         const glm::mat4& xform = glm::mat4(1.0f))
+		: clip(clip_id), time_offset(offset), transform(xform)
+	{
+	}
+
+	int clip;               // index into Scene::clips, -1 plays Mesh::key_frames
+	float time_offset;      // added to the scene time before sampling the clip
+	glm::mat4 transform;    // model matrix of this instance
+	Configuration q;        // pose evaluated by the last Scene::update
+	BoundingBox bounds;     // world space bounds of that pose
+};
+
+/*
+ * Scene: N instances of one loaded model.
+ *
+ * All poses are packed into a single buffer texture (the "palette") so the
+ * crowd can be drawn by one instanced draw per material. Each instance owns
+ * getPaletteStride() RGBA32F texels:
+ *      [0, 4):  columns of the instance model matrix
+ *      then 2 texels per bone: rotation quaternion (xyzw), translation (xyz1)
+ *      then getMorphTexels() texels of morph weights, four per texel
+ * shaders/instanced.vert locates its block through gl_InstanceID.
+ *
+ * In baked mode the bones are replaced by a single texel
+ * (time offset, first row, number of rows, 0) pointing into the
+ * BakedAnimation texture, and shaders/baked.vert poses the instance and
+ * weighs its morphs by itself. The palette then only changes when instances are added.
+ *
+ * Only the blocks of instances that pass cull() are uploaded, so
+ * gl_InstanceID counts visible instances.
+ */
+class Scene {
+public:
+	Scene(Mesh& mesh);
+	~Scene();
+
+	int addClip(const std::vector<KeyFrame>& clip);
+	int addInstance(const Instance& instance);
+	/*
+	 * populateGrid: place n instances on a square grid on the floor behind
+	 * the origin, with staggered time offsets so they don't move in lockstep.
+	 */
+	void populateGrid(int n, float spacing);
+
+	/*
+	 * update: evaluate every instance at scene time t (in key frames).
+	 * FK runs in parallel across instances.
+	 */
+	void update(float t);
+	/*
+	 * cull: pick the instances whose bounds intersect the frustum and
+	 * upload their palette blocks. Call once per frame before drawing.
+	 */
+	void cull(const Frustum& frustum);
+
+	/*
+	 * bake: sample all clips at rate samples per key frame and switch to
+	 * GPU playback. unbake goes back to CPU FK, e.g. after editing.
+	 */
+	void bake(float rate);
+	void unbake();
+	bool isBaked() const { return baked_; }
+	const BakedAnimation& getBakedAnimation() const { return baked_animation_; }
+	const float* getTimePointer() const { return &time_; }
+
+	int getNumberOfInstances() const { return int(instances.size()); }
+	int getNumberOfVisibleInstances() const { return int(visible_.size()); }
+	int getPaletteStride() const { return baked_ ? 5 : 4 + 2 * mesh_.getNumberOfBones() + getMorphTexels(); }
+	int getMorphTexels() const { return (int(mesh_.morphs.size()) + 3) / 4; }
+	unsigned getPaletteTexture() const { return palette_texture_; }
+
+	std::vector<Instance> instances;
+	std::vector<std::vector<KeyFrame>> clips;
+private:
+	void uploadPalette();
+	void packBakedPalette();
+
+	Mesh& mesh_;
+	BakedAnimation baked_animation_;
+	bool baked_ = false;
+	bool palette_dirty_ = true;
+	float time_ = 0.0f;
+	std::vector<glm::vec4> palette_;    // all instances
+	std::vector<glm::vec4> upload_;     // visible instances
+	std::vector<int> visible_;
+	bool upload_pending_ = true;
+	StreamBuffer palette_stream_;      // rewritten whenever the upload changes
+	unsigned palette_texture_ = 0;
+};
+
+#endif
@@ -0,0 +1,197 @@
+#include "shader_reloader.h"
+#include "render_pass.h"
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	const char* kRawBegin = "R\"zzz(";
+	const char* kRawEnd = ")zzz\"";
+	const int kWatchIntervalMs = 100;
+}
+
+ShaderReloader::ShaderReloader(const std::string& directory)
+	: directory_(directory), stop_(false)
+{
+	worker_ = std::thread(&ShaderReloader::watch, this);
+	std::cerr << "Watching shaders in " << directory_ << std::endl;
+}
+
+ShaderReloader::~ShaderReloader()
+{
+	stop_ = true;
+	if (worker_.joinable())
+		worker_.join();
+}
+
+void ShaderReloader::track(const char* embedded, const std::string& file)
+{
+	files_[embedded] = file;
+}
+
+void ShaderReloader::addPass(RenderPass* pass)
+{
+	passes_.push_back({pass, pass->getSources()});
+}
+
+void ShaderReloader::loadFiles()
+{
+	std::set<std::string> files;
+	for (const auto& tracked : files_)
+		files.insert(tracked.second);
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (const std::string& file : files) {
+			std::string source;
+			if (readSource(file, source))
+				changed_.emplace_back(file, std::move(source));
+		}
+	}
+	poll();
+}
+
+void ShaderReloader::poll()
+{
+	std::vector<std::pair<std::string, std::string>> changed;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		changed.swap(changed_);
+	}
+	if (changed.empty())
+		return;
+	std::set<std::string> files;
+	for (auto& change : changed) {
+		if (isCurrent(change.first, change.second))
+			continue;
+		// reloadProgram() copies the sources, so one string per file will do
+		latest_[change.first] = std::move(change.second);
+		files.insert(change.first);
+		std::cerr << "Shader changed: " << change.first << std::endl;
+	}
+	if (files.empty())
+		return;
+	for (const auto& watched : passes_) {
+		bool affected = false;
+		std::vector<const char*> shaders;
+		for (const char* embedded : watched.embedded) {
+			const char* source = embedded;
+			auto file = embedded ? files_.find(embedded) : files_.end();
+			if (file != files_.end()) {
+				affected = affected || files.count(file->second) > 0;
+				auto latest = latest_.find(file->second);
+				if (latest != latest_.end())
+					source = latest->second.c_str();
+			}
+			shaders.emplace_back(source);
+		}
+		if (affected)
+			watched.pass->reloadProgram(shaders);
+	}
+}
+
+/*
+ * Whether the passes already run this source for file: the last one read,
+ * or the compiled-in one before any. Untracked files count as current.
+ */
+bool ShaderReloader::isCurrent(const std::string& file, const std::string& source) const
+{
+	auto latest = latest_.find(file);
+	if (latest != latest_.end())
+		return latest->second == source;
+	for (const auto& tracked : files_)
+		if (tracked.second == file)
+			return source == tracked.first;
+	return true;
+}
+
+/*
+ * The file without the raw string wrapper, or as is if it has none.
+ */
+bool ShaderReloader::readSource(const std::string& file, std::string& source) const
+{
+	std::ifstream fin(directory_ + "/" + file);
+	if (!fin.good())
+		return false;
+	std::stringstream ss;
+	ss << fin.rdbuf();
+	source = ss.str();
+	size_t begin = source.find(kRawBegin);
+	size_t end = source.rfind(kRawEnd);
+	if (begin != std::string::npos && end != std::string::npos && end > begin) {
+		begin += std::char_traits<char>::length(kRawBegin);
+		source = source.substr(begin, end - begin);
+	}
+	return !source.empty();
+}
+
+#ifdef __linux__
+void ShaderReloader::watch()
+{
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0 || inotify_add_watch(fd, directory_.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		std::cerr << "Cannot watch " << directory_ << ", shader reloading disabled" << std::endl;
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	alignas(struct inotify_event) char buffer[4096];
+	while (!stop_) {
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		if (::poll(&pfd, 1, kWatchIntervalMs) <= 0)
+			continue;
+		ssize_t len;
+		while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+			for (char* ptr = buffer; ptr < buffer + len; ) {
+				const struct inotify_event* event = (const struct inotify_event*)ptr;
+				ptr += sizeof(struct inotify_event) + event->len;
+				std::string source;
+				if (event->len == 0 || !readSource(event->name, source))
+					continue;
+				std::lock_guard<std::mutex> lock(mutex_);
+				changed_.emplace_back(event->name, std::move(source));
+			}
+		}
+	}
+	close(fd);
+}
+#else
+/*
+ * No inotify: compare modification times instead.
+ */
+void ShaderReloader::watch()
+{
+	std::map<std::string, time_t> mtimes;
+	while (!stop_) {
+		DIR* dir = opendir(directory_.c_str());
+		if (dir) {
+			while (struct dirent* entry = readdir(dir)) {
+				std::string file = entry->d_name;
+				struct stat st;
+				if (stat((directory_ + "/" + file).c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+					continue;
+				auto iter = mtimes.find(file);
+				bool added = iter == mtimes.end();
+				// Files seen first are reported too, poll() drops unchanged ones
+				bool modified = added || iter->second != st.st_mtime;
+				mtimes[file] = st.st_mtime;
+				std::string source;
+				if (modified && readSource(file, source)) {
+					std::lock_guard<std::mutex> lock(mutex_);
+					changed_.emplace_back(file, std::move(source));
+				}
+			}
+			closedir(dir);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(kWatchIntervalMs));
+	}
+}
+#endif
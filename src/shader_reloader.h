@@ -0,0 +1,59 @@
+#ifndef SHADER_RELOADER_H
+#define SHADER_RELOADER_H
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class RenderPass;
+
+/*
+ * ShaderReloader: development mode that rebuilds programs when a file in
+ * the shader directory (normally src/shaders) changes.
+ *
+ * A worker thread waits for changes (inotify on Linux, polling mtimes
+ * elsewhere), reads the file and strips the R"zzz( )zzz" wrapper, so the
+ * files stay includable from main.cc. GL calls must stay on the context
+ * thread: poll() hands the new sources to RenderPass::reloadProgram, and
+ * the pass keeps its old program if the new one does not link. Files
+ * edited while the program was not running are picked up by loadFiles().
+ */
+class ShaderReloader {
+public:
+	ShaderReloader(const std::string& directory);
+	~ShaderReloader();
+
+	// track: embedded is the string main.cc compiled in from file.
+	void track(const char* embedded, const std::string& file);
+	// addPass: the pass' current sources decide which files it depends on.
+	void addPass(RenderPass* pass);
+	// loadFiles: read every tracked file once, after track() and addPass(),
+	// and rebuild the passes whose files differ from what was compiled in.
+	void loadFiles();
+	// poll: call once per frame from the GL thread.
+	void poll();
+private:
+	struct Watched {
+		RenderPass* pass;
+		std::vector<const char*> embedded;  // VS, GS, FS as constructed
+	};
+
+	void watch();
+	bool readSource(const std::string& file, std::string& source) const;
+	bool isCurrent(const std::string& file, const std::string& source) const;
+
+	std::string directory_;
+	std::map<const char*, std::string> files_;  // embedded source -> file
+	std::vector<Watched> passes_;
+	std::map<std::string, std::string> latest_; // file -> last good read
+
+	std::mutex mutex_;
+	std::vector<std::pair<std::string, std::string>> changed_; // file, source
+	std::atomic<bool> stop_;
+	std::thread worker_;
+};
+
+#endif
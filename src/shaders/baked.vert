@@ -0,0 +1,85 @@
+R"zzz(
+#version 330 core
+
+// Scene palette in baked mode, see scene.h for the layout
+uniform samplerBuffer instance_palette;
+uniform int palette_stride;
+// Clips sampled by BakedAnimation, see baked_animation.h for the layout
+uniform sampler2D baked_animation;
+uniform float baked_rate;
+uniform float scene_time;
+// Offsets as in blending.vert, weights in the last columns of the clips
+uniform samplerBuffer morph_offsets;
+uniform int morph_count;
+
+in ivec4 jid;
+in vec4 weight;         // unused joints weigh 0
+in vec3 vector_from_joint0;
+in vec3 vector_from_joint1;
+in vec3 vector_from_joint2;
+in vec3 vector_from_joint3;
+in vec4 normal;
+in vec2 uv;
+in vec4 vert;
+in ivec2 morph_range;
+
+out vec4 vs_light_direction;
+out vec4 vs_normal;
+out vec2 vs_uv;
+out vec4 vs_camera_direction;
+
+vec3 qtransform(vec4 q, vec3 v) {
+	return v + 2.0 * cross(cross(v, q.xyz) - q.w*v, q.xyz);
+}
+
+vec3 skin(int jid, vec3 offset, int row0, int row1, float tau) {
+	vec4 q0 = texelFetch(baked_animation, ivec2(2 * jid, row0), 0);
+	vec4 q1 = texelFetch(baked_animation, ivec2(2 * jid, row1), 0);
+	if (dot(q0, q1) < 0.0)
+		q1 = -q1;
+	vec4 q = normalize(mix(q0, q1, tau));
+	vec3 t0 = texelFetch(baked_animation, ivec2(2 * jid + 1, row0), 0).xyz;
+	vec3 t1 = texelFetch(baked_animation, ivec2(2 * jid + 1, row1), 0).xyz;
+	return qtransform(q, offset) + mix(t0, t1, tau);
+}
+
+vec3 morph_offset(int row0, int row1, float tau) {
+	int first_weight = textureSize(baked_animation, 0).x - (morph_count + 3) / 4;
+	vec3 offset = vec3(0.0);
+	for (int i = 0; i < morph_range.y; i++) {
+		vec4 texel = texelFetch(morph_offsets, morph_range.x + i);
+		int morph = int(texel.w);
+		ivec2 column = ivec2(first_weight + morph / 4, 0);
+		float w0 = texelFetch(baked_animation, column + ivec2(0, row0), 0)[morph % 4];
+		float w1 = texelFetch(baked_animation, column + ivec2(0, row1), 0)[morph % 4];
+		offset += mix(w0, w1, tau) * texel.xyz;
+	}
+	return offset;
+}
+
+void main() {
+	int base = gl_InstanceID * palette_stride;
+	mat4 instance_model = mat4(texelFetch(instance_palette, base),
+	                           texelFetch(instance_palette, base + 1),
+	                           texelFetch(instance_palette, base + 2),
+	                           texelFetch(instance_palette, base + 3));
+	// x: time offset, y: first row, z: number of rows
+	vec4 clip = texelFetch(instance_palette, base + 4);
+	float f = mod((scene_time + clip.x) * baked_rate, clip.z - 1.0);
+	int row0 = int(clip.y) + int(f);
+	int row1 = min(row0 + 1, int(clip.y + clip.z) - 1);
+	float tau = fract(f);
+
+	vec3 offset = morph_offset(row0, row1, tau);
+	vec3 position = weight.x * skin(jid.x, vector_from_joint0 + offset, row0, row1, tau) +
+	                weight.y * skin(jid.y, vector_from_joint1 + offset, row0, row1, tau) +
+	                weight.z * skin(jid.z, vector_from_joint2 + offset, row0, row1, tau) +
+	                weight.w * skin(jid.w, vector_from_joint3 + offset, row0, row1, tau);
+	gl_Position = instance_model * vec4(position, 1.0);
+
+	vs_normal = instance_model * normal;
+	vs_light_direction = light_position - gl_Position;
+	vs_camera_direction = vec4(camera_position, 1.0) - gl_Position;
+	vs_uv = uv;
+}
+)zzz"
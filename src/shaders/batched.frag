@@ -0,0 +1,41 @@
+R"zzz(
+#version 330 core
+in vec4 face_normal;
+in vec4 vertex_normal;
+in vec4 light_direction;
+in vec4 camera_direction;
+in vec2 uv_coords;
+flat in int material_index;
+// Materials sorted by first face, see draw_list.h
+struct MaterialEntry {
+	vec4 diffuse;
+	vec4 ambient;
+	vec4 specular;
+	float shininess;
+	int first_face;
+};
+layout(std140) uniform MaterialTable {
+	MaterialEntry materials[256];
+};
+uniform float alpha;
+uniform sampler2D textureSampler;
+out vec4 fragment_color;
+
+void main() {
+	vec4 diffuse = materials[material_index].diffuse;
+	vec4 ambient = materials[material_index].ambient;
+	vec4 specular = materials[material_index].specular;
+	float shininess = materials[material_index].shininess;
+	vec3 texcolor = texture(textureSampler, uv_coords).xyz;
+	if (length(texcolor) == 0.0) {
+		vec3 color = vec3(diffuse);
+		float dot_nl = dot(normalize(light_direction), normalize(vertex_normal));
+		dot_nl = clamp(dot_nl, 0.0, 1.0);
+		vec4 spec = specular * pow(max(0.0, dot(reflect(-light_direction, vertex_normal), camera_direction)), shininess);
+		color = clamp(dot_nl * color + vec3(ambient) + vec3(spec), 0.0, 1.0);
+		fragment_color = vec4(color, alpha);
+	} else {
+		fragment_color = vec4(texcolor.rgb, alpha);
+	}
+}
+)zzz"
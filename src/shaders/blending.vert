@@ -1,19 +1,22 @@
 R"zzz(
 #version 330 core
-uniform vec4 light_position;
-uniform vec3 camera_position;
 
 uniform vec3 joint_trans[128];
 uniform vec4 joint_rot[128];
+// See morph_targets.h
+uniform samplerBuffer morph_offsets;
+uniform samplerBuffer morph_weights;
 
-in int jid0;
-in int jid1;
-in float w0;
+in ivec4 jid;
+in vec4 weight;         // unused joints weigh 0
 in vec3 vector_from_joint0;
 in vec3 vector_from_joint1;
+in vec3 vector_from_joint2;
+in vec3 vector_from_joint3;
 in vec4 normal;
 in vec2 uv;
 in vec4 vert;
+in ivec2 morph_range;
 
 out vec4 vs_light_direction;
 out vec4 vs_normal;
@@ -24,11 +27,24 @@ vec3 qtransform(vec4 q, vec3 v) {
 	return v + 2.0 * cross(cross(v, q.xyz) - q.w*v, q.xyz);
 }
 
+vec3 morph_offset() {
+	vec3 offset = vec3(0.0);
+	for (int i = 0; i < morph_range.y; i++) {
+		vec4 texel = texelFetch(morph_offsets, morph_range.x + i);
+		offset += texelFetch(morph_weights, int(texel.w)).r * texel.xyz;
+	}
+	return offset;
+}
+
 void main() {
 	// FIXME: Implement linear skinning here
-	vec3 position0 = qtransform(joint_rot[jid0], vector_from_joint0) + joint_trans[jid0];
-	vec3 position1 = qtransform(joint_rot[jid1], vector_from_joint1) + joint_trans[jid1];
-	gl_Position = vec4(w0 * position0 + (1.0 - w0) * position1, 1.0);
+	// Morphs move the rest position, before skinning
+	vec3 offset = morph_offset();
+	vec3 position = weight.x * (qtransform(joint_rot[jid.x], vector_from_joint0 + offset) + joint_trans[jid.x]) +
+	                weight.y * (qtransform(joint_rot[jid.y], vector_from_joint1 + offset) + joint_trans[jid.y]) +
+	                weight.z * (qtransform(joint_rot[jid.z], vector_from_joint2 + offset) + joint_trans[jid.z]) +
+	                weight.w * (qtransform(joint_rot[jid.w], vector_from_joint3 + offset) + joint_trans[jid.w]);
+	gl_Position = vec4(position, 1.0);
 
 	vs_normal = normal;
 	vs_light_direction = light_position - gl_Position;
@@ -1,8 +1,5 @@
 R"zzz(#version 330 core
 const int kMaxBones = 128;
-uniform mat4 projection;
-uniform mat4 model;
-uniform mat4 view;
 in int jid;
 uniform vec3 joint_trans[128];
 
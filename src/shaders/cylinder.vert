@@ -3,9 +3,6 @@ uniform mat4 bone_transform; // transform the cylinder to the correct configurat
 const float kPi = 3.1415926535897932384626433832795;
 //const float radius = 0.1;	// radius of cylinder
 uniform float cylinder_radius;
-uniform mat4 projection;
-uniform mat4 model;
-uniform mat4 view;
 in vec4 vertex_position;
 
 // FIXME: Implement your vertex shader for cylinders
@@ -1,7 +1,5 @@
 R"zzz(
 #version 330 core
-uniform vec4 light_position;
-uniform vec3 camera_position;
 in vec4 vertex_position;
 in vec4 normal;
 in vec2 uv;
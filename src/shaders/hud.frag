@@ -0,0 +1,11 @@
+R"zzz(#version 330 core
+in vec2 tex_coord;
+uniform sampler2D font;
+out vec4 fragment_color;
+void main()
+{
+	// White text on a translucent backdrop covering every character cell
+	float ink = texture(font, tex_coord).r;
+	fragment_color = vec4(vec3(ink), mix(0.6, 1.0, ink));
+}
+)zzz"
@@ -0,0 +1,9 @@
+R"zzz(#version 330 core
+in vec4 vertex_position;	// xy: clip space, zw: font texture coordinates
+out vec2 tex_coord;
+void main()
+{
+	tex_coord = vertex_position.zw;
+	gl_Position = vec4(vertex_position.xy, 0.0, 1.0);
+}
+)zzz"
@@ -0,0 +1,9 @@
+R"zzz(#version 330 core
+uniform uint id_base;           // IdPicker kind in the top two bits
+uniform int id_per_primitive;   // 1: add gl_PrimitiveID, e.g. one id per bone line
+uniform int face_offset;        // first face of the current material
+out uint fragment_id;
+void main() {
+	fragment_id = id_base + uint(face_offset + id_per_primitive * gl_PrimitiveID);
+}
+)zzz"
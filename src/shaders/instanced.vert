@@ -0,0 +1,65 @@
+R"zzz(
+#version 330 core
+
+// Scene palette, see scene.h for the layout
+uniform samplerBuffer instance_palette;
+uniform int palette_stride;
+// Offsets as in blending.vert, weights per instance in the palette
+uniform samplerBuffer morph_offsets;
+uniform int morph_count;
+
+in ivec4 jid;
+in vec4 weight;         // unused joints weigh 0
+in vec3 vector_from_joint0;
+in vec3 vector_from_joint1;
+in vec3 vector_from_joint2;
+in vec3 vector_from_joint3;
+in vec4 normal;
+in vec2 uv;
+in vec4 vert;
+in ivec2 morph_range;
+
+out vec4 vs_light_direction;
+out vec4 vs_normal;
+out vec2 vs_uv;
+out vec4 vs_camera_direction;
+
+vec3 qtransform(vec4 q, vec3 v) {
+	return v + 2.0 * cross(cross(v, q.xyz) - q.w*v, q.xyz);
+}
+
+vec3 morph_offset(int base) {
+	int first_weight = base + palette_stride - (morph_count + 3) / 4;
+	vec3 offset = vec3(0.0);
+	for (int i = 0; i < morph_range.y; i++) {
+		vec4 texel = texelFetch(morph_offsets, morph_range.x + i);
+		int morph = int(texel.w);
+		offset += texelFetch(instance_palette, first_weight + morph / 4)[morph % 4] * texel.xyz;
+	}
+	return offset;
+}
+
+vec3 skin(int base, int jid, vec3 offset) {
+	int b = base + 4 + 2 * jid;
+	return qtransform(texelFetch(instance_palette, b), offset) + texelFetch(instance_palette, b + 1).xyz;
+}
+
+void main() {
+	int base = gl_InstanceID * palette_stride;
+	mat4 instance_model = mat4(texelFetch(instance_palette, base),
+	                           texelFetch(instance_palette, base + 1),
+	                           texelFetch(instance_palette, base + 2),
+	                           texelFetch(instance_palette, base + 3));
+	vec3 offset = morph_offset(base);
+	vec3 position = weight.x * skin(base, jid.x, vector_from_joint0 + offset) +
+	                weight.y * skin(base, jid.y, vector_from_joint1 + offset) +
+	                weight.z * skin(base, jid.z, vector_from_joint2 + offset) +
+	                weight.w * skin(base, jid.w, vector_from_joint3 + offset);
+	gl_Position = instance_model * vec4(position, 1.0);
+
+	vs_normal = instance_model * normal;
+	vs_light_direction = light_position - gl_Position;
+	vs_camera_direction = vec4(camera_position, 1.0) - gl_Position;
+	vs_uv = uv;
+}
+)zzz"
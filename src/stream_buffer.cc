@@ -0,0 +1,61 @@
+#include <GL/glew.h>
+#include <debuggl.h>
+#include "stream_buffer.h"
+#include <cstring>
+#include <iostream>
+
+constexpr int StreamBuffer::kSegments;
+
+StreamBuffer::StreamBuffer(unsigned target)
+	: target_(target)
+{
+}
+
+StreamBuffer::~StreamBuffer()
+{
+	for (int i = 0; i < kSegments; i++)
+		if (fences_[i])
+			glDeleteSync((GLsync)fences_[i]);
+	if (current_ >= 0)
+		glDeleteBuffers(kSegments, buffers_);
+}
+
+unsigned StreamBuffer::update(const void* data, size_t bytes)
+{
+	if (current_ < 0)
+		CHECK_GL_ERROR(glGenBuffers(kSegments, buffers_));
+	else
+		CHECK_GL_ERROR(fences_[current_] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+	current_ = (current_ + 1) % kSegments;
+
+	if (fences_[current_]) {
+		GLsync fence = (GLsync)fences_[current_];
+		GLenum status = glClientWaitSync(fence, 0, 0);
+		if (status == GL_TIMEOUT_EXPIRED) {
+			stalls_++;
+			while (status == GL_TIMEOUT_EXPIRED)
+				status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+		}
+		glDeleteSync(fence);
+		fences_[current_] = nullptr;
+	}
+
+	CHECK_GL_ERROR(glBindBuffer(target_, buffers_[current_]));
+	if (bytes > capacity_[current_]) {
+		CHECK_GL_ERROR(glBufferData(target_, bytes, nullptr, GL_STREAM_DRAW));
+		capacity_[current_] = bytes;
+	}
+	if (bytes > 0) {
+		void* ptr = nullptr;
+		CHECK_GL_ERROR(ptr = glMapBufferRange(target_, 0, bytes,
+		                                      GL_MAP_WRITE_BIT |
+		                                      GL_MAP_INVALIDATE_RANGE_BIT |
+		                                      GL_MAP_UNSYNCHRONIZED_BIT));
+		if (ptr) {
+			std::memcpy(ptr, data, bytes);
+			CHECK_GL_ERROR(glUnmapBuffer(target_));
+		}
+	}
+	CHECK_GL_ERROR(glBindBuffer(target_, 0));
+	return buffers_[current_];
+}
@@ -0,0 +1,43 @@
+#ifndef STREAM_BUFFER_H
+#define STREAM_BUFFER_H
+
+#include <cstddef>
+
+/*
+ * StreamBuffer: GL buffer for data rewritten every frame.
+ *
+ * Writes rotate through kSegments buffer objects. Moving on from a segment
+ * fences it, so by the time the ring comes back the GPU has usually
+ * finished reading it, and the segment is mapped unsynchronized with its
+ * old contents invalidated: no implicit stall, no reallocation unless the
+ * data outgrows the segment.
+ *
+ * The segments are separate buffers rather than ranges of one because
+ * buffer textures can only take a whole buffer before GL 4.3. Users must
+ * rebind getBuffer() after every update().
+ */
+class StreamBuffer {
+public:
+	static constexpr int kSegments = 3;
+
+	StreamBuffer(unsigned target);
+	~StreamBuffer();
+
+	/*
+	 * update: copy bytes into the next segment.
+	 * Return: the buffer that now holds them, same as getBuffer().
+	 */
+	unsigned update(const void* data, size_t bytes);
+	unsigned getBuffer() const { return current_ < 0 ? 0 : buffers_[current_]; }
+	// getStalls: updates that had to wait for the GPU
+	size_t getStalls() const { return stalls_; }
+private:
+	unsigned target_;
+	unsigned buffers_[kSegments] = {};
+	size_t capacity_[kSegments] = {};
+	void* fences_[kSegments] = {};  // GLsync
+	int current_ = -1;
+	size_t stalls_ = 0;
+};
+
+#endif
@@ -0,0 +1,264 @@
+#include <GL/glew.h>
+#include "texture_cache.h"
+#include "hash.h"
+#include <image.h>
+#include <job_system.h>
+#include <mmdadapter.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace {
+	const char kMagic[4] = { 'T', 'X', 'C', '1' };
+
+	template<typename T>
+	void write_pod(std::ofstream& fout, const T& value)
+	{
+		fout.write((const char*)&value, sizeof(T));
+	}
+
+	template<typename T>
+	bool read_pod(std::ifstream& fin, T& value)
+	{
+		return bool(fin.read((char*)&value, sizeof(T)));
+	}
+
+	uint16_t pack565(const int c[3])
+	{
+		return uint16_t(((c[0] * 31 + 127) / 255) << 11 |
+		                ((c[1] * 63 + 127) / 255) << 5 |
+		                ((c[2] * 31 + 127) / 255));
+	}
+
+	void unpack565(uint16_t v, int c[3])
+	{
+		int r = v >> 11, g = (v >> 5) & 63, b = v & 31;
+		c[0] = (r << 3) | (r >> 2);
+		c[1] = (g << 2) | (g >> 4);
+		c[2] = (b << 3) | (b >> 2);
+	}
+
+	/*
+	 * One 4x4 block: endpoints on the diagonal of the color bounding box,
+	 * flipped per channel to follow its correlation with green, and
+	 * pulled in by 1/16 of the range.
+	 */
+	void compress_block(const unsigned char px[16][3], unsigned char* out)
+	{
+		int lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 };
+		int mean[3] = { 0, 0, 0 };
+		for (int i = 0; i < 16; i++)
+			for (int c = 0; c < 3; c++) {
+				lo[c] = std::min(lo[c], int(px[i][c]));
+				hi[c] = std::max(hi[c], int(px[i][c]));
+				mean[c] += px[i][c];
+			}
+		int cov[3] = { 0, 0, 0 };
+		for (int i = 0; i < 16; i++)
+			for (int c = 0; c < 3; c++)
+				cov[c] += (px[i][c] * 16 - mean[c]) * (px[i][1] * 16 - mean[1]);
+		int e0[3], e1[3];
+		for (int c = 0; c < 3; c++) {
+			int inset = (hi[c] - lo[c]) / 16;
+			e0[c] = hi[c] - inset;
+			e1[c] = lo[c] + inset;
+			if (cov[c] < 0)
+				std::swap(e0[c], e1[c]);
+		}
+		uint16_t c0 = pack565(e0), c1 = pack565(e1);
+		if (c0 < c1)
+			std::swap(c0, c1);
+		uint32_t indices = 0;
+		if (c0 != c1) {
+			// c0 > c1 selects the four color mode
+			int palette[4][3];
+			unpack565(c0, palette[0]);
+			unpack565(c1, palette[1]);
+			for (int c = 0; c < 3; c++) {
+				palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+				palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+			}
+			for (int i = 0; i < 16; i++) {
+				int best = 0, best_distance = 1 << 30;
+				for (int p = 0; p < 4; p++) {
+					int distance = 0;
+					for (int c = 0; c < 3; c++) {
+						int d = int(px[i][c]) - palette[p][c];
+						distance += d * d;
+					}
+					if (distance < best_distance) {
+						best_distance = distance;
+						best = p;
+					}
+				}
+				indices |= uint32_t(best) << (2 * i);
+			}
+		}
+		out[0] = c0 & 0xFF;
+		out[1] = c0 >> 8;
+		out[2] = c1 & 0xFF;
+		out[3] = c1 >> 8;
+		for (int i = 0; i < 4; i++)
+			out[4 + i] = (indices >> (8 * i)) & 0xFF;
+	}
+
+	std::vector<unsigned char> compress_level(const unsigned char* rgb, int w, int h)
+	{
+		int bw = (w + 3) / 4, bh = (h + 3) / 4;
+		std::vector<unsigned char> blocks(size_t(bw) * bh * 8);
+		parallel_for(0, bh, 4, [&](int by) {
+			unsigned char px[16][3];
+			for (int bx = 0; bx < bw; bx++) {
+				// Edge blocks repeat the last row and column
+				for (int i = 0; i < 16; i++) {
+					int x = std::min(bx * 4 + i % 4, w - 1);
+					int y = std::min(by * 4 + i / 4, h - 1);
+					memcpy(px[i], rgb + (size_t(y) * w + x) * 3, 3);
+				}
+				compress_block(px, &blocks[(size_t(by) * bw + bx) * 8]);
+			}
+		});
+		return blocks;
+	}
+
+	// Box filter down to the next mip level
+	std::vector<unsigned char> downsample(const std::vector<unsigned char>& rgb, int w, int h)
+	{
+		int nw = std::max(w / 2, 1), nh = std::max(h / 2, 1);
+		std::vector<unsigned char> ret(size_t(nw) * nh * 3);
+		for (int y = 0; y < nh; y++) {
+			int y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+			for (int x = 0; x < nw; x++) {
+				int x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+				for (int c = 0; c < 3; c++) {
+					int sum = rgb[(size_t(y0) * w + x0) * 3 + c] +
+					          rgb[(size_t(y0) * w + x1) * 3 + c] +
+					          rgb[(size_t(y1) * w + x0) * 3 + c] +
+					          rgb[(size_t(y1) * w + x1) * 3 + c];
+					ret[(size_t(y) * nw + x) * 3 + c] = (sum + 2) / 4;
+				}
+			}
+		}
+		return ret;
+	}
+}
+
+TextureCache::TextureCache(const std::string& path)
+	: path_(path)
+{
+	std::ifstream fin(path_, std::ios::binary);
+	char magic[4];
+	uint32_t count = 0;
+	if (!fin.good() || !fin.read(magic, 4) || memcmp(magic, kMagic, 4) != 0 ||
+	    !read_pod(fin, count))
+		return;
+	for (uint32_t i = 0; i < count; i++) {
+		uint64_t key;
+		Entry entry;
+		uint32_t nlevels = 0;
+		if (!read_pod(fin, key) || !read_pod(fin, entry.width) ||
+		    !read_pod(fin, entry.height) || !read_pod(fin, nlevels))
+			break;
+		entry.levels.resize(nlevels);
+		bool ok = true;
+		for (auto& level : entry.levels) {
+			uint32_t bytes = 0;
+			ok = read_pod(fin, bytes);
+			level.resize(bytes);
+			ok = ok && fin.read((char*)level.data(), bytes);
+			if (!ok)
+				break;
+		}
+		if (!ok)
+			break;
+		entries_[key] = std::move(entry);
+	}
+	std::cerr << "Loaded " << entries_.size() << " compressed textures from " << path_ << std::endl;
+}
+
+bool TextureCache::load(const std::string& fn, Image& image)
+{
+	uint64_t key;
+	if (!hash_file(fn, key))
+		return false;
+	std::unique_lock<std::mutex> lock(mutex_);
+	used_.insert(key);
+	auto iter = entries_.find(key);
+	if (iter == entries_.end()) {
+		// Decode and compress without holding up the other loaders
+		lock.unlock();
+		if (!readImage(fn, image))
+			return false;
+		compress(image);
+		image.bytes.clear();
+		image.bytes.shrink_to_fit();
+		Entry entry;
+		entry.width = image.width;
+		entry.height = image.height;
+		entry.levels = image.compressed;
+		lock.lock();
+		entries_[key] = std::move(entry);
+		dirty_ = true;
+		return true;
+	}
+	image.width = iter->second.width;
+	image.height = iter->second.height;
+	image.stride = 0;
+	image.bytes.clear();
+	image.compressed = iter->second.levels;
+	return true;
+}
+
+void TextureCache::save()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (!dirty_ && used_.size() == entries_.size())
+		return;
+	std::string tmp = path_ + ".tmp";
+	{
+		std::ofstream fout(tmp, std::ios::binary);
+		if (!fout.good()) {
+			std::cerr << "Cannot write texture cache " << path_ << std::endl;
+			return;
+		}
+		fout.write(kMagic, 4);
+		write_pod(fout, uint32_t(used_.size()));
+		for (uint64_t key : used_) {
+			const Entry& entry = entries_[key];
+			write_pod(fout, key);
+			write_pod(fout, entry.width);
+			write_pod(fout, entry.height);
+			write_pod(fout, uint32_t(entry.levels.size()));
+			for (const auto& level : entry.levels) {
+				write_pod(fout, uint32_t(level.size()));
+				fout.write((const char*)level.data(), level.size());
+			}
+		}
+	}
+	if (std::rename(tmp.c_str(), path_.c_str()) != 0)
+		std::cerr << "Cannot write texture cache " << path_ << std::endl;
+	dirty_ = false;
+}
+
+void TextureCache::compress(Image& image)
+{
+	int w = image.width, h = image.height;
+	image.compressed.clear();
+	std::vector<unsigned char> rgb(image.bytes.begin(),
+	                               image.bytes.begin() + size_t(w) * h * 3);
+	while (true) {
+		image.compressed.emplace_back(compress_level(rgb.data(), w, h));
+		if (w == 1 && h == 1)
+			break;
+		rgb = downsample(rgb, w, h);
+		w = std::max(w / 2, 1);
+		h = std::max(h / 2, 1);
+	}
+}
+
+bool TextureCache::isSupported()
+{
+	return GLEW_EXT_texture_compression_s3tc;
+}
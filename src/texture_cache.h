@@ -0,0 +1,48 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+struct Image;
+
+/*
+ * TextureCache: BC1 compressed copies of a model's textures, kept in one
+ * file next to the model.
+ *
+ * Entries are keyed by the hash of the source file, so an edited texture
+ * is compressed again and an unchanged one is never decoded: load() fills
+ * Image::compressed and leaves Image::bytes empty. Use load() as the
+ * MMDReader image loader, then save() to write back new entries.
+ */
+class TextureCache {
+public:
+	TextureCache(const std::string& path);
+
+	// load: safe to call from several threads
+	bool load(const std::string& fn, Image& image);
+	void save();
+
+	// compress: fill image.compressed with the BC1 mip chain of image.bytes
+	static void compress(Image& image);
+	// isSupported: the GL context can sample BC1 textures
+	static bool isSupported();
+private:
+	struct Entry {
+		int width = 0;
+		int height = 0;
+		std::vector<std::vector<unsigned char>> levels;
+	};
+
+	std::string path_;
+	std::map<uint64_t, Entry> entries_;
+	std::set<uint64_t> used_;      // entries still referenced by the model
+	bool dirty_ = false;
+	std::mutex mutex_;
+};
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef TEXTURE_TO_RENDER_H
 #define TEXTURE_TO_RENDER_H
 
+#include <cstddef>
+
 class TextureToRender {
 public:
 	TextureToRender();
@@ -9,8 +11,10 @@ public:
 	void bind();
 	void unbind();
 	int getTexture() const { return tex_; }
+	// getBytes: color and depth memory, drivers pad both to 4 bytes a pixel
+	size_t getBytes() const { return size_t(w_) * h_ * 8; }
 private:
-	int w_, h_;
+	int w_ = 0, h_ = 0;
 	unsigned int fb_ = -1;
 	unsigned int tex_ = -1;
 	unsigned int dep_ = -1;